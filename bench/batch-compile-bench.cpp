@@ -0,0 +1,106 @@
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lua-wrapper/lua-batch-compile.hpp"
+
+/*
+ * bytecode::compile_batch over a generated script set with 1..N worker
+ * threads; N defaults to hardware_concurrency.
+ *
+ *  batch_compile_bench [scripts] [functions per script] [max threads]
+ */
+
+namespace {
+
+    typedef std::chrono::steady_clock clock_type;
+
+    namespace bc = lua::bytecode;
+
+    std::string make_script( size_t id, size_t functions )
+    {
+        std::string res = "local M = { }\n";
+        for( size_t i = 0; i < functions; ++i ) {
+            const std::string n = std::to_string( i );
+            res += "function M.f" + n + "( t, k )\n"
+                   "    local acc = " + std::to_string( id ) + "\n"
+                   "    for i = 1, #t do\n"
+                   "        if t[i] > k then acc = acc + t[i] * " + n + "\n"
+                   "        else acc = acc - string.format( '%d', i ):len( ) end\n"
+                   "    end\n"
+                   "    return { value = acc, name = 'f" + n + "' }\n"
+                   "end\n";
+        }
+        res += "return M\n";
+        return res;
+    }
+
+    double run( const std::vector<bc::compile_unit> &units, unsigned threads )
+    {
+        bc::batch_options opts;
+        opts.threads = threads;
+        clock_type::time_point start = clock_type::now( );
+        std::vector<bc::compile_result> res = bc::compile_batch( units, opts );
+        clock_type::time_point stop = clock_type::now( );
+        for( size_t i = 0; i < res.size( ); ++i ) {
+            if( res[i].status != LUA_OK ) {
+                throw std::runtime_error( res[i].error );
+            }
+        }
+        std::chrono::duration<double, std::milli> ms( stop - start );
+        return ms.count( );
+    }
+}
+
+int main( int argc, const char **argv )
+{ try {
+
+    const size_t   scripts   = argc > 1 ? std::strtoul( argv[1], nullptr, 10 )
+                                        : 2000;
+    const size_t   functions = argc > 2 ? std::strtoul( argv[2], nullptr, 10 )
+                                        : 20;
+    unsigned       max_threads = argc > 3 ? std::atoi( argv[3] )
+                                          : std::thread::hardware_concurrency( );
+    if( max_threads == 0 ) {
+        max_threads = 1;
+    }
+
+    std::vector<bc::compile_unit> units;
+    size_t bytes = 0;
+    for( size_t i = 0; i < scripts; ++i ) {
+        units.push_back( bc::compile_unit::source(
+                            "=script" + std::to_string( i ),
+                            make_script( i, functions ) ) );
+        bytes += units.back( ).text.size( );
+    }
+
+    std::cout << "scripts: " << scripts << ", source: "
+              << bytes / 1024 << " KB\n\n";
+    std::cout << std::setw( 8 ) << "threads" << std::setw( 12 ) << "ms"
+              << std::setw( 10 ) << "speedup" << "\n";
+
+    run( units, 1 ); /// warm up the allocator and the page cache
+    const double base = run( units, 1 );
+    for( unsigned t = 1; t <= max_threads; t *= 2 ) {
+        const double ms = ( t == 1 ) ? base : run( units, t );
+        std::cout << std::setw( 8 ) << t
+                  << std::fixed << std::setprecision( 1 )
+                  << std::setw( 12 ) << ms
+                  << std::setprecision( 2 )
+                  << std::setw( 10 ) << base / ms << "\n";
+        if( t < max_threads && t * 2 > max_threads ) {
+            t = max_threads / 2;
+        }
+    }
+
+    return 0;
+
+} catch( const std::exception &ex ) {
+    std::cerr << "Error: " << ex.what( ) << "\n";
+    return 1;
+}}
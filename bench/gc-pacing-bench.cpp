@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include <stdint.h>
+
+#include "lua-wrapper/lua-wrapper.hpp"
+#include "lua-wrapper/lua-gc.hpp"
+
+/*
+ * Request latency with the collector left to itself vs with
+ * gc_step_for( budget ) in the idle time between requests. A request
+ * builds and drops a few hundred small tables; a slice of them is kept
+ * in a rolling cache so the heap has live data to mark. A gc::telemetry
+ * counts the cycles; the ones that end during a request are the ones
+ * that cost it latency.
+ *
+ *  gc_pacing_bench [requests] [budget_us]
+ */
+
+namespace {
+
+    typedef std::chrono::steady_clock clock_type;
+
+    const char *request_chunk =
+        "cache = { } "
+        "local slot = 0 "
+        "function request( n ) "
+        "  local res = 0 "
+        "  for i = 1, n do "
+        "    local t = { id = i, name = 'item' .. i, tags = { i, i + 1 } } "
+        "    res = res + #t.name "
+        "    if i % 16 == 0 then "
+        "      slot = slot % 20000 + 1 "
+        "      cache[slot] = t "
+        "    end "
+        "  end "
+        "  return res "
+        "end";
+
+    struct result {
+        double   p50;
+        double   p99;
+        double   max;
+        double   idle_us;
+        uint64_t request_cycles;
+        uint64_t idle_cycles;
+    };
+
+    result run( size_t requests, long budget_us )
+    {
+        lua::state ls;
+        ls.openlibs( );
+        if( luaL_dostring( ls.get_state( ), request_chunk ) != LUA_OK ) {
+            throw std::runtime_error( ls.pop_error( ) );
+        }
+
+        lua::gc::telemetry telemetry( ls.get_state( ) );
+        telemetry.start( );
+
+        std::vector<double> times;
+        times.reserve( requests );
+        result res = { 0, 0, 0, 0, 0, 0 };
+        for( size_t i = 0; i < requests; ++i ) {
+            const uint64_t cycles = telemetry.get( ).collections;
+            clock_type::time_point start = clock_type::now( );
+            ls.check_call_error( ls.exec_function( "request", 400 ) );
+            ls.clean_stack( );
+            std::chrono::duration<double, std::micro> us( clock_type::now( )
+                                                        - start );
+            times.push_back( us.count( ) );
+            res.request_cycles += telemetry.get( ).collections - cycles;
+            if( budget_us > 0 ) {
+                const uint64_t before = telemetry.get( ).collections;
+                lua::gc::step_report r = ls.gc_step_for(
+                            std::chrono::microseconds( budget_us ) );
+                res.idle_us     += static_cast<double>(r.elapsed.count( ));
+                res.idle_cycles += telemetry.get( ).collections - before;
+            }
+        }
+        telemetry.stop( );
+        std::sort( times.begin( ), times.end( ) );
+        res.p50 = times[times.size( ) / 2];
+        res.p99 = times[times.size( ) * 99 / 100];
+        res.max = times.back( );
+        res.idle_us /= static_cast<double>(requests);
+        return res;
+    }
+
+    void report( const char *name, const result &r )
+    {
+        std::cout << std::left  << std::setw( 16 ) << name
+                  << std::right << std::fixed << std::setprecision( 1 )
+                  << std::setw( 10 ) << r.p50
+                  << std::setw( 10 ) << r.p99
+                  << std::setw( 10 ) << r.max
+                  << std::setw( 12 ) << r.idle_us
+                  << std::setw( 14 ) << r.request_cycles
+                  << std::setw( 12 ) << r.idle_cycles << "\n";
+    }
+}
+
+int main( int argc, const char **argv )
+{ try {
+
+    const size_t requests = argc > 1 ? std::strtoul( argv[1], nullptr, 10 )
+                                     : 20000;
+    const long budget = argc > 2 ? std::strtol( argv[2], nullptr, 10 )
+                                 : 1000;
+
+    std::cout << "requests: " << requests
+              << ", idle budget: " << budget << " us\n\n";
+    std::cout << std::left  << std::setw( 16 ) << "mode"
+              << std::right << std::setw( 10 ) << "p50 us"
+              << std::setw( 10 ) << "p99 us"
+              << std::setw( 10 ) << "max us"
+              << std::setw( 12 ) << "idle us"
+              << std::setw( 14 ) << "req. cycles"
+              << std::setw( 12 ) << "idle cycles" << "\n";
+
+    report( "in requests", run( requests, 0 ) );
+    report( "gc_step_for", run( requests, budget ) );
+
+    return 0;
+
+} catch( const std::exception &ex ) {
+    std::cerr << "Error: " << ex.what( ) << "\n";
+    return 1;
+}}
@@ -0,0 +1,88 @@
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+#include "lua-wrapper/lua-wrapper.hpp"
+
+/*
+ * Per-state startup: a new state with openlibs( ) vs openlibs_lazy( ),
+ * then a small sandbox-style chunk that only uses string and table.
+ * Memory is what the state holds after the chunk ran.
+ *
+ *  lazy_libs_bench [states]
+ */
+
+namespace {
+
+    typedef std::chrono::steady_clock clock_type;
+
+    const char *sandbox_chunk =
+        "local t = { } "
+        "for i = 1, 10 do t[#t + 1] = string.format( '%d', i ) end "
+        "return table.concat( t, ',' )";
+
+    struct result {
+        double ns;
+        double kb;
+    };
+
+    template <typename Open>
+    result run( size_t states, Open open )
+    {
+        result res = { 0, 0 };
+        clock_type::time_point start = clock_type::now( );
+        for( size_t i = 0; i < states; ++i ) {
+            lua::state ls;
+            open( ls );
+            lua_State *L = ls.get_state( );
+            if( luaL_loadstring( L, sandbox_chunk ) != LUA_OK ) {
+                throw std::runtime_error( ls.pop_error( ) );
+            }
+            ls.check_call_error( lua_pcall( L, 0, 0, 0 ) );
+            if( i == 0 ) {
+                lua_gc( L, LUA_GCCOLLECT, 0 );
+                res.kb = lua_gc( L, LUA_GCCOUNT, 0 )
+                       + lua_gc( L, LUA_GCCOUNTB, 0 ) / 1024.0;
+            }
+        }
+        clock_type::time_point stop = clock_type::now( );
+        std::chrono::duration<double, std::nano> ns( stop - start );
+        res.ns = ns.count( ) / static_cast<double>(states);
+        return res;
+    }
+
+    void report( const char *name, const result &r )
+    {
+        std::cout << std::left  << std::setw( 16 ) << name
+                  << std::right << std::fixed << std::setprecision( 1 )
+                  << std::setw( 12 ) << r.ns / 1000.0
+                  << std::setw( 12 ) << r.kb << "\n";
+    }
+}
+
+int main( int argc, const char **argv )
+{ try {
+
+    const size_t states = argc > 1 ? std::strtoul( argv[1], nullptr, 10 )
+                                   : 20000;
+
+    std::cout << "states: " << states << "\n\n";
+    std::cout << std::left  << std::setw( 16 ) << "mode"
+              << std::right << std::setw( 12 ) << "us/state"
+              << std::setw( 12 ) << "KB/state" << "\n";
+
+    report( "openlibs", run( states, []( lua::state &ls ) {
+                ls.openlibs( );
+            } ) );
+    report( "openlibs_lazy", run( states, []( lua::state &ls ) {
+                ls.openlibs_lazy( );
+            } ) );
+
+    return 0;
+
+} catch( const std::exception &ex ) {
+    std::cerr << "Error: " << ex.what( ) << "\n";
+    return 1;
+}}
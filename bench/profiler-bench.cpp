@@ -0,0 +1,133 @@
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+#include <stdint.h>
+
+#include "lua-wrapper/lua-wrapper.hpp"
+#include "lua-wrapper/lua-profiler.hpp"
+
+/*
+ * Profiler overhead: the same CPU-bound Lua work with no sampler, with
+ * count-hook sampling and with timer sampling at a few periods. The
+ * modes take turns within each round and the best round of each is
+ * reported, so a noisy machine skews them alike.
+ *
+ *  profiler_bench [iterations] [rounds]
+ */
+
+namespace {
+
+    typedef std::chrono::steady_clock clock_type;
+
+    const char *work_chunk =
+        "local function leaf( n ) "
+        "  local s = 0 for i = 1, n do s = s + i % 7 end return s "
+        "end "
+        "local function mid( n ) return leaf( n ) + #tostring( n ) end "
+        "function work( k ) "
+        "  local r = 0 for i = 1, k do r = r + mid( 1000 ) end return r "
+        "end";
+
+    struct mode {
+        const char                 *name;
+        bool                        profiled;
+        lua::profiler::sample_mode  sampling;
+        unsigned                    period;
+        double                      best;
+        uint64_t                    samples;
+    };
+
+    double run( lua::state &ls, size_t iterations )
+    {
+        clock_type::time_point start = clock_type::now( );
+        ls.check_call_error( ls.exec_function( "work", iterations ) );
+        ls.clean_stack( );
+        std::chrono::duration<double, std::milli> ms( clock_type::now( )
+                                                    - start );
+        return ms.count( );
+    }
+
+    void measure( lua::state &ls, size_t iterations, mode &m )
+    {
+        double ms = 0;
+        uint64_t samples = 0;
+        if( m.profiled ) {
+            lua::profiler::options opts;
+            opts.mode   = m.sampling;
+            opts.period = m.period;
+            lua::profiler::sampler s( ls.get_state( ), opts );
+            s.start( );
+            ms = run( ls, iterations );
+            s.stop( );
+            s.collect( );
+            samples = s.samples( );
+        } else {
+            ms = run( ls, iterations );
+        }
+        if( m.best == 0 || ms < m.best ) {
+            m.best    = ms;
+            m.samples = samples;
+        }
+    }
+
+    void report( const mode &m, double base )
+    {
+        std::cout << std::left  << std::setw( 20 ) << m.name
+                  << std::right << std::fixed << std::setprecision( 1 )
+                  << std::setw( 10 ) << m.best
+                  << std::setw( 10 ) << ( m.best / base - 1.0 ) * 100.0
+                  << std::setw( 10 ) << m.samples << "\n";
+    }
+}
+
+int main( int argc, const char **argv )
+{ try {
+
+    const size_t iterations = argc > 1 ? std::strtoul( argv[1], nullptr, 10 )
+                                       : 20000;
+    const size_t rounds     = argc > 2 ? std::strtoul( argv[2], nullptr, 10 )
+                                       : 5;
+
+    lua::state ls;
+    ls.openlibs( );
+    if( luaL_dostring( ls.get_state( ), work_chunk ) != LUA_OK ) {
+        throw std::runtime_error( ls.pop_error( ) );
+    }
+
+    using lua::profiler::SAMPLE_COUNT;
+    using lua::profiler::SAMPLE_TIMER;
+    mode modes[] = {
+         { "off",          false, SAMPLE_COUNT, 0,      0, 0 }
+        ,{ "count 1000",   true,  SAMPLE_COUNT, 1000,   0, 0 }
+        ,{ "count 100000", true,  SAMPLE_COUNT, 100000, 0, 0 }
+        ,{ "timer 100us",  true,  SAMPLE_TIMER, 100,    0, 0 }
+        ,{ "timer 1ms",    true,  SAMPLE_TIMER, 1000,   0, 0 }
+        ,{ "timer 10ms",   true,  SAMPLE_TIMER, 10000,  0, 0 }
+    };
+
+    std::cout << "iterations: " << iterations
+              << ", best of " << rounds << " rounds\n\n";
+    std::cout << std::left  << std::setw( 20 ) << "mode"
+              << std::right << std::setw( 10 ) << "ms"
+              << std::setw( 10 ) << "+%"
+              << std::setw( 10 ) << "samples" << "\n";
+
+    run( ls, iterations / 10 );
+    for( size_t r = 0; r < rounds; ++r ) {
+        for( mode &m: modes ) {
+            measure( ls, iterations, m );
+        }
+    }
+    for( const mode &m: modes ) {
+        report( m, modes[0].best );
+    }
+
+    return 0;
+
+} catch( const std::exception &ex ) {
+    std::cerr << "Error: " << ex.what( ) << "\n";
+    return 1;
+}}
@@ -0,0 +1,128 @@
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lua-wrapper/lua-wrapper.hpp"
+#include "lua-wrapper/lua-typed-array.hpp"
+
+/*
+ * typed_array kernels vs the same operation written as a Lua loop
+ * over a plain table.
+ *
+ *  typed_array_bench [elements] [repeats]
+ */
+
+namespace {
+
+    typedef std::chrono::steady_clock clock_type;
+
+    double run_chunk( lua::state &ls, const char *code, int repeats )
+    {
+        lua_State *L = ls.get_state( );
+        if( luaL_loadstring( L, code ) != LUA_OK ) {
+            throw std::runtime_error( ls.pop_error( ) );
+        }
+        clock_type::time_point start = clock_type::now( );
+        for( int i = 0; i < repeats; ++i ) {
+            lua_pushvalue( L, -1 );
+            ls.check_call_error( lua_pcall( L, 0, 0, 0 ) );
+        }
+        clock_type::time_point stop = clock_type::now( );
+        ls.pop( );
+        std::chrono::duration<double, std::milli> ms( stop - start );
+        return ms.count( ) / repeats;
+    }
+
+    struct bench_case {
+        const char *name;
+        const char *lua_loop;
+        const char *kernel;
+    };
+
+}
+
+int main( int argc, const char **argv )
+{ try {
+
+    const size_t count   = argc > 1 ? std::strtoul( argv[1], nullptr, 10 )
+                                    : 1000000;
+    const int    repeats = argc > 2 ? std::atoi( argv[2] ) : 20;
+
+    lua::state ls;
+    ls.openlibs( );
+    ls.openlib( "typed_array", &lua::luaopen_typed_array );
+
+    std::vector<double> host_a( count );
+    std::vector<double> host_b( count );
+    for( size_t i = 0; i < count; ++i ) {
+        host_a[i] = static_cast<double>( (i * 7919) % 1000 ) / 10.0;
+        host_b[i] = static_cast<double>( i % 10 );
+    }
+
+    lua::float64_array::wrap( ls.get_state( ), host_a.data( ), count );
+    ls.set_value( "a" );
+    ls.pop( );
+    lua::float64_array::wrap( ls.get_state( ), host_b.data( ), count );
+    ls.set_value( "b" );
+    ls.pop( );
+
+    ls.check_call_error( luaL_dostring( ls.get_state( ),
+                                        "ta = a:to_table( ) tb = b:to_table( )" ) );
+
+    static const bench_case cases[ ] = {
+        { "sum",
+          "local s = 0 for i = 1, #ta do s = s + ta[i] end",
+          "local s = a:sum( )" },
+        { "min/max",
+          "local mn, mx = ta[1], ta[1] "
+          "for i = 2, #ta do local v = ta[i] "
+          "if v < mn then mn = v end if v > mx then mx = v end end",
+          "local mn, mx = a:min( ), a:max( )" },
+        { "dot",
+          "local s = 0 for i = 1, #ta do s = s + ta[i] * tb[i] end",
+          "local s = a:dot( b )" },
+        { "scale",
+          "for i = 1, #ta do ta[i] = ta[i] * 1.0000001 end",
+          "a:scale( 1.0000001 )" },
+        { "add",
+          "for i = 1, #ta do ta[i] = ta[i] + 0.5 * tb[i] end",
+          "a:add( b, 0.5 )" },
+        { "threshold",
+          "for i = 1, #ta do ta[i] = ta[i] >= 50 and 1 or 0 end",
+          "a:threshold( 50 )" },
+        { "sum (a[i] loop)",
+          "local s = 0 for i = 1, #ta do s = s + ta[i] end",
+          "local s = 0 for i = 1, #a do s = s + a[i] end" },
+    };
+
+    std::cout << "elements: " << count
+              << ", repeats: " << repeats
+              << ", isa: " << lua::simd::isa_name( lua::simd::current_isa( ) )
+              << "\n\n";
+
+    std::cout << std::left  << std::setw( 18 ) << "operation"
+              << std::right << std::setw( 14 ) << "lua loop, ms"
+              << std::setw( 14 ) << "array, ms"
+              << std::setw( 10 ) << "speedup" << "\n";
+
+    for( const bench_case &c: cases ) {
+        double loop   = run_chunk( ls, c.lua_loop, repeats );
+        double kernel = run_chunk( ls, c.kernel,   repeats );
+        std::cout << std::left  << std::setw( 18 ) << c.name
+                  << std::right << std::fixed << std::setprecision( 3 )
+                  << std::setw( 14 ) << loop
+                  << std::setw( 14 ) << kernel
+                  << std::setprecision( 1 )
+                  << std::setw( 9 ) << ( loop / kernel ) << "x\n";
+    }
+
+    return 0;
+
+} catch( const std::exception &ex ) {
+    std::cerr << "Error: " << ex.what( ) << "\n";
+    return 1;
+}}
@@ -0,0 +1,167 @@
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lua-wrapper/lua-wrapper.hpp"
+
+/*
+ * Short-lived userdata created from scripts, the test_meta pattern from
+ * main.cpp: a C function creates the object, a method reads it back and
+ * the collector finalizes it. Each payload runs with the default layout
+ * and with the userdata policies from lua-userdata.hpp. The types take
+ * turns, round after round, and each reports its best round.
+ *
+ *  userdata_policy_bench [objects] [rounds]
+ */
+
+namespace {
+
+    typedef std::chrono::steady_clock clock_type;
+
+    namespace ud = lua::userdata;
+
+    /// test_meta: one std::string
+    struct message {
+        std::string messge;
+        explicit message( const char *m )
+            :messge(m)
+        { }
+        size_t size( ) const { return messge.size( ); }
+    };
+
+    /// small and trivially destructible
+    struct point {
+        double x;
+        double y;
+        explicit point( const char *m )
+            :x(static_cast<double>(m[0]))
+            ,y(0)
+        { }
+        size_t size( ) const { return 2; }
+    };
+
+    template <typename Payload, typename Policy, int Id>
+    struct bench_object: public Payload {
+
+        typedef Policy userdata_policy;
+
+        explicit bench_object( const char *m )
+            :Payload(m)
+        { }
+
+        static const char *name( )
+        {
+            static const char *names[ ] = {
+                "bench.message",
+                "bench.point",          "bench.point_no_gc",
+            };
+            return names[Id];
+        }
+
+        static int lcall_new( lua_State *L )
+        {
+            lua::state::create_metatable<bench_object>(
+                        L, luaL_optstring( L, 1, "message" ) );
+            return 1;
+        }
+
+        static int lcall_size( lua_State *L )
+        {
+            bench_object *self = lua::state::check_metatable<bench_object>( L );
+            lua_pushinteger( L, static_cast<lua_Integer>(self->size( )) );
+            return 1;
+        }
+
+        static const struct luaL_Reg *table( )
+        {
+            static const struct luaL_Reg lib[ ] = {
+                { "size",   &lcall_size },
+                { nullptr,  nullptr     },
+            };
+            return lib;
+        }
+    };
+
+    typedef bench_object<message, ud::inline_value, 0> message_value;
+    typedef bench_object<point,   ud::inline_value, 1> point_value;
+    typedef bench_object<point,   ud::no_finalizer, 2> point_no_gc;
+
+    /// ns per object for one round
+    template <typename T>
+    double run( lua::state &ls, size_t count )
+    {
+        lua_State *L = ls.get_state( );
+        const char *code =
+            "local new, n = ... "
+            "for i = 1, n do local o = new( 'message' ) o:size( ) end "
+            "collectgarbage( ) collectgarbage( )";
+        if( luaL_loadstring( L, code ) != LUA_OK ) {
+            throw std::runtime_error( ls.pop_error( ) );
+        }
+
+        clock_type::time_point start = clock_type::now( );
+        lua_pushcfunction( L, &T::lcall_new );
+        lua_pushinteger( L, static_cast<lua_Integer>(count) );
+        ls.check_call_error( lua_pcall( L, 2, 0, 0 ) );
+        clock_type::time_point stop = clock_type::now( );
+
+        std::chrono::duration<double, std::nano> ns( stop - start );
+        return ns.count( ) / static_cast<double>(count);
+    }
+
+    template <typename T>
+    void best_of( lua::state &ls, size_t count, double &best )
+    {
+        const double ns = run<T>( ls, count );
+        if( best == 0 || ns < best ) {
+            best = ns;
+        }
+    }
+
+    void report( const char *name, double ns )
+    {
+        std::cout << std::left  << std::setw( 24 ) << name
+                  << std::right << std::fixed << std::setprecision( 1 )
+                  << std::setw( 10 ) << ns << "\n";
+    }
+
+}
+
+int main( int argc, const char **argv )
+{ try {
+
+    const size_t count   = argc > 1 ? std::strtoul( argv[1], nullptr, 10 )
+                                    : 200000;
+    const int    rounds  = argc > 2 ? std::atoi( argv[2] ) : 10;
+
+    lua::state ls;
+    ls.openlibs( );
+    ls.register_metatable<message_value>( );
+    ls.register_metatable<point_value>( );
+    ls.register_metatable<point_no_gc>( );
+    ls.clean_stack( );
+
+    std::cout << "objects: " << count << ", rounds: " << rounds << "\n\n";
+    std::cout << std::left  << std::setw( 24 ) << "type"
+              << std::right << std::setw( 10 ) << "ns/object" << "\n";
+
+    std::vector<double> best( 3, 0.0 );
+    for( int i = 0; i < rounds; ++i ) {
+        best_of<message_value>( ls, count, best[0] );
+        best_of<point_value>( ls, count, best[1] );
+        best_of<point_no_gc>( ls, count, best[2] );
+    }
+    report( message_value::name( ), best[0] );
+    report( point_value::name( ), best[1] );
+    report( point_no_gc::name( ), best[2] );
+
+    return 0;
+
+} catch( const std::exception &ex ) {
+    std::cerr << "Error: " << ex.what( ) << "\n";
+    return 1;
+}}
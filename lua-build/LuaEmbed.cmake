@@ -0,0 +1,57 @@
+# Precompiled Lua scripts linked into a target, see lua-wrapper/lua-embedded.hpp
+#
+#  lua_embed_scripts( <target> <bundle>
+#                     [STRIP]
+#                     [BASE_DIR <dir>]
+#                     SCRIPTS <file.lua> ... )
+#
+# Compiles SCRIPTS with lua_embed (built from lua-build/embed against
+# lua_lib, so the bytecode matches the Lua the target runs) into
+# ${CMAKE_CURRENT_BINARY_DIR}/<bundle>-embedded.cpp and adds it to
+# <target>. Each script is registered under its path relative to
+# BASE_DIR (default: the current source dir) and loaded with
+# state::load_embedded( "<relative path>" ). STRIP drops debug info.
+
+include( CMakeParseArguments )
+
+set( LUA_EMBED_WRAPPER_DIR ${CMAKE_CURRENT_LIST_DIR}/..
+     CACHE INTERNAL "Directory that contains lua-wrapper/" )
+
+function( lua_embed_scripts target bundle )
+
+    cmake_parse_arguments( embed "STRIP" "BASE_DIR" "SCRIPTS" ${ARGN} )
+
+    if( NOT embed_BASE_DIR )
+        set( embed_BASE_DIR ${CMAKE_CURRENT_SOURCE_DIR} )
+    endif( )
+    get_filename_component( base ${embed_BASE_DIR} ABSOLUTE )
+
+    set( output ${CMAKE_CURRENT_BINARY_DIR}/${bundle}-embedded.cpp )
+    set( args )
+    set( deps )
+
+    if( embed_STRIP )
+        list( APPEND args --strip )
+    endif( )
+    list( APPEND args ${output} )
+
+    foreach( script ${embed_SCRIPTS} )
+        get_filename_component( path ${script} ABSOLUTE )
+        file( RELATIVE_PATH name ${base} ${path} )
+        list( APPEND args "${name}=${path}" )
+        list( APPEND deps ${path} )
+    endforeach( )
+
+    add_custom_command( OUTPUT  ${output}
+                        COMMAND lua_embed ${args}
+                        DEPENDS lua_embed ${deps}
+                        COMMENT "Embedding Lua scripts into ${bundle}"
+                        VERBATIM )
+
+    # target properties rather than target_sources (CMake 3.1), so this
+    # works with the 2.8 minimum the project declares
+    set_property( TARGET ${target} APPEND PROPERTY SOURCES ${output} )
+    set_property( TARGET ${target} APPEND PROPERTY
+                  INCLUDE_DIRECTORIES ${LUA_EMBED_WRAPPER_DIR} )
+
+endfunction( )
@@ -0,0 +1,155 @@
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "lua-wrapper/lua-batch-compile.hpp"
+
+/*
+ * Build-time side of lua-embedded.hpp: compiles scripts with the Lua the
+ * project links against and writes their bytecode as a C++ source.
+ *
+ *  lua_embed [--strip] <output.cpp> <name>=<script.lua> ...
+ *
+ * name is what embedded::load_embedded( ) takes; it is also the chunk name,
+ * so errors read "name:line: ...". Scripts are compiled in parallel
+ * (bytecode::compile_batch).
+ */
+
+namespace {
+
+    namespace bc = lua::bytecode;
+
+    void append_quoted( std::string &out, const std::string &value )
+    {
+        out.push_back( '"' );
+        for( size_t i = 0; i < value.size( ); ++i ) {
+            if( value[i] == '"' || value[i] == '\\' ) {
+                out.push_back( '\\' );
+            }
+            out.push_back( value[i] );
+        }
+        out.push_back( '"' );
+    }
+
+    void append_bytes( std::string &out, const std::string &data )
+    {
+        static const char digits[ ] = "0123456789abcdef";
+        for( size_t i = 0; i < data.size( ); ++i ) {
+            const unsigned char c = static_cast<unsigned char>(data[i]);
+            out.append( ( i % 16 ) ? " 0x" : "\n        0x" );
+            out.push_back( digits[c >> 4] );
+            out.push_back( digits[c & 0xF] );
+            out.push_back( ',' );
+        }
+    }
+
+    bool write_file( const std::string &path, const std::string &data )
+    {
+        FILE *f = std::fopen( path.c_str( ), "wb" );
+        if( !f ) {
+            return false;
+        }
+        bool ok = std::fwrite( data.data( ), 1, data.size( ), f )
+                                                        == data.size( );
+        return ( std::fclose( f ) == 0 ) && ok;
+    }
+
+    int usage( )
+    {
+        std::cerr << "usage: lua_embed [--strip] <output.cpp> "
+                     "<name>=<script.lua> ...\n";
+        return 2;
+    }
+}
+
+int main( int argc, const char **argv )
+{
+    int first = 1;
+    bool strip = false;
+    if( first < argc && std::strcmp( argv[first], "--strip" ) == 0 ) {
+        strip = true;
+        ++first;
+    }
+    if( argc - first < 1 ) {
+        return usage( );
+    }
+    const std::string output = argv[first++];
+
+    std::vector<bc::compile_unit> units;
+    std::vector<std::string> names;
+    std::set<std::string> seen;
+    for( int i = first; i < argc; ++i ) {
+        const char *eq = std::strchr( argv[i], '=' );
+        if( !eq || eq == argv[i] || !eq[1] ) {
+            std::cerr << "lua_embed: expected name=path, got '"
+                      << argv[i] << "'\n";
+            return 2;
+        }
+        const std::string name( argv[i], eq );
+        if( !seen.insert( name ).second ) {
+            std::cerr << "lua_embed: duplicate name '" << name << "'\n";
+            return 1;
+        }
+        names.push_back( name );
+        units.push_back( bc::compile_unit::file( eq + 1, "@" + name ) );
+    }
+
+    bc::batch_options opts;
+    opts.strip = strip;
+    const std::vector<bc::compile_result> results =
+                                    bc::compile_batch( units, opts );
+
+    int res = 0;
+    for( size_t i = 0; i < results.size( ); ++i ) {
+        if( results[i].status != LUA_OK ) {
+            std::cerr << "lua_embed: " << results[i].error << "\n";
+            res = 1;
+        }
+    }
+    if( res != 0 ) {
+        return res;
+    }
+
+    std::string out;
+    out.append( "/* generated by lua_embed; do not edit */\n\n"
+                "#include \"lua-wrapper/lua-embedded.hpp\"\n\n"
+                "#ifdef LUA_WRAPPER_TOP_NAMESPACE\n"
+                "using namespace LUA_WRAPPER_TOP_NAMESPACE;\n"
+                "#endif\n\n"
+                "namespace {\n" );
+
+    std::string table;
+    for( size_t i = 0; i < results.size( ); ++i ) {
+        const std::string id = "chunk_" + std::to_string( i );
+        out.append( "\n    const unsigned char " + id + "[ ] = {" );
+        append_bytes( out, results[i].bytecode );
+        out.append( "\n    };\n" );
+
+        table.append( "        { " );
+        append_quoted( table, names[i] );
+        table.append( ", " + id + ", sizeof(" + id + ") },\n" );
+    }
+
+    if( names.empty( ) ) {
+        /// no zero-length arrays
+        out.append( "\n    const lua::embedded::registrar registered( "
+                    "nullptr, 0 );\n" );
+    } else {
+        out.append( "\n    const lua::embedded::chunk chunks[ ] = {\n" );
+        out.append( table );
+        out.append( "    };\n\n"
+                    "    const lua::embedded::registrar registered( chunks,\n"
+                    "                    sizeof(chunks) / sizeof(chunks[0]) );\n" );
+    }
+    out.append( "}\n" );
+
+    if( !write_file( output, out ) ) {
+        std::cerr << "lua_embed: cannot write " << output << "\n";
+        std::remove( output.c_str( ) );
+        return 1;
+    }
+    return 0;
+}
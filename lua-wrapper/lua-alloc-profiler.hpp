@@ -0,0 +1,403 @@
+#ifndef LUA_ALLOC_PROFILER_HPP
+#define LUA_ALLOC_PROFILER_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+extern "C" {
+#include "lualib.h"
+#include "lauxlib.h"
+#include "lua.h"
+}
+
+#include "lua-text-format.hpp"
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#endif
+
+/*
+ * Which Lua code holds a state's memory.
+ *
+ * alloc_sampler puts itself in front of the state's allocator
+ * (lua_getallocf/lua_setallocf; for a lua::state that is def_alloc)
+ * and samples new blocks: on average one per `interval` bytes, drawn
+ * at random so periodic allocation patterns do not alias. A sampled
+ * block is charged to the innermost Lua frame running at the time
+ * (function, source, line) with a weight of size / p bytes, p being
+ * the chance that a block of its size is sampled (so about `interval`
+ * for small blocks and its own size for large ones), and uncharged
+ * when Lua frees it; a sampled block that is reallocated keeps its
+ * site and scales its weight. snapshot( )
+ * reports the estimated live bytes and the bytes allocated per site;
+ * diff( after, before ) shows what grew in between.
+ *
+ * Limits:
+ *  - the stack walked is the one of the main thread: code running in a
+ *    coroutine is charged to the line that resumed it;
+ *  - only new blocks are sampled (table array parts and the Lua stack
+ *    grow by reallocation);
+ *  - the sampler must be stopped (or destroyed) before lua_close, and
+ *    lives on the thread that runs the state.
+ */
+namespace lua { namespace profiler {
+
+    struct alloc_site {
+        std::string function;   /// "main", "[C] name" or the Lua name
+        std::string source;     /// short_src; "[host]" outside Lua code
+        int         line         = 0;
+        int64_t     live_bytes   = 0;
+        int64_t     live_blocks  = 0;
+        int64_t     alloc_bytes  = 0;
+        int64_t     alloc_blocks = 0;
+    };
+
+    struct alloc_snapshot {
+
+        /// live_bytes descending
+        std::vector<alloc_site> sites;
+        int64_t                 live_bytes  = 0;
+        int64_t                 alloc_bytes = 0;
+
+        /// "live_bytes live_blocks alloc_bytes function@source:line"
+        void append_to( std::string &out, size_t max_sites = 0 ) const
+        {
+            size_t n = sites.size( );
+            if( max_sites && max_sites < n ) {
+                n = max_sites;
+            }
+            for( size_t i = 0; i < n; ++i ) {
+                const alloc_site &s = sites[i];
+                text::append_integer( out, s.live_bytes );
+                out.push_back( ' ' );
+                text::append_integer( out, s.live_blocks );
+                out.push_back( ' ' );
+                text::append_integer( out, s.alloc_bytes );
+                out.push_back( ' ' );
+                out.append( s.function );
+                out.push_back( '@' );
+                out.append( s.source );
+                if( s.line > 0 ) {
+                    out.push_back( ':' );
+                    text::append_integer( out, s.line );
+                }
+                out.push_back( '\n' );
+            }
+        }
+    };
+
+    namespace detail {
+
+        inline bool site_greater( const alloc_site &l, const alloc_site &r )
+        {
+            if( l.live_bytes != r.live_bytes ) {
+                return l.live_bytes > r.live_bytes;
+            }
+            return l.alloc_bytes > r.alloc_bytes;
+        }
+
+        inline std::string site_key( const alloc_site &s )
+        {
+            std::string res( s.source );
+            res.push_back( '\n' );
+            text::append_integer( res, s.line );
+            res.push_back( '\n' );
+            res.append( s.function );
+            return res;
+        }
+    }
+
+    /*
+     * after - before, site by site; sites that did not change are left
+     * out. With two snapshots of a steady workload the sites on top are
+     * the ones that keep memory.
+     */
+    inline alloc_snapshot diff( const alloc_snapshot &after,
+                                const alloc_snapshot &before )
+    {
+        std::map<std::string, alloc_site> sites;
+        for( size_t i = 0; i < after.sites.size( ); ++i ) {
+            sites[detail::site_key( after.sites[i] )] = after.sites[i];
+        }
+        for( size_t i = 0; i < before.sites.size( ); ++i ) {
+            const alloc_site &b = before.sites[i];
+            std::pair<std::map<std::string, alloc_site>::iterator, bool> it =
+                    sites.insert( std::make_pair( detail::site_key( b ), b ) );
+            alloc_site &s = it.first->second;
+            if( it.second ) {
+                s.live_bytes = s.live_blocks = 0;
+                s.alloc_bytes = s.alloc_blocks = 0;
+            }
+            s.live_bytes   -= b.live_bytes;
+            s.live_blocks  -= b.live_blocks;
+            s.alloc_bytes  -= b.alloc_bytes;
+            s.alloc_blocks -= b.alloc_blocks;
+        }
+
+        alloc_snapshot res;
+        res.live_bytes  = after.live_bytes - before.live_bytes;
+        res.alloc_bytes = after.alloc_bytes - before.alloc_bytes;
+        for( std::map<std::string, alloc_site>::iterator it = sites.begin( );
+             it != sites.end( ); ++it )
+        {
+            const alloc_site &s = it->second;
+            if( s.live_bytes || s.live_blocks
+             || s.alloc_bytes || s.alloc_blocks )
+            {
+                res.sites.push_back( s );
+            }
+        }
+        std::sort( res.sites.begin( ), res.sites.end( ),
+                   &detail::site_greater );
+        return res;
+    }
+
+    class alloc_sampler {
+
+        struct block {
+            uint32_t site;
+            size_t   size;
+            size_t   weight;
+        };
+
+    public:
+
+        explicit alloc_sampler( lua_State *L, size_t interval = 512 * 1024 )
+            :L_(L)
+            ,interval_(interval ? interval : 1)
+            ,next_alloc_f_(nullptr)
+            ,next_ud_(nullptr)
+            ,running_(false)
+            ,random_(static_cast<unsigned>(
+                        reinterpret_cast<uintptr_t>(this) ))
+            ,countdown_(0)
+        { }
+
+        alloc_sampler( const alloc_sampler & ) = delete;
+        alloc_sampler &operator = ( const alloc_sampler & ) = delete;
+
+        ~alloc_sampler( )
+        {
+            stop( );
+        }
+
+        void start( )
+        {
+            if( running_ ) {
+                return;
+            }
+            next_alloc_f_ = lua_getallocf( L_, &next_ud_ );
+            lua_setallocf( L_, &lcall_alloc, this );
+            countdown_ = next_countdown( );
+            running_   = true;
+        }
+
+        /// blocks sampled so far stay charged to their sites
+        void stop( )
+        {
+            if( !running_ ) {
+                return;
+            }
+            lua_setallocf( L_, next_alloc_f_, next_ud_ );
+            running_ = false;
+            blocks_.clear( );
+        }
+
+        bool running( ) const
+        {
+            return running_;
+        }
+
+        size_t interval( ) const
+        {
+            return interval_;
+        }
+
+        alloc_snapshot snapshot( ) const
+        {
+            alloc_snapshot res;
+            res.sites.reserve( sites_.size( ) );
+            for( size_t i = 0; i < sites_.size( ); ++i ) {
+                const alloc_site &s = sites_[i];
+                if( s.live_blocks || s.alloc_blocks ) {
+                    res.sites.push_back( s );
+                    res.live_bytes  += s.live_bytes;
+                    res.alloc_bytes += s.alloc_bytes;
+                }
+            }
+            std::sort( res.sites.begin( ), res.sites.end( ),
+                       &detail::site_greater );
+            return res;
+        }
+
+        /// forgets the allocation totals; live blocks stay tracked
+        void reset_totals( )
+        {
+            for( size_t i = 0; i < sites_.size( ); ++i ) {
+                sites_[i].alloc_bytes  = 0;
+                sites_[i].alloc_blocks = 0;
+            }
+        }
+
+    private:
+
+        size_t next_countdown( )
+        {
+            std::exponential_distribution<double> dist(
+                                    1.0 / static_cast<double>(interval_) );
+            const double res = dist( random_ );
+            return res < 1.0 ? 1 : static_cast<size_t>(res);
+        }
+
+        /// sites are keyed by what they report, as in diff( ): the
+        /// ar.source and ar.name strings can be collected and their
+        /// addresses reused by other functions
+        uint32_t site_of( lua_State *L )
+        {
+            lua_Debug ar;
+            alloc_site site;
+            const char *c_name = nullptr;
+            bool found = false;
+            for( int level = 0; lua_getstack( L, level, &ar ); ++level ) {
+                lua_getinfo( L, "Sln", &ar );
+                if( ar.currentline > 0 ) {
+                    found = true;
+                    break;
+                }
+                if( level == 0 && ar.what && ar.what[0] == 'C' ) {
+                    c_name = ar.name;
+                }
+            }
+            if( !found ) {
+                /// the host (or a C function called by it) allocates
+                site.function = c_name ? std::string( "[C] " ) + c_name
+                                       : std::string( "?" );
+                site.source   = "[host]";
+            } else {
+                if( ar.what && ar.what[0] == 'm' ) {
+                    site.function = "main";
+                } else {
+                    site.function = ar.name ? ar.name : "?";
+                }
+                site.source = ar.short_src;
+                site.line   = ar.currentline;
+            }
+
+            std::string key = detail::site_key( site );
+            site_ids::const_iterator it = ids_.find( key );
+            if( it != ids_.end( ) ) {
+                return it->second;
+            }
+            const uint32_t id = static_cast<uint32_t>(sites_.size( ));
+            sites_.push_back( site );
+            ids_.insert( std::make_pair( std::move( key ), id ) );
+            return id;
+        }
+
+        void sample( void *ptr, size_t size )
+        {
+            const uint32_t id = site_of( L_ );
+            /// a block is sampled with p = 1 - exp( -size / interval );
+            /// size / p keeps the estimate unbiased for every size
+            const double ratio = static_cast<double>(size)
+                               / static_cast<double>(interval_);
+            const size_t weight = size ? static_cast<size_t>(
+                        static_cast<double>(size) / -std::expm1( -ratio )
+                        + 0.5 ) : interval_;
+            block b = { id, size, weight };
+            blocks_[ptr] = b;
+            alloc_site &s = sites_[id];
+            s.live_bytes   += static_cast<int64_t>(weight);
+            s.alloc_bytes  += static_cast<int64_t>(weight);
+            ++s.live_blocks;
+            ++s.alloc_blocks;
+        }
+
+        void *alloc( void *ptr, size_t old_size, size_t new_size )
+        {
+            void *res = next_alloc_f_( next_ud_, ptr, old_size, new_size );
+
+            if( ptr && !blocks_.empty( ) ) {
+                block_map::iterator it = blocks_.find( ptr );
+                if( it != blocks_.end( ) && ( res || new_size == 0 ) ) {
+                    block b = it->second;
+                    blocks_.erase( it );
+                    alloc_site &s = sites_[b.site];
+                    s.live_bytes -= static_cast<int64_t>(b.weight);
+                    --s.live_blocks;
+                    if( new_size ) {
+                        /// reallocated: same site, weight scaled
+                        b.weight = b.size ? static_cast<size_t>(
+                                   static_cast<double>(b.weight) * new_size
+                                   / static_cast<double>(b.size) )
+                                          : b.weight;
+                        b.size = new_size;
+                        s.live_bytes += static_cast<int64_t>(b.weight);
+                        ++s.live_blocks;
+                        try {
+                            blocks_[res] = b;
+                        } catch( ... ) {
+                            s.live_bytes -= static_cast<int64_t>(b.weight);
+                            --s.live_blocks;
+                        }
+                    }
+                }
+                return res;
+            }
+
+            /// a new block (ptr is null, old_size is the Lua type)
+            if( !ptr && res ) {
+                if( new_size < countdown_ ) {
+                    countdown_ -= new_size;
+                } else {
+                    countdown_ = next_countdown( );
+                    try {
+                        sample( res, new_size );
+                    } catch( ... ) {
+                        /// out of memory for the bookkeeping: lose it
+                    }
+                }
+            }
+            return res;
+        }
+
+        static void *lcall_alloc( void *ud, void *ptr,
+                                  size_t old_size, size_t new_size )
+        {
+            return static_cast<alloc_sampler *>(ud)->alloc( ptr, old_size,
+                                                             new_size );
+        }
+
+        typedef std::unordered_map<std::string, uint32_t> site_ids;
+        typedef std::unordered_map<void *, block>         block_map;
+
+        lua_State                  *L_;
+        size_t                      interval_;
+        lua_Alloc                   next_alloc_f_;
+        void                       *next_ud_;
+        bool                        running_;
+        std::minstd_rand            random_;
+        size_t                      countdown_;
+
+        std::vector<alloc_site>     sites_;
+        site_ids                    ids_;
+        block_map                   blocks_;
+    };
+
+}}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#endif // LUA_ALLOC_PROFILER_HPP
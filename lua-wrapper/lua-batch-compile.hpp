@@ -0,0 +1,193 @@
+#ifndef LUA_BATCH_COMPILE_HPP
+#define LUA_BATCH_COMPILE_HPP
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "lualib.h"
+#include "lauxlib.h"
+#include "lua.h"
+}
+
+#include "lua-bytecode-cache.hpp"
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#endif
+
+/*
+ * Compiling many chunks at once.
+ *
+ * compile_batch spreads the units over a set of worker threads; each
+ * worker owns one bare lua_State (no libraries) that only parses and
+ * dumps, and takes the next unit from a shared counter, so a few large
+ * scripts do not leave the other workers idle. Results come back in
+ * unit order with the status, the diagnostic and the bytecode, ready
+ * for cache::put, the lua_embed tool or a deploy-time check.
+ *
+ * With options.store set, every compiled unit is also stored there
+ * (the cache is safe to share between the workers), dumped with the
+ * cache's strip flag whatever options.strip says for the results.
+ */
+namespace lua { namespace bytecode {
+
+    struct compile_unit {
+
+        std::string name;   /// chunk name as lua_load sees it
+        std::string path;   /// read from here if from_file
+        std::string text;
+        bool        from_file;
+
+        /// a script file; the chunk name is "@path" unless given
+        static compile_unit file( std::string path, std::string name = "" )
+        {
+            compile_unit res;
+            res.name      = name.empty( ) ? "@" + path : std::move( name );
+            res.path      = std::move( path );
+            res.from_file = true;
+            return res;
+        }
+
+        static compile_unit source( std::string name, std::string text )
+        {
+            compile_unit res;
+            res.name      = std::move( name );
+            res.text      = std::move( text );
+            res.from_file = false;
+            return res;
+        }
+    };
+
+    struct compile_result {
+        int         status = LUA_OK;    /// LUA_OK, LUA_ERRSYNTAX, ...
+        std::string error;              /// the diagnostic if status != OK
+        std::string bytecode;
+    };
+
+    struct batch_options {
+        unsigned  threads = 0;          /// 0: hardware_concurrency
+        bool      strip   = false;
+        cache    *store   = nullptr;
+    };
+
+    namespace detail {
+
+        inline void compile_one( lua_State *L, const compile_unit &unit,
+                                 const batch_options &opts,
+                                 compile_result &res )
+        {
+            std::string file_text;
+            const std::string *text = &unit.text;
+            size_t skip = 0;
+            if( unit.from_file ) {
+                if( !read_file( unit.path.c_str( ), file_text ) ) {
+                    res.status = LUA_ERRFILE;
+                    res.error  = "cannot open " + unit.path;
+                    return;
+                }
+                text = &file_text;
+                skip = source_offset( file_text );
+            }
+            const char  *data = text->data( ) + skip;
+            const size_t len  = text->size( ) - skip;
+
+            res.status = luaL_loadbuffer( L, data, len,
+                                          unit.name.c_str( ) );
+            if( res.status != LUA_OK ) {
+                const char *msg = lua_tostring( L, -1 );
+                res.error = msg ? msg : "unknown error";
+            } else if( !dump( L, res.bytecode, opts.strip ) ) {
+                res.status = LUA_ERRERR;
+                res.error  = "cannot dump " + unit.name;
+            } else if( opts.store ) {
+                /// entries are keyed by the cache's own strip flag
+                std::string stored;
+                const std::string *code = &res.bytecode;
+                if( opts.store->strip( ) != opts.strip ) {
+                    code = dump( L, stored, opts.store->strip( ) )
+                         ? &stored : nullptr;
+                }
+                if( code ) {
+                    opts.store->put( data, len, unit.name.c_str( ), *code );
+                }
+            }
+            lua_settop( L, 0 );
+        }
+
+        inline void compile_worker( const std::vector<compile_unit> &units,
+                                    const batch_options &opts,
+                                    std::atomic<size_t> &next,
+                                    std::vector<compile_result> &results )
+        {
+            lua_State *L = luaL_newstate( );
+            for( size_t i = next++; i < units.size( ); i = next++ ) {
+                if( !L ) {
+                    results[i].status = LUA_ERRMEM;
+                    results[i].error  = "cannot create a Lua state";
+                    continue;
+                }
+                try {
+                    compile_one( L, units[i], opts, results[i] );
+                } catch( const std::exception &ex ) {
+                    results[i].status = LUA_ERRMEM;
+                    results[i].error  = ex.what( );
+                    lua_settop( L, 0 );
+                }
+            }
+            if( L ) {
+                lua_close( L );
+            }
+        }
+    }
+
+    /// results[i] belongs to units[i]
+    inline std::vector<compile_result>
+    compile_batch( const std::vector<compile_unit> &units,
+                   const batch_options &opts = batch_options( ) )
+    {
+        std::vector<compile_result> results( units.size( ) );
+        size_t threads = opts.threads ? opts.threads
+                                      : std::thread::hardware_concurrency( );
+        if( threads == 0 ) {
+            threads = 1;
+        }
+        if( threads > units.size( ) ) {
+            threads = units.size( );
+        }
+
+        std::atomic<size_t> next( 0 );
+        std::vector<std::thread> workers;
+        workers.reserve( threads );
+        for( size_t i = 1; i < threads; ++i ) {
+            try {
+                workers.emplace_back( &detail::compile_worker,
+                                      std::cref( units ), std::cref( opts ),
+                                      std::ref( next ), std::ref( results ) );
+            } catch( const std::system_error & ) {
+                /// fewer workers, same results
+                break;
+            }
+        }
+        /// the calling thread is a worker too
+        detail::compile_worker( units, opts, next, results );
+        for( size_t i = 0; i < workers.size( ); ++i ) {
+            workers[i].join( );
+        }
+        return results;
+    }
+
+}}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#endif // LUA_BATCH_COMPILE_HPP
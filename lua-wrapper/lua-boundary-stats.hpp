@@ -0,0 +1,280 @@
+#ifndef LUA_BOUNDARY_STATS_HPP
+#define LUA_BOUNDARY_STATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string>
+
+#include <stdint.h>
+
+extern "C" {
+#include "lualib.h"
+#include "lauxlib.h"
+#include "lua.h"
+}
+
+#include "lua-text-format.hpp"
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#endif
+
+/*
+ * Counters for the host/Lua boundary: how often the wrapper pushes,
+ * reads, calls and walks tables, how many string bytes cross, and how
+ * long it takes.
+ *
+ * Build with LUA_WRAPPER_BOUNDARY_STATS defined (for the whole program)
+ * and lua::state records every push, get<T>/get_opt<T>, exec_function,
+ * get_table_deep, check_metatable/test_metatable and
+ * object_wrapper::object_by_path. Without it the recording lines are
+ * empty macros.
+ *
+ * The counters of a state live in its registry, so every lua::state
+ * over the same lua_State (and its coroutines) adds to the same set;
+ * lua_close frees them. Only the thread that runs the state writes;
+ * get_snapshot( L ) copies them and may run wherever the state may.
+ *
+ * Times include one clock read pair per operation (tens of ns), which
+ * is most of what a plain push costs; the counts and bytes are exact.
+ * An operation that runs inside another one (a push done by
+ * exec_function, an exec_function called back from Lua) counts for
+ * both.
+ */
+namespace lua { namespace boundary {
+
+    enum operation {
+         OP_PUSH             = 0
+        ,OP_GET              = 1
+        ,OP_EXEC_FUNCTION    = 2
+        ,OP_GET_TABLE_DEEP   = 3
+        ,OP_OBJECT_BY_PATH   = 4
+        ,OP_METATABLE_CHECK  = 5
+        ,OP_COUNT
+    };
+
+    inline const char *operation_name( operation op )
+    {
+        static const char *names[OP_COUNT] = {
+            "push", "get", "exec_function", "get_table_deep",
+            "object_by_path", "metatable_check"
+        };
+        return op < OP_COUNT ? names[op] : "unknown";
+    }
+
+    struct operation_stats {
+        uint64_t calls = 0;
+        uint64_t bytes = 0;
+        uint64_t ns    = 0;
+    };
+
+    struct snapshot {
+
+        operation_stats ops[OP_COUNT];
+
+        const operation_stats &operator [ ]( operation op ) const
+        {
+            return ops[op];
+        }
+
+        /// "prefix.push.calls 12\n..." for line-based metric collectors
+        void append_to( std::string &out,
+                        const char *prefix = "lua.boundary" ) const
+        {
+            static const char *fields[3] = { ".calls ", ".bytes ", ".ns " };
+            for( int i = 0; i < OP_COUNT; ++i ) {
+                const uint64_t values[3] = {
+                    ops[i].calls, ops[i].bytes, ops[i].ns
+                };
+                for( int f = 0; f < 3; ++f ) {
+                    out.append( prefix );
+                    out.push_back( '.' );
+                    out.append( operation_name( static_cast<operation>(i) ) );
+                    out.append( fields[f] );
+                    text::append_unsigned( out, values[f] );
+                    out.push_back( '\n' );
+                }
+            }
+        }
+
+        /// what happened between since and this
+        snapshot operator - ( const snapshot &since ) const
+        {
+            snapshot res;
+            for( int i = 0; i < OP_COUNT; ++i ) {
+                res.ops[i].calls = ops[i].calls - since.ops[i].calls;
+                res.ops[i].bytes = ops[i].bytes - since.ops[i].bytes;
+                res.ops[i].ns    = ops[i].ns    - since.ops[i].ns;
+            }
+            return res;
+        }
+    };
+
+    class counters {
+
+        struct slot {
+            std::atomic<uint64_t> calls;
+            std::atomic<uint64_t> bytes;
+            std::atomic<uint64_t> ns;
+        };
+
+        /// one writer: a plain add, readable from a metrics thread
+        static void add( std::atomic<uint64_t> &v, uint64_t n )
+        {
+            v.store( v.load( std::memory_order_relaxed ) + n,
+                     std::memory_order_relaxed );
+        }
+
+        static void *registry_key( )
+        {
+            static char key;
+            return &key;
+        }
+
+    public:
+
+        counters( )
+        {
+            reset( );
+        }
+
+        counters( const counters & ) = delete;
+        counters &operator = ( const counters & ) = delete;
+
+        /// the counters of L, created on first use
+        static counters *of( lua_State *L )
+        {
+            lua_rawgetp( L, LUA_REGISTRYINDEX, registry_key( ) );
+            counters *res = static_cast<counters *>(lua_touserdata( L, -1 ));
+            lua_pop( L, 1 );
+            if( res ) {
+                return res;
+            }
+            /// trivially destructible: no __gc, usable from finalizers
+            void *mem = lua_newuserdata( L, sizeof(counters) );
+            res = new (mem) counters;
+            lua_rawsetp( L, LUA_REGISTRYINDEX, registry_key( ) );
+            return res;
+        }
+
+        void record( operation op, uint64_t bytes, uint64_t ns )
+        {
+            slot &s = slots_[op];
+            add( s.calls, 1 );
+            add( s.bytes, bytes );
+            add( s.ns, ns );
+        }
+
+        snapshot get( ) const
+        {
+            snapshot res;
+            for( int i = 0; i < OP_COUNT; ++i ) {
+                const slot &s = slots_[i];
+                res.ops[i].calls = s.calls.load( std::memory_order_relaxed );
+                res.ops[i].bytes = s.bytes.load( std::memory_order_relaxed );
+                res.ops[i].ns    = s.ns.load( std::memory_order_relaxed );
+            }
+            return res;
+        }
+
+        void reset( )
+        {
+            for( int i = 0; i < OP_COUNT; ++i ) {
+                slots_[i].calls.store( 0, std::memory_order_relaxed );
+                slots_[i].bytes.store( 0, std::memory_order_relaxed );
+                slots_[i].ns.store( 0, std::memory_order_relaxed );
+            }
+        }
+
+    private:
+        slot slots_[OP_COUNT];
+    };
+
+    /// all zero, and no counters created, when built without
+    /// LUA_WRAPPER_BOUNDARY_STATS
+    inline snapshot get_snapshot( lua_State *L )
+    {
+#ifdef LUA_WRAPPER_BOUNDARY_STATS
+        return counters::of( L )->get( );
+#else
+        (void)L;
+        return snapshot( );
+#endif
+    }
+
+    inline void reset( lua_State *L )
+    {
+#ifdef LUA_WRAPPER_BOUNDARY_STATS
+        counters::of( L )->reset( );
+#else
+        (void)L;
+#endif
+    }
+
+    /// string bytes of the value at idx; other types cross as 0 bytes
+    inline size_t string_bytes( lua_State *L, int idx )
+    {
+        return lua_type( L, idx ) == LUA_TSTRING ? lua_rawlen( L, idx ) : 0;
+    }
+
+    /*
+     * Records one operation on L from construction to destruction;
+     * bytes( ) adds to its byte count. A Lua error that unwinds past a
+     * scope (longjmp) loses that one record.
+     */
+    class scope {
+
+        typedef std::chrono::steady_clock clock_type;
+
+    public:
+
+        scope( lua_State *L, operation op )
+            :counters_(counters::of( L ))
+            ,op_(op)
+            ,bytes_(0)
+            ,start_(clock_type::now( ))
+        { }
+
+        scope( const scope & ) = delete;
+        scope &operator = ( const scope & ) = delete;
+
+        ~scope( )
+        {
+            const uint64_t ns = static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        clock_type::now( ) - start_ ).count( ) );
+            counters_->record( op_, bytes_, ns );
+        }
+
+        void bytes( size_t n )
+        {
+            bytes_ += n;
+        }
+
+    private:
+        counters               *counters_;
+        operation               op_;
+        uint64_t                bytes_;
+        clock_type::time_point  start_;
+    };
+
+}}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#ifdef LUA_WRAPPER_BOUNDARY_STATS
+#define LUA_WRAPPER_BOUNDARY_SCOPE( L, op ) \
+    boundary::scope lua_wrapper_boundary_scope_( L, boundary::op )
+#define LUA_WRAPPER_BOUNDARY_BYTES( L, idx ) \
+    lua_wrapper_boundary_scope_.bytes( boundary::string_bytes( L, idx ) )
+#else
+#define LUA_WRAPPER_BOUNDARY_SCOPE( L, op ) ((void)0)
+#define LUA_WRAPPER_BOUNDARY_BYTES( L, idx ) ((void)0)
+#endif
+
+#endif // LUA_BOUNDARY_STATS_HPP
@@ -0,0 +1,405 @@
+#ifndef LUA_BYTECODE_CACHE_HPP
+#define LUA_BYTECODE_CACHE_HPP
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+extern "C" {
+#include "lualib.h"
+#include "lauxlib.h"
+#include "lua.h"
+}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#endif
+
+/*
+ * On-disk cache of compiled chunks.
+ *
+ * An entry is the lua_dump output of a chunk, stored as
+ *
+ *  <directory>/<key>.luac: [ entry_header ][ bytecode ]
+ *
+ * The key is a 64-bit hash of the Lua release, the number and pointer
+ * sizes, the strip flag, the chunk name and the source text, so an
+ * edited script, a different interpreter or a different path simply
+ * misses. On load the header (magic, key, sizes, bytecode hash) is
+ * checked before lua_load sees the bytecode: Lua does not verify
+ * bytecode, so a damaged entry must never reach it. Anything that does
+ * not validate counts as stale and the source is compiled instead.
+ *
+ * Entries are written to a temp file named after the process and a
+ * counter and renamed over the final name, so concurrent writers (threads
+ * or worker processes sharing the directory) never expose a partial
+ * file; the last rename wins and all of them carry the same bytes.
+ *
+ * The directory must exist; the cache does not create it. A cache object
+ * holds no per-load state and can be shared between states and threads.
+ */
+namespace lua { namespace bytecode {
+
+    /// FNV-1a; h chains several buffers into one hash
+    inline uint64_t hash64( const void *data, size_t len,
+                            uint64_t h = 14695981039346656037ULL )
+    {
+        const unsigned char *p = static_cast<const unsigned char *>(data);
+        for( size_t i = 0; i < len; ++i ) {
+            h ^= p[i];
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    inline bool read_file( const char *path, std::string &out )
+    {
+        FILE *f = std::fopen( path, "rb" );
+        if( !f ) {
+            return false;
+        }
+        out.clear( );
+        char buf[16384];
+        size_t n;
+        while( (n = std::fread( buf, 1, sizeof(buf), f )) > 0 ) {
+            out.append( buf, n );
+        }
+        const bool ok = !std::ferror( f );
+        std::fclose( f );
+        return ok;
+    }
+
+    /// where the chunk starts in a script file: a leading BOM and '#'
+    /// line are skipped the way luaL_loadfile skips them, keeping the
+    /// '\n' so line numbers stay right
+    inline size_t source_offset( const char *src, size_t size )
+    {
+        size_t skip = 0;
+        if( size >= 3 && std::memcmp( src, "\xEF\xBB\xBF", 3 ) == 0 ) {
+            skip = 3;
+        }
+        if( skip < size && src[skip] == '#' ) {
+            const void *eol = std::memchr( src + skip, '\n', size - skip );
+            skip = eol ? static_cast<size_t>(static_cast<const char *>(eol)
+                                             - src)
+                       : size;
+        }
+        return skip;
+    }
+
+    inline size_t source_offset( const std::string &src )
+    {
+        return source_offset( src.data( ), src.size( ) );
+    }
+
+    /// lua_Writer into a std::string; an exception must not cross
+    /// lua_dump, so a failed append just stops the dump
+    inline int string_writer( lua_State *, const void *p, size_t sz,
+                              void *ud )
+    {
+        try {
+            static_cast<std::string *>(ud)->append(
+                        static_cast<const char *>(p), sz );
+        } catch( ... ) {
+            return 1;
+        }
+        return 0;
+    }
+
+    /// lua_dump of the function on the top of the stack
+    inline bool dump( lua_State *L, std::string &out, bool strip = false )
+    {
+        out.clear( );
+        if( !lua_isfunction( L, -1 ) || lua_iscfunction( L, -1 ) ) {
+            return false;
+        }
+        return lua_dump( L, &string_writer, &out, strip ? 1 : 0 ) == 0;
+    }
+
+    struct cache_stats {
+        uint64_t hits         = 0;
+        uint64_t misses       = 0;
+        uint64_t stale        = 0; /// entry found but rejected
+        uint64_t writes       = 0;
+        uint64_t write_errors = 0;
+    };
+
+    class cache {
+
+        struct entry_header {
+            char     magic[8];
+            uint64_t key;
+            uint64_t source_size;
+            uint64_t code_size;
+            uint64_t code_hash;
+        };
+
+        static const char *magic( )
+        {
+            return "LWBC\x01\0\0";
+        }
+
+        struct counters {
+            std::atomic<uint64_t> hits;
+            std::atomic<uint64_t> misses;
+            std::atomic<uint64_t> stale;
+            std::atomic<uint64_t> writes;
+            std::atomic<uint64_t> write_errors;
+            counters( )
+                :hits(0)
+                ,misses(0)
+                ,stale(0)
+                ,writes(0)
+                ,write_errors(0)
+            { }
+        };
+
+    public:
+
+        /// strip drops debug info: smaller entries, but error messages
+        /// and tracebacks lose line numbers
+        explicit cache( std::string directory, bool strip = false )
+            :dir_(std::move( directory ))
+            ,strip_(strip)
+        {
+            if( !dir_.empty( ) && dir_.back( ) != '/'
+#if defined(_WIN32)
+                                && dir_.back( ) != '\\'
+#endif
+              )
+            {
+                dir_.push_back( '/' );
+            }
+        }
+
+        cache( const cache & ) = delete;
+        cache &operator = ( const cache & ) = delete;
+
+        const std::string &directory( ) const
+        {
+            return dir_;
+        }
+
+        /*
+         * Same contract as luaL_loadfile: pushes the chunk and returns
+         * LUA_OK, or pushes a message and returns an error code
+         * (LUA_ERRFILE if the script cannot be read).
+         */
+        int load_file( lua_State *L, const char *path )
+        {
+            std::string src;
+            if( !read_file( path, src ) ) {
+                lua_pushfstring( L, "cannot open %s", path );
+                return LUA_ERRFILE;
+            }
+            const size_t skip = source_offset( src );
+            std::string name( "@" );
+            name.append( path );
+            return load_buffer( L, src.data( ) + skip, src.size( ) - skip,
+                                name.c_str( ) );
+        }
+
+        /// luaL_loadbuffer through the cache; name is the chunk name
+        int load_buffer( lua_State *L, const char *data, size_t len,
+                         const char *name )
+        {
+            const uint64_t key = make_key( data, len, name );
+            const std::string path = entry_path( key );
+
+            std::string entry;
+            if( read_file( path.c_str( ), entry ) ) {
+                const char *code = validate( entry, key, len );
+                if( code ) {
+                    size_t code_size = entry.size( ) - sizeof(entry_header);
+                    if( luaL_loadbufferx( L, code, code_size, name, "b" )
+                            == LUA_OK )
+                    {
+                        ++counters_.hits;
+                        return LUA_OK;
+                    }
+                    lua_pop( L, 1 );
+                }
+                ++counters_.stale;
+            } else {
+                ++counters_.misses;
+            }
+
+            /// a binary chunk passed as source is loaded but not cached
+            const bool is_text = ( len == 0 || data[0] != LUA_SIGNATURE[0] );
+            int res = luaL_loadbuffer( L, data, len, name );
+            if( res == LUA_OK && is_text ) {
+                std::string code;
+                if( dump( L, code, strip_ ) ) {
+                    store( path, key, len, code );
+                } else {
+                    ++counters_.write_errors;
+                }
+            }
+            return res;
+        }
+
+        /// stores bytecode compiled elsewhere (see compile_batch) for the
+        /// source data[0, len) loaded under name; false if it could not
+        /// be written
+        bool put( const char *data, size_t len, const char *name,
+                  const std::string &code )
+        {
+            const uint64_t key = make_key( data, len, name );
+            return store( entry_path( key ), key, len, code );
+        }
+
+        bool strip( ) const
+        {
+            return strip_;
+        }
+
+        cache_stats stats( ) const
+        {
+            cache_stats res;
+            res.hits         = counters_.hits.load( );
+            res.misses       = counters_.misses.load( );
+            res.stale        = counters_.stale.load( );
+            res.writes       = counters_.writes.load( );
+            res.write_errors = counters_.write_errors.load( );
+            return res;
+        }
+
+        void reset_stats( )
+        {
+            counters_.hits         = 0;
+            counters_.misses       = 0;
+            counters_.stale        = 0;
+            counters_.writes       = 0;
+            counters_.write_errors = 0;
+        }
+
+    private:
+
+        uint64_t make_key( const char *data, size_t len,
+                           const char *name ) const
+        {
+            const unsigned char sizes[ ] = {
+                static_cast<unsigned char>(sizeof(lua_Integer)),
+                static_cast<unsigned char>(sizeof(lua_Number)),
+                static_cast<unsigned char>(sizeof(void *)),
+                static_cast<unsigned char>(strip_ ? 1 : 0),
+            };
+            uint64_t h = hash64( LUA_RELEASE, sizeof(LUA_RELEASE) );
+            h = hash64( sizes, sizeof(sizes), h );
+            h = hash64( name, std::strlen( name ) + 1, h );
+            return hash64( data, len, h );
+        }
+
+        std::string entry_path( uint64_t key ) const
+        {
+            static const char digits[ ] = "0123456789abcdef";
+            std::string res( dir_ );
+            for( int shift = 60; shift >= 0; shift -= 4 ) {
+                res.push_back( digits[(key >> shift) & 0xF] );
+            }
+            res.append( ".luac" );
+            return res;
+        }
+
+        /// the bytecode inside entry, or nullptr if it does not belong
+        /// to this key or is damaged
+        static const char *validate( const std::string &entry,
+                                     uint64_t key, size_t source_size )
+        {
+            if( entry.size( ) < sizeof(entry_header) ) {
+                return nullptr;
+            }
+            entry_header hdr;
+            std::memcpy( &hdr, entry.data( ), sizeof(hdr) );
+            const char *code = entry.data( ) + sizeof(hdr);
+            const size_t code_size = entry.size( ) - sizeof(hdr);
+            if( std::memcmp( hdr.magic, magic( ), sizeof(hdr.magic) ) != 0
+             || hdr.key != key
+             || hdr.source_size != source_size
+             || hdr.code_size != code_size
+             || hdr.code_hash != hash64( code, code_size ) )
+            {
+                return nullptr;
+            }
+            return code;
+        }
+
+        bool store( const std::string &path, uint64_t key,
+                    size_t source_size, const std::string &code )
+        {
+            entry_header hdr;
+            std::memcpy( hdr.magic, magic( ), sizeof(hdr.magic) );
+            hdr.key         = key;
+            hdr.source_size = source_size;
+            hdr.code_size   = code.size( );
+            hdr.code_hash   = hash64( code.data( ), code.size( ) );
+
+            static std::atomic<unsigned> sequence( 0 );
+            std::string tmp( path );
+            tmp.append( ".tmp." );
+#if defined(_WIN32)
+            tmp.append( std::to_string( _getpid( ) ) );
+#else
+            tmp.append( std::to_string( getpid( ) ) );
+#endif
+            tmp.push_back( '.' );
+            tmp.append( std::to_string( sequence++ ) );
+
+            FILE *f = std::fopen( tmp.c_str( ), "wb" );
+            if( !f ) {
+                ++counters_.write_errors;
+                return false;
+            }
+            bool ok = std::fwrite( &hdr, sizeof(hdr), 1, f ) == 1
+                   && std::fwrite( code.data( ), 1, code.size( ), f )
+                                                        == code.size( );
+            ok = ( std::fclose( f ) == 0 ) && ok;
+#if defined(_WIN32)
+            /// rename does not replace an existing file here
+            if( ok ) {
+                std::remove( path.c_str( ) );
+            }
+#endif
+            if( !ok || std::rename( tmp.c_str( ), path.c_str( ) ) != 0 ) {
+                std::remove( tmp.c_str( ) );
+                ++counters_.write_errors;
+                return false;
+            }
+            ++counters_.writes;
+            return true;
+        }
+
+        std::string dir_;
+        bool        strip_;
+        counters    counters_;
+    };
+
+    /// state::load_file that takes the compiled chunk from cache when
+    /// the source has not changed and stores it there when it has
+    inline int load_file( lua_State *L, const char *path, cache &c )
+    {
+        int res = c.load_file( L, path );
+        if( 0 == res ) {
+            res = lua_pcall( L, 0, LUA_MULTRET, 0 );
+        }
+        return res;
+    }
+
+}}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#endif // LUA_BYTECODE_CACHE_HPP
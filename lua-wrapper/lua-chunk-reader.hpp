@@ -0,0 +1,342 @@
+#ifndef LUA_CHUNK_READER_HPP
+#define LUA_CHUNK_READER_HPP
+
+#include <cerrno>
+#include <cstring>
+#include <istream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#define LUA_CHUNK_READER_NOMINMAX
+#endif
+#include <windows.h>
+#ifdef LUA_CHUNK_READER_NOMINMAX
+#undef NOMINMAX
+#undef LUA_CHUNK_READER_NOMINMAX
+#endif
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+extern "C" {
+#include "lualib.h"
+#include "lauxlib.h"
+#include "lua.h"
+}
+
+#include "lua-bytecode-cache.hpp"
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#endif
+
+/*
+ * Loading chunks without an extra copy of them.
+ *
+ * mapped_file maps a file read-only; load_mapped hands the mapping to
+ * lua_load as one piece, so a multi-MB script is read by the parser
+ * straight from the page cache. The mapping is also usable for data
+ * (json::decode, msgpack::decode take a pointer and a size).
+ *
+ * For chunks that arrive incrementally (a pipe, a socket, a stream)
+ * load( L, reader, name ) drives lua_load from a Reader:
+ *
+ *  const char *read( size_t *size ); // next piece, nullptr/0 at the end
+ *  bool failed( ) const;             // true if the source broke
+ *
+ * fd_reader and stream_reader keep one fixed buffer and refill it, so
+ * only that buffer and the parser's own state are ever in memory.
+ *
+ * load_mapped_file and load_reader also run the chunk:
+ *
+ *  lua::chunk::load_mapped_file( ls.get_state( ), "app.lua" );
+ *
+ * The header is not part of lua-wrapper.hpp (it brings in the OS
+ * mapping headers); include it where it is used.
+ */
+namespace lua { namespace chunk {
+
+    class mapped_file {
+
+    public:
+
+        mapped_file( )
+            :data_(nullptr)
+            ,size_(0)
+        { }
+
+        /// throws std::runtime_error if the file cannot be mapped
+        explicit mapped_file( const char *path )
+            :data_(nullptr)
+            ,size_(0)
+        {
+            if( !open( path ) ) {
+                throw std::runtime_error( std::string( "cannot map " )
+                                        + path );
+            }
+        }
+
+        mapped_file( mapped_file &&other )
+            :data_(other.data_)
+            ,size_(other.size_)
+        {
+            other.data_ = nullptr;
+            other.size_ = 0;
+        }
+
+        mapped_file &operator = ( mapped_file &&other )
+        {
+            if( this != &other ) {
+                close( );
+                data_ = other.data_;
+                size_ = other.size_;
+                other.data_ = nullptr;
+                other.size_ = 0;
+            }
+            return *this;
+        }
+
+        mapped_file( const mapped_file & ) = delete;
+        mapped_file &operator = ( const mapped_file & ) = delete;
+
+        ~mapped_file( )
+        {
+            close( );
+        }
+
+        /// an empty file opens fine and has no mapping
+        bool open( const char *path )
+        {
+            close( );
+#if defined(_WIN32)
+            HANDLE file = CreateFileA( path, GENERIC_READ, FILE_SHARE_READ,
+                                       nullptr, OPEN_EXISTING,
+                                       FILE_ATTRIBUTE_NORMAL, nullptr );
+            if( file == INVALID_HANDLE_VALUE ) {
+                return false;
+            }
+            LARGE_INTEGER size;
+            bool ok = GetFileSizeEx( file, &size ) != 0;
+            if( ok && size.QuadPart > 0 ) {
+                HANDLE map = CreateFileMappingA( file, nullptr, PAGE_READONLY,
+                                                 0, 0, nullptr );
+                ok = map != nullptr;
+                if( ok ) {
+                    data_ = static_cast<const char *>(
+                                MapViewOfFile( map, FILE_MAP_READ, 0, 0, 0 ) );
+                    CloseHandle( map );
+                    ok = data_ != nullptr;
+                }
+                size_ = ok ? static_cast<size_t>(size.QuadPart) : 0;
+            }
+            CloseHandle( file );
+            return ok;
+#else
+            int fd = ::open( path, O_RDONLY );
+            if( fd < 0 ) {
+                return false;
+            }
+            struct stat st;
+            bool ok = ::fstat( fd, &st ) == 0 && S_ISREG( st.st_mode );
+            if( ok && st.st_size > 0 ) {
+                void *p = ::mmap( nullptr, static_cast<size_t>(st.st_size),
+                                  PROT_READ, MAP_PRIVATE, fd, 0 );
+                ok = p != MAP_FAILED;
+                if( ok ) {
+                    data_ = static_cast<const char *>(p);
+                    size_ = static_cast<size_t>(st.st_size);
+                    /// the parser reads front to back once
+                    ::madvise( p, size_, MADV_SEQUENTIAL );
+                }
+            }
+            ::close( fd );
+            return ok;
+#endif
+        }
+
+        void close( )
+        {
+            if( data_ ) {
+#if defined(_WIN32)
+                UnmapViewOfFile( data_ );
+#else
+                ::munmap( const_cast<char *>(data_), size_ );
+#endif
+            }
+            data_ = nullptr;
+            size_ = 0;
+        }
+
+        const char *data( ) const
+        {
+            return data_ ? data_ : "";
+        }
+
+        size_t size( ) const
+        {
+            return size_;
+        }
+
+    private:
+        const char *data_;
+        size_t      size_;
+    };
+
+    /// reads a file descriptor (pipe, socket, file) until EOF;
+    /// the descriptor stays open
+    class fd_reader {
+
+    public:
+
+        explicit fd_reader( int fd, size_t buffer_size = 65536 )
+            :fd_(fd)
+            ,buf_(buffer_size ? buffer_size : 1)
+            ,failed_(false)
+        { }
+
+        const char *read( size_t *size )
+        {
+            for( ;; ) {
+#if defined(_WIN32)
+                int n = ::_read( fd_, buf_.data( ),
+                                 static_cast<unsigned>(buf_.size( )) );
+#else
+                ssize_t n = ::read( fd_, buf_.data( ), buf_.size( ) );
+#endif
+                if( n > 0 ) {
+                    *size = static_cast<size_t>(n);
+                    return buf_.data( );
+                }
+                if( n < 0 && errno == EINTR ) {
+                    continue;
+                }
+                failed_ = n < 0;
+                *size = 0;
+                return nullptr;
+            }
+        }
+
+        bool failed( ) const
+        {
+            return failed_;
+        }
+
+    private:
+        int               fd_;
+        std::vector<char> buf_;
+        bool              failed_;
+    };
+
+    class stream_reader {
+
+    public:
+
+        explicit stream_reader( std::istream &is, size_t buffer_size = 65536 )
+            :is_(is)
+            ,buf_(buffer_size ? buffer_size : 1)
+        { }
+
+        const char *read( size_t *size )
+        {
+            is_.read( buf_.data( ),
+                      static_cast<std::streamsize>(buf_.size( )) );
+            *size = static_cast<size_t>(is_.gcount( ));
+            return *size ? buf_.data( ) : nullptr;
+        }
+
+        bool failed( ) const
+        {
+            return is_.bad( );
+        }
+
+    private:
+        std::istream     &is_;
+        std::vector<char> buf_;
+    };
+
+    namespace detail {
+        template <typename Reader>
+        const char *lua_reader( lua_State *, void *ud, size_t *size )
+        {
+            return static_cast<Reader *>(ud)->read( size );
+        }
+    }
+
+    /*
+     * Same contract as lua_load: pushes the chunk and returns LUA_OK, or
+     * pushes a message and returns an error code; LUA_ERRFILE if the
+     * reader failed. mode is "t", "b" or "bt" as for luaL_loadbufferx.
+     */
+    template <typename Reader>
+    inline int load( lua_State *L, Reader &reader, const char *name,
+                     const char *mode = nullptr )
+    {
+        int res = lua_load( L, &detail::lua_reader<Reader>, &reader,
+                            name, mode );
+        if( reader.failed( ) ) {
+            lua_pop( L, 1 );
+            lua_pushfstring( L, "cannot read %s", name );
+            res = LUA_ERRFILE;
+        }
+        return res;
+    }
+
+    /*
+     * luaL_loadfile through a mapping; a leading BOM and '#' line are
+     * skipped like luaL_loadfile does. The mapping only lives for the
+     * call: lua_load does not keep the source around.
+     */
+    inline int load_mapped( lua_State *L, const char *path )
+    {
+        mapped_file file;
+        if( !file.open( path ) ) {
+            lua_pushfstring( L, "cannot open %s", path );
+            return LUA_ERRFILE;
+        }
+        const size_t skip = bytecode::source_offset( file.data( ),
+                                                     file.size( ) );
+        std::string name( "@" );
+        name.append( path );
+        return luaL_loadbuffer( L, file.data( ) + skip, file.size( ) - skip,
+                                name.c_str( ) );
+    }
+
+    /// load_mapped and run the chunk; same results as state::load_file
+    inline int load_mapped_file( lua_State *L, const char *path )
+    {
+        int res = load_mapped( L, path );
+        if( 0 == res ) {
+            res = lua_pcall( L, 0, LUA_MULTRET, 0 );
+        }
+        return res;
+    }
+
+    /// load from reader and run the chunk; same results as
+    /// state::load_file
+    template <typename Reader>
+    inline int load_reader( lua_State *L, Reader &reader, const char *name )
+    {
+        int res = load( L, reader, name );
+        if( 0 == res ) {
+            res = lua_pcall( L, 0, LUA_MULTRET, 0 );
+        }
+        return res;
+    }
+
+}}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#endif // LUA_CHUNK_READER_HPP
@@ -0,0 +1,297 @@
+#ifndef LUA_CONTAINER_WRAPPER_HPP
+#define LUA_CONTAINER_WRAPPER_HPP
+
+#include <array>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if( __cplusplus >= 201703L ) || ( defined(_MSVC_LANG) && _MSVC_LANG >= 201703L )
+#include <optional>
+#define LUA_WRAPPER_HAS_OPTIONAL 1
+#elif defined(__has_include)
+#if __has_include(<experimental/optional>)
+/// C++14: the Library Fundamentals TS optional (libstdc++, libc++)
+#include <experimental/optional>
+#define LUA_WRAPPER_HAS_EXPERIMENTAL_OPTIONAL 1
+#endif
+#endif
+
+extern "C" {
+#include "lua.h"
+}
+
+#include "lua-type-wrapper.hpp"
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#endif
+
+namespace lua { namespace types {
+
+    /// Lua sequences {v1, v2, ...} <-> vector-like containers
+    template <typename C>
+    struct id_sequence: public base_id<LUA_TTABLE> {
+
+        typedef typename C::value_type value_type;
+        typedef id_traits<value_type>  traits;
+
+        static C get( lua_State *L, int idx )
+        {
+            C res;
+            if( lua_type( L, idx ) != LUA_TTABLE ) {
+                return res;
+            }
+            idx = lua_absindex( L, idx );
+            lua_checkstack( L, 2 );
+
+            const lua_Integer len = static_cast<lua_Integer>(lua_rawlen( L, idx ));
+            res.reserve( static_cast<size_t>(len) );
+            for( lua_Integer i = 1; i <= len; ++i ) {
+                lua_rawgeti( L, idx, i );
+                res.push_back( traits::get( L, -1 ) );
+                lua_pop( L, 1 );
+            }
+            return res;
+        }
+
+        static void push( lua_State *L, const C &value )
+        {
+            lua_checkstack( L, 3 );
+            lua_createtable( L, static_cast<int>(value.size( )), 0 );
+            lua_Integer i = 1;
+            for( typename C::const_iterator b(value.begin( )), e(value.end( ));
+                 b != e; ++b )
+            {
+                traits::push( L, *b );
+                lua_rawseti( L, -2, i++ );
+            }
+        }
+    };
+
+    template <typename T, size_t N>
+    struct id_fixed_array: public base_id<LUA_TTABLE> {
+
+        typedef std::array<T, N> array_type;
+        typedef id_traits<T>     traits;
+
+        static array_type get( lua_State *L, int idx )
+        {
+            array_type res = array_type( );
+            if( lua_type( L, idx ) != LUA_TTABLE ) {
+                return res;
+            }
+            idx = lua_absindex( L, idx );
+            lua_checkstack( L, 2 );
+
+            size_t len = static_cast<size_t>(lua_rawlen( L, idx ));
+            len = len < N ? len : N;
+            for( size_t i = 0; i < len; ++i ) {
+                lua_rawgeti( L, idx, static_cast<lua_Integer>(i + 1) );
+                res[i] = traits::get( L, -1 );
+                lua_pop( L, 1 );
+            }
+            return res;
+        }
+
+        static void push( lua_State *L, const array_type &value )
+        {
+            lua_checkstack( L, 3 );
+            lua_createtable( L, static_cast<int>(N), 0 );
+            for( size_t i = 0; i < N; ++i ) {
+                traits::push( L, value[i] );
+                lua_rawseti( L, -2, static_cast<lua_Integer>(i + 1) );
+            }
+        }
+    };
+
+    /// Lua hash tables {k1 = v1, ...} <-> map-like containers
+    template <typename M>
+    struct id_associative: public base_id<LUA_TTABLE> {
+
+        typedef typename M::key_type    key_type;
+        typedef typename M::mapped_type mapped_type;
+        typedef id_traits<key_type>     key_traits;
+        typedef id_traits<mapped_type>  value_traits;
+
+        static M get( lua_State *L, int idx )
+        {
+            M res;
+            if( lua_type( L, idx ) != LUA_TTABLE ) {
+                return res;
+            }
+            idx = lua_absindex( L, idx );
+            lua_checkstack( L, 4 );
+
+            lua_pushnil( L );
+            while( lua_next( L, idx ) ) {
+                /// the key is read from a copy; lua_tolstring must
+                /// not convert the original key while lua_next walks
+                lua_pushvalue( L, -2 );
+                res.insert( std::make_pair( key_traits::get( L, -1 ),
+                                            value_traits::get( L, -2 ) ) );
+                lua_pop( L, 2 );
+            }
+            return res;
+        }
+
+        static void push( lua_State *L, const M &value )
+        {
+            lua_checkstack( L, 4 );
+            lua_createtable( L, 0, static_cast<int>(value.size( )) );
+            for( typename M::const_iterator b(value.begin( )), e(value.end( ));
+                 b != e; ++b )
+            {
+                key_traits::push( L, b->first );
+                value_traits::push( L, b->second );
+                lua_rawset( L, -3 );
+            }
+        }
+    };
+
+    /// std::pair and std::tuple are {e1, e2, ...}
+    template <typename T>
+    struct id_tuple: public base_id<LUA_TTABLE> {
+
+    private:
+
+        enum { tuple_size = std::tuple_size<T>::value };
+
+        typedef std::make_index_sequence<tuple_size> indexes;
+
+        template <size_t I>
+        static void get_element( lua_State *L, int idx, T &res )
+        {
+            typedef typename std::tuple_element<I, T>::type element_type;
+            lua_rawgeti( L, idx, static_cast<lua_Integer>(I + 1) );
+            std::get<I>( res ) = id_traits<element_type>::get( L, -1 );
+            lua_pop( L, 1 );
+        }
+
+        template <size_t I>
+        static void push_element( lua_State *L, const T &value )
+        {
+            typedef typename std::tuple_element<I, T>::type element_type;
+            id_traits<element_type>::push( L, std::get<I>( value ) );
+            lua_rawseti( L, -2, static_cast<lua_Integer>(I + 1) );
+        }
+
+        template <size_t ...I>
+        static void get_all( lua_State *L, int idx, T &res,
+                             std::index_sequence<I...> )
+        {
+            int dummy[ ] = { 0, ( get_element<I>( L, idx, res ), 0 )... };
+            (void)dummy;
+        }
+
+        template <size_t ...I>
+        static void push_all( lua_State *L, const T &value,
+                              std::index_sequence<I...> )
+        {
+            int dummy[ ] = { 0, ( push_element<I>( L, value ), 0 )... };
+            (void)dummy;
+        }
+
+    public:
+
+        static T get( lua_State *L, int idx )
+        {
+            T res = T( );
+            if( lua_type( L, idx ) == LUA_TTABLE ) {
+                lua_checkstack( L, 2 );
+                get_all( L, lua_absindex( L, idx ), res, indexes( ) );
+            }
+            return res;
+        }
+
+        static void push( lua_State *L, const T &value )
+        {
+            lua_checkstack( L, 3 );
+            lua_createtable( L, tuple_size, 0 );
+            push_all( L, value, indexes( ) );
+        }
+    };
+
+    template <typename T, typename A>
+    struct id_traits<std::vector<T, A> > : public
+           id_sequence<std::vector<T, A> > { };
+
+    template <typename T, size_t N>
+    struct id_traits<std::array<T, N> > : public
+           id_fixed_array<T, N> { };
+
+    template <typename K, typename V, typename C, typename A>
+    struct id_traits<std::map<K, V, C, A> > : public
+           id_associative<std::map<K, V, C, A> > { };
+
+    template <typename K, typename V, typename H, typename E, typename A>
+    struct id_traits<std::unordered_map<K, V, H, E, A> > : public
+           id_associative<std::unordered_map<K, V, H, E, A> > { };
+
+    template <typename F, typename S>
+    struct id_traits<std::pair<F, S> > : public
+           id_tuple<std::pair<F, S> > { };
+
+    template <typename ...T>
+    struct id_traits<std::tuple<T...> > : public
+           id_tuple<std::tuple<T...> > { };
+
+    /// nil <-> an empty optional; Opt is std::optional<T> or,
+    /// in C++14 builds, std::experimental::optional<T>
+    template <typename Opt>
+    struct id_optional {
+
+        typedef typename Opt::value_type value_type;
+        typedef id_traits<value_type> traits;
+        enum { type_index = traits::type_index };
+
+        static bool check( lua_State *L, int idx )
+        {
+            return lua_isnoneornil( L, idx ) || traits::check( L, idx );
+        }
+
+        static Opt get( lua_State *L, int idx )
+        {
+            if( lua_isnoneornil( L, idx ) ) {
+                return Opt( );
+            }
+            return Opt( traits::get( L, idx ) );
+        }
+
+        static void push( lua_State *L, const Opt &value )
+        {
+            if( value ) {
+                traits::push( L, *value );
+            } else {
+                lua_pushnil( L );
+            }
+        }
+    };
+
+#ifdef LUA_WRAPPER_HAS_OPTIONAL
+
+    template <typename T>
+    struct id_traits<std::optional<T> > : public
+           id_optional<std::optional<T> > { };
+
+#endif
+
+#ifdef LUA_WRAPPER_HAS_EXPERIMENTAL_OPTIONAL
+
+    template <typename T>
+    struct id_traits<std::experimental::optional<T> > : public
+           id_optional<std::experimental::optional<T> > { };
+
+#endif
+
+}}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#endif // LUA_CONTAINER_WRAPPER_HPP
@@ -0,0 +1,132 @@
+#ifndef LUA_EMBEDDED_HPP
+#define LUA_EMBEDDED_HPP
+
+#include <cstring>
+#include <map>
+#include <string>
+
+extern "C" {
+#include "lualib.h"
+#include "lauxlib.h"
+#include "lua.h"
+}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#endif
+
+/*
+ * Scripts compiled at build time and linked in as constant data.
+ *
+ * lua_embed_scripts( ) from lua-build/LuaEmbed.cmake runs the lua_embed
+ * tool over a list of .lua files; the generated source holds the
+ * bytecode and registers it here from a static registrar, under the
+ * script path relative to the bundle's base directory ("test.lua",
+ * "lib/util.lua"). load_embedded( L, name ) then runs a chunk with no
+ * file I/O and no parser.
+ *
+ * Chunks are registered during static initialization and only read
+ * afterwards, so lookups need no locking.
+ */
+namespace lua { namespace embedded {
+
+    struct chunk {
+        const char          *name;
+        const unsigned char *data;
+        size_t               size;
+    };
+
+    class registry {
+
+        struct name_less {
+            bool operator ( )( const char *l, const char *r ) const
+            {
+                return std::strcmp( l, r ) < 0;
+            }
+        };
+
+        typedef std::map<const char *, const chunk *, name_less> map_type;
+
+    public:
+
+        static registry &instance( )
+        {
+            static registry inst;
+            return inst;
+        }
+
+        /// the first chunk registered under a name wins
+        void add( const chunk *chunks, size_t count )
+        {
+            for( size_t i = 0; i < count; ++i ) {
+                chunks_.insert( std::make_pair( chunks[i].name, &chunks[i] ) );
+            }
+        }
+
+        const chunk *find( const char *name ) const
+        {
+            map_type::const_iterator it = chunks_.find( name );
+            return it == chunks_.end( ) ? nullptr : it->second;
+        }
+
+        template <typename Func>
+        void for_each( Func call ) const
+        {
+            for( map_type::const_iterator it = chunks_.begin( );
+                 it != chunks_.end( ); ++it )
+            {
+                call( *it->second );
+            }
+        }
+
+        size_t size( ) const
+        {
+            return chunks_.size( );
+        }
+
+    private:
+        map_type chunks_;
+    };
+
+    /// what the generated source instantiates
+    struct registrar {
+        registrar( const chunk *chunks, size_t count )
+        {
+            registry::instance( ).add( chunks, count );
+        }
+    };
+
+    /// same contract as luaL_loadfile; LUA_ERRFILE for an unknown name
+    inline int load( lua_State *L, const char *name )
+    {
+        const chunk *c = registry::instance( ).find( name );
+        if( !c ) {
+            lua_pushfstring( L, "embedded chunk '%s' not found", name );
+            return LUA_ERRFILE;
+        }
+        /// "@name", as lua_embed compiled it
+        std::string chunkname( "@" );
+        chunkname.append( name );
+        return luaL_loadbufferx( L, reinterpret_cast<const char *>(c->data),
+                                 c->size, chunkname.c_str( ), "b" );
+    }
+
+    /// load and run the chunk; same results as state::load_file
+    inline int load_embedded( lua_State *L, const char *name )
+    {
+        int res = load( L, name );
+        if( 0 == res ) {
+            res = lua_pcall( L, 0, LUA_MULTRET, 0 );
+        }
+        return res;
+    }
+
+}}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#endif // LUA_EMBEDDED_HPP
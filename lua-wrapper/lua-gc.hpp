@@ -0,0 +1,578 @@
+#ifndef LUA_GC_HPP
+#define LUA_GC_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#include <stdint.h>
+
+extern "C" {
+#include "lualib.h"
+#include "lauxlib.h"
+#include "lua.h"
+}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#endif
+
+/*
+ * Collector settings and numbers.
+ *
+ * configure( L, config ) switches between the incremental and the
+ * generational collector (5.4) and sets their parameters; a zero
+ * parameter keeps the current value, like lua_gc does.
+ *
+ * telemetry counts, for one state, from start( ) to stop( ):
+ *  - collections: completed cycles; in generational mode minor and
+ *    major collections both count. A finalizer-only sentinel object
+ *    that is re-created every time it is collected does the counting;
+ *  - bytes allocated and freed, from a layer over the state's allocator;
+ *  - steps and the time in them, for the collection work the host asks
+ *    for through collect( ), step( ) (and lua::state's gc_ calls). The
+ *    steps Lua runs by itself inside allocations are not timed: there
+ *    is no hook for them.
+ *
+ * step_for( L, budget ) moves collection work into idle time; see
+ * there.
+ *
+ * Like the profilers, a telemetry lives on the thread that runs the
+ * state and is stopped before lua_close; allocator layers (telemetry,
+ * profiler::alloc_sampler) are stopped in reverse order of start.
+ */
+namespace lua { namespace gc {
+
+    enum collector_mode {
+         MODE_INCREMENTAL  = 0
+        ,MODE_GENERATIONAL = 1
+    };
+
+    struct config {
+
+        collector_mode mode = MODE_INCREMENTAL;
+
+        /// incremental
+        int pause            = 0;   /// new cycle when heap is pause% of
+                                    /// the live size after the last one
+        int step_multiplier  = 0;   /// collector speed vs allocation, %
+        int step_size        = 0;   /// log2 of the bytes per step (5.4)
+
+        /// generational (5.4)
+        int minor_multiplier = 0;   /// minor when the heap grew minor%
+        int major_multiplier = 0;   /// major when it grew major% since
+                                    /// the last major
+
+        static config incremental( int pause = 0, int step_multiplier = 0,
+                                   int step_size = 0 )
+        {
+            config res;
+            res.mode            = MODE_INCREMENTAL;
+            res.pause           = pause;
+            res.step_multiplier = step_multiplier;
+            res.step_size       = step_size;
+            return res;
+        }
+
+        static config generational( int minor_multiplier = 0,
+                                    int major_multiplier = 0 )
+        {
+            config res;
+            res.mode             = MODE_GENERATIONAL;
+            res.minor_multiplier = minor_multiplier;
+            res.major_multiplier = major_multiplier;
+            return res;
+        }
+    };
+
+    namespace detail {
+
+        /// what step_for knows about a state between its calls
+        struct pacing {
+            bool     in_cycle;      /// a cycle is open
+            uint64_t cycles;        /// ended, counted by the sentinel
+            uint64_t seen_cycles;   /// cycles at the last step_for
+            size_t   cycle_heap;    /// heap when the last one ended
+            size_t   idle_heap;     /// heap after the last step_for
+            size_t   growth;        /// a request's allocation, averaged
+            unsigned cycle_calls;   /// step_for calls the last cycle took
+            unsigned calls;         /// calls into the open cycle so far
+            size_t   prepaid;       /// credit given in the open cycle
+        };
+
+        inline void *pacing_key( )
+        {
+            static char key;
+            return &key;
+        }
+
+        inline void *mode_key( )
+        {
+            static char key;
+            return &key;
+        }
+
+        /// the mode set through configure; incremental if none was
+        inline collector_mode mode_of( lua_State *L )
+        {
+            lua_rawgetp( L, LUA_REGISTRYINDEX, mode_key( ) );
+            const collector_mode res = lua_toboolean( L, -1 )
+                                     ? MODE_GENERATIONAL
+                                     : MODE_INCREMENTAL;
+            lua_pop( L, 1 );
+            return res;
+        }
+
+        inline size_t heap_bytes( lua_State *L )
+        {
+            return static_cast<size_t>(lua_gc( L, LUA_GCCOUNT, 0 )) * 1024
+                 + static_cast<size_t>(lua_gc( L, LUA_GCCOUNTB, 0 ));
+        }
+
+        int lcall_pacing_sentinel_gc( lua_State *L );
+
+        /// garbage with a finalizer: each cycle that ends runs it
+        inline void push_pacing_sentinel( lua_State *L )
+        {
+            lua_newuserdata( L, 1 );
+            lua_createtable( L, 0, 1 );
+            lua_pushcfunction( L, &lcall_pacing_sentinel_gc );
+            lua_setfield( L, -2, "__gc" );
+            lua_setmetatable( L, -2 );
+            lua_pop( L, 1 );
+        }
+
+        /// the pacing of L if step_for ever ran on it, or nullptr
+        inline pacing *find_pacing( lua_State *L )
+        {
+            lua_rawgetp( L, LUA_REGISTRYINDEX, pacing_key( ) );
+            pacing *res = static_cast<pacing *>(lua_touserdata( L, -1 ));
+            lua_pop( L, 1 );
+            return res;
+        }
+
+        /// forget the open cycle; the heap now is its end
+        inline void reset_pacing( lua_State *L, pacing *p )
+        {
+            p->in_cycle    = false;
+            p->seen_cycles = p->cycles;
+            p->cycle_heap  = p->idle_heap = heap_bytes( L );
+            p->calls       = 0;
+            p->prepaid     = 0;
+        }
+
+        /// trivially destructible, so lua_close just frees it
+        inline pacing *pacing_of( lua_State *L )
+        {
+            pacing *res = find_pacing( L );
+            if( !res ) {
+                res = static_cast<pacing *>(
+                            lua_newuserdata( L, sizeof(pacing) ) );
+                res->cycles      = 0;
+                res->growth      = 0;
+                res->cycle_calls = 1;
+                reset_pacing( L, res );
+                lua_rawsetp( L, LUA_REGISTRYINDEX, pacing_key( ) );
+                push_pacing_sentinel( L );
+            }
+            return res;
+        }
+
+        /// lua_gc is off inside finalizers: the heap is read later
+        inline int lcall_pacing_sentinel_gc( lua_State *L )
+        {
+            lua_rawgetp( L, LUA_REGISTRYINDEX, pacing_key( ) );
+            pacing *p = static_cast<pacing *>(lua_touserdata( L, -1 ));
+            lua_pop( L, 1 );
+            if( p ) {
+                ++p->cycles;
+                push_pacing_sentinel( L );
+            }
+            return 0;
+        }
+
+        /// the pause parameter, in %
+        inline int current_pause( lua_State *L )
+        {
+            const int res = lua_gc( L, LUA_GCSETPAUSE, 200 );
+            lua_gc( L, LUA_GCSETPAUSE, res );
+            return res;
+        }
+    }
+
+    /// returns the previous mode; throws std::runtime_error for the
+    /// generational mode on Lua 5.3
+    inline collector_mode configure( lua_State *L, const config &conf )
+    {
+#if LUA_VERSION_NUM >= 504
+        int prev = 0;
+        if( conf.mode == MODE_GENERATIONAL ) {
+            prev = lua_gc( L, LUA_GCGEN, conf.minor_multiplier,
+                           conf.major_multiplier );
+        } else {
+            prev = lua_gc( L, LUA_GCINC, conf.pause,
+                           conf.step_multiplier, conf.step_size );
+        }
+        lua_pushboolean( L, conf.mode == MODE_GENERATIONAL );
+        lua_rawsetp( L, LUA_REGISTRYINDEX, detail::mode_key( ) );
+        /// a switch ends the cycle (to generational: a full collection)
+        detail::pacing *p = detail::find_pacing( L );
+        if( p ) {
+            detail::reset_pacing( L, p );
+        }
+        return prev == LUA_GCGEN ? MODE_GENERATIONAL : MODE_INCREMENTAL;
+#else
+        if( conf.mode == MODE_GENERATIONAL ) {
+            throw std::runtime_error( "generational collection needs "
+                                      "Lua 5.4" );
+        }
+        if( conf.pause ) {
+            lua_gc( L, LUA_GCSETPAUSE, conf.pause );
+        }
+        if( conf.step_multiplier ) {
+            lua_gc( L, LUA_GCSETSTEPMUL, conf.step_multiplier );
+        }
+        return MODE_INCREMENTAL;
+#endif
+    }
+
+    /// bytes in use by the state
+    inline size_t heap_bytes( lua_State *L )
+    {
+        return detail::heap_bytes( L );
+    }
+
+    struct stats {
+        uint64_t collections     = 0;
+        uint64_t steps           = 0;   /// host-driven steps and collects
+        uint64_t step_ns         = 0;
+        uint64_t bytes_allocated = 0;
+        uint64_t bytes_freed     = 0;
+        size_t   heap_bytes      = 0;   /// at the time of the snapshot
+    };
+
+    struct step_report {
+        unsigned                  steps        = 0;
+        bool                      cycle_done   = false;
+        size_t                    bytes_freed  = 0;   /// heap shrink
+        std::chrono::microseconds elapsed{ 0 };
+    };
+
+    class telemetry {
+
+        typedef std::chrono::steady_clock clock_type;
+
+        static void *registry_key( )
+        {
+            static char key;
+            return &key;
+        }
+
+        /// tells this start's sentinels from ones left by earlier runs
+        static uint64_t next_serial( )
+        {
+            static std::atomic<uint64_t> serial( 0 );
+            return ++serial;
+        }
+
+    public:
+
+        explicit telemetry( lua_State *L )
+            :L_(L)
+            ,next_alloc_f_(nullptr)
+            ,next_ud_(nullptr)
+            ,running_(false)
+            ,serial_(0)
+        { }
+
+        telemetry( const telemetry & ) = delete;
+        telemetry &operator = ( const telemetry & ) = delete;
+
+        ~telemetry( )
+        {
+            stop( );
+        }
+
+        /// the running telemetry of L or nullptr
+        static telemetry *of( lua_State *L )
+        {
+            lua_rawgetp( L, LUA_REGISTRYINDEX, registry_key( ) );
+            telemetry *res =
+                    static_cast<telemetry *>(lua_touserdata( L, -1 ));
+            lua_pop( L, 1 );
+            return res;
+        }
+
+        /// throws std::runtime_error if L already has one running
+        void start( )
+        {
+            if( running_ ) {
+                return;
+            }
+            if( of( L_ ) ) {
+                throw std::runtime_error( "gc telemetry is already running "
+                                          "on this state" );
+            }
+            lua_pushlightuserdata( L_, this );
+            lua_rawsetp( L_, LUA_REGISTRYINDEX, registry_key( ) );
+            next_alloc_f_ = lua_getallocf( L_, &next_ud_ );
+            lua_setallocf( L_, &lcall_alloc, this );
+            running_ = true;
+            serial_  = next_serial( );
+            push_sentinel( L_, serial_ );
+        }
+
+        /// the sentinel left behind is not renewed
+        void stop( )
+        {
+            if( !running_ ) {
+                return;
+            }
+            lua_setallocf( L_, next_alloc_f_, next_ud_ );
+            lua_pushnil( L_ );
+            lua_rawsetp( L_, LUA_REGISTRYINDEX, registry_key( ) );
+            running_ = false;
+        }
+
+        bool running( ) const
+        {
+            return running_;
+        }
+
+        stats get( ) const
+        {
+            stats res = stats_;
+            res.heap_bytes = heap_bytes( L_ );
+            return res;
+        }
+
+        void reset( )
+        {
+            stats_ = stats( );
+        }
+
+        void record_step( uint64_t ns )
+        {
+            ++stats_.steps;
+            stats_.step_ns += ns;
+        }
+
+        /*
+         * A step or a full collection, timed into the telemetry of L if
+         * it has one running. kb is the LUA_GCSTEP argument. Returns
+         * lua_gc's result (1: a step finished a cycle).
+         */
+        static int step( lua_State *L, int kb = 0 )
+        {
+            return timed( L, LUA_GCSTEP, kb );
+        }
+
+        static int collect( lua_State *L )
+        {
+            return timed( L, LUA_GCCOLLECT, 0 );
+        }
+
+        /*
+         * Collection work for the idle time between requests: steps
+         * (LUA_GCSTEP 0, timed like step( )) while the budget lasts. A
+         * step is not split, so the last one may overrun by its length.
+         *
+         * Once a cycle is open, every allocation pays for a share of it,
+         * so a cycle the collector starts inside a request is mostly
+         * finished by that request. step_for therefore
+         *  - starts the next cycle itself while the collector pauses,
+         *    as many requests ahead of the collector's own start (the
+         *    heap after the last cycle times the pause) as the last
+         *    cycle took step_for calls to finish;
+         *  - drives an open cycle on until it ends (then stops), whoever
+         *    opened it;
+         *  - after steps that left the cycle open, pre-pays the next
+         *    request: a negative LUA_GCSTEP gives the collector credit
+         *    for about one and a half requests of allocation, so that
+         *    request runs no steps. The credit in one cycle is capped at
+         *    half the pause headroom; past that the requests help again;
+         *  - in generational mode (as set through configure) runs one
+         *    young collection if the heap grew since the last call.
+         * A request's allocation is learnt from the heap growth between
+         * calls while the collector pauses.
+         *
+         * The collector mode is only known if it was set with configure;
+         * collectgarbage( "generational" ) from a script is not seen.
+         */
+        static step_report step_for( lua_State *L,
+                                     std::chrono::microseconds budget )
+        {
+            step_report res;
+            const clock_type::time_point start    = clock_type::now( );
+            const clock_type::time_point deadline = start + budget;
+            detail::pacing *p = detail::pacing_of( L );
+            const collector_mode mode = detail::mode_of( L );
+            const size_t before = heap_bytes( L );
+
+            if( p->cycles != p->seen_cycles ) {
+                /// a request ended the cycle; since then the heap grew
+                /// by at most one request. If it was one of ours, the
+                /// next one starts a call earlier
+                if( p->in_cycle ) {
+                    p->cycle_calls = p->calls + 2;
+                }
+                p->in_cycle    = false;
+                p->seen_cycles = p->cycles;
+                p->cycle_heap  = before > p->growth ? before - p->growth
+                                                    : before;
+                p->calls       = 0;
+                p->prepaid     = 0;
+            } else if( !p->in_cycle && before > p->idle_heap ) {
+                /// paused, so nothing was freed: all of it is allocation
+                const size_t grown = before - p->idle_heap;
+                p->growth = p->growth ? ( p->growth * 3 + grown ) / 4
+                                      : grown;
+            }
+
+            const size_t pause = static_cast<size_t>(
+                                        detail::current_pause( L ) );
+            bool run = true;
+            if( mode == MODE_GENERATIONAL ) {
+                run = before > p->idle_heap;
+            } else if( !p->in_cycle ) {
+                const size_t trigger = p->cycle_heap / 100 * pause;
+                const size_t ahead   = p->growth * ( p->cycle_calls + 1 );
+                run = before + ahead >= trigger;
+            }
+
+            clock_type::time_point now = start;
+            while( run && now < deadline ) {
+                ++res.steps;
+                if( step( L, 0 ) ) {
+                    res.cycle_done = true;
+                    break;
+                }
+                if( mode == MODE_GENERATIONAL ) {
+                    break;
+                }
+                now = clock_type::now( );
+            }
+
+            const size_t after = heap_bytes( L );
+            if( res.cycle_done || p->cycles != p->seen_cycles ) {
+                p->cycle_calls = p->calls + 1;
+                p->in_cycle    = false;
+                p->seen_cycles = p->cycles;
+                p->cycle_heap  = after;
+                p->calls       = 0;
+                p->prepaid     = 0;
+            } else if( res.steps && mode == MODE_INCREMENTAL ) {
+                p->in_cycle = true;
+                ++p->calls;
+                const size_t headroom = pause > 100
+                            ? p->cycle_heap / 100 * ( pause - 100 ) / 2 : 0;
+                const size_t credit = p->growth + p->growth / 2;
+                if( credit >= 1024 && p->prepaid + credit <= headroom ) {
+                    p->prepaid += credit;
+                    lua_gc( L, LUA_GCSTEP,
+                            -static_cast<int>(credit / 1024) );
+                }
+            }
+            p->idle_heap    = after;
+            res.bytes_freed = before > after ? before - after : 0;
+            res.elapsed = std::chrono::duration_cast<
+                            std::chrono::microseconds>( clock_type::now( )
+                                                      - start );
+            return res;
+        }
+
+    private:
+
+        static uint64_t since( clock_type::time_point start )
+        {
+            return static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        clock_type::now( ) - start ).count( ) );
+        }
+
+        static int timed( lua_State *L, int what, int data )
+        {
+            telemetry *t = of( L );
+            clock_type::time_point start;
+            if( t ) {
+                start = clock_type::now( );
+            }
+            const int res = lua_gc( L, what, data );
+            if( t ) {
+                t->record_step( since( start ) );
+            }
+            /// step_for goes on with a cycle the host opened; states it
+            /// never ran on get no pacing
+            detail::pacing *p = detail::find_pacing( L );
+            if( p ) {
+                p->in_cycle = what == LUA_GCSTEP && res == 0;
+            }
+            return res;
+        }
+
+        static void push_sentinel( lua_State *L, uint64_t serial )
+        {
+            void *mem = lua_newuserdata( L, sizeof(serial) );
+            std::memcpy( mem, &serial, sizeof(serial) );
+            lua_createtable( L, 0, 1 );
+            lua_pushcfunction( L, &lcall_sentinel_gc );
+            lua_setfield( L, -2, "__gc" );
+            lua_setmetatable( L, -2 );
+            lua_pop( L, 1 );
+        }
+
+        /// one cycle done: count it and leave garbage for the next one
+        static int lcall_sentinel_gc( lua_State *L )
+        {
+            uint64_t serial = 0;
+            std::memcpy( &serial, lua_touserdata( L, 1 ), sizeof(serial) );
+            telemetry *t = of( L );
+            if( t && t->serial_ == serial ) {
+                ++t->stats_.collections;
+                push_sentinel( L, serial );
+            }
+            return 0;
+        }
+
+        void *alloc( void *ptr, size_t old_size, size_t new_size )
+        {
+            void *res = next_alloc_f_( next_ud_, ptr, old_size, new_size );
+            /// old_size is the Lua type of a new block, not a size
+            const size_t old_bytes = ptr ? old_size : 0;
+            if( new_size == 0 ) {
+                stats_.bytes_freed += old_bytes;
+            } else if( res ) {
+                if( new_size > old_bytes ) {
+                    stats_.bytes_allocated += new_size - old_bytes;
+                } else {
+                    stats_.bytes_freed += old_bytes - new_size;
+                }
+            }
+            return res;
+        }
+
+        static void *lcall_alloc( void *ud, void *ptr,
+                                  size_t old_size, size_t new_size )
+        {
+            return static_cast<telemetry *>(ud)->alloc( ptr, old_size,
+                                                         new_size );
+        }
+
+        lua_State  *L_;
+        lua_Alloc   next_alloc_f_;
+        void       *next_ud_;
+        bool        running_;
+        uint64_t    serial_;
+        stats       stats_;
+    };
+
+}}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#endif // LUA_GC_HPP
@@ -0,0 +1,480 @@
+#ifndef LUA_HOT_RELOAD_HPP
+#define LUA_HOT_RELOAD_HPP
+
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <sys/inotify.h>
+#include <unistd.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+extern "C" {
+#include "lualib.h"
+#include "lauxlib.h"
+#include "lua.h"
+}
+
+#include "lua-chunk-reader.hpp"
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#endif
+
+/*
+ * Reloading modules in a running state.
+ *
+ * watcher::watch( name, path ) ties a module name (as for require) to
+ * its file. poll( ) picks up the files that changed since the last call
+ * (inotify on Linux, modification times elsewhere) and reloads those
+ * modules; reload( name ) does the same on demand.
+ *
+ * A reload runs the new chunk like require would and merges the result
+ * into what is already there instead of replacing it:
+ *
+ *  - module table vs module table: every function field is replaced in
+ *    the old table, data fields already in it are kept, new fields are
+ *    added. Code that did `local m = require "x"` sees the new functions
+ *    through the same table, and the module keeps its state: upvalues
+ *    of the new functions that refer to the new module table are
+ *    pointed at the old one.
+ *  - globals that hold one of the replaced functions (or the old module
+ *    value itself) are pointed at the new one.
+ *  - anything else (a module returning a function, say) replaces
+ *    package.loaded[name].
+ *
+ * Locals and upvalues elsewhere that captured an old function keep it;
+ * that is what function_ref is for. Every successful reload bumps the
+ * state's generation, and a function_ref resolves its module field
+ * again when the generation moved, so host-side cached handles call the
+ * new code on the next push.
+ *
+ * A chunk that fails to compile or run leaves the module untouched.
+ */
+namespace lua { namespace reload {
+
+    namespace detail {
+
+        inline void *generation_key( )
+        {
+            static char key;
+            return &key;
+        }
+
+        inline void push_loaded( lua_State *L )
+        {
+            luaL_getsubtable( L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE );
+        }
+
+        /// t[k] = map[t[k]] for the values of the table at idx that
+        /// the table at map has a replacement for
+        inline void replace_values( lua_State *L, int idx, int map )
+        {
+            idx = lua_absindex( L, idx );
+            map = lua_absindex( L, map );
+            lua_pushnil( L );
+            while( lua_next( L, idx ) ) {
+                lua_pushvalue( L, -1 );
+                if( lua_rawget( L, map ) != LUA_TNIL ) {
+                    lua_pushvalue( L, -3 );     /// key
+                    lua_insert( L, -2 );        /// key, new
+                    lua_rawset( L, idx );
+                } else {
+                    lua_pop( L, 1 );
+                }
+                lua_pop( L, 1 );
+            }
+        }
+
+        /// upvalues of the function at func that hold the table at from
+        /// are pointed at the table at to
+        inline void rebind_upvalues( lua_State *L, int func,
+                                     int from, int to )
+        {
+            for( int n = 1; lua_getupvalue( L, func, n ); ++n ) {
+                const bool same = lua_rawequal( L, -1, from ) != 0;
+                lua_pop( L, 1 );
+                if( same ) {
+                    lua_pushvalue( L, to );
+                    lua_setupvalue( L, func, n );
+                }
+            }
+        }
+
+        /*
+         * Merges the table at src into the table at dst and records
+         * old function -> new function in the table at map. The new
+         * functions that closed over src (the chunk's `local M`) get dst
+         * instead, so they work on the module state that was kept.
+         */
+        inline void merge_module( lua_State *L, int dst, int src, int map )
+        {
+            dst = lua_absindex( L, dst );
+            src = lua_absindex( L, src );
+            map = lua_absindex( L, map );
+            lua_pushnil( L );
+            while( lua_next( L, src ) ) {
+                lua_pushvalue( L, -2 );
+                int old_type = lua_rawget( L, dst );
+                const bool is_func = lua_type( L, -2 ) == LUA_TFUNCTION;
+                if( is_func && !lua_iscfunction( L, -2 ) ) {
+                    rebind_upvalues( L, lua_absindex( L, -2 ), src, dst );
+                }
+                if( is_func && old_type == LUA_TFUNCTION
+                            && !lua_rawequal( L, -1, -2 ) )
+                {
+                    lua_pushvalue( L, -2 );
+                    lua_rawset( L, map );       /// map[old] = new
+                } else {
+                    lua_pop( L, 1 );
+                }
+                if( is_func || old_type == LUA_TNIL ) {
+                    lua_pushvalue( L, -2 );
+                    lua_pushvalue( L, -2 );
+                    lua_rawset( L, dst );
+                }
+                lua_pop( L, 1 );
+            }
+        }
+    }
+
+    /// how many reloads succeeded in this state
+    inline lua_Integer generation( lua_State *L )
+    {
+        lua_rawgetp( L, LUA_REGISTRYINDEX, detail::generation_key( ) );
+        lua_Integer res = lua_tointeger( L, -1 );
+        lua_pop( L, 1 );
+        return res;
+    }
+
+    inline void bump_generation( lua_State *L )
+    {
+        lua_pushinteger( L, generation( L ) + 1 );
+        lua_rawsetp( L, LUA_REGISTRYINDEX, detail::generation_key( ) );
+    }
+
+    /*
+     * Loads path, runs it with (name, path) like require and merges the
+     * result into package.loaded[name]. On failure the message is in
+     * error and nothing changed.
+     */
+    inline bool reload_module( lua_State *L, const std::string &name,
+                               const std::string &path, std::string &error )
+    {
+        const int top = lua_gettop( L );
+        int res = chunk::load_mapped( L, path.c_str( ) );
+        if( res == LUA_OK ) {
+            lua_pushlstring( L, name.c_str( ), name.size( ) );
+            lua_pushlstring( L, path.c_str( ), path.size( ) );
+            res = lua_pcall( L, 2, 1, 0 );
+        }
+        if( res != LUA_OK ) {
+            const char *msg = lua_tostring( L, -1 );
+            error = msg ? msg : "unknown error";
+            lua_settop( L, top );
+            return false;
+        }
+        if( lua_isnil( L, -1 ) ) {
+            lua_pop( L, 1 );
+            lua_pushboolean( L, 1 );                /// as require does
+        }
+        const int fresh = lua_gettop( L );
+
+        detail::push_loaded( L );
+        const int loaded = lua_gettop( L );
+        lua_getfield( L, loaded, name.c_str( ) );
+        const int old = lua_gettop( L );
+
+        lua_newtable( L );
+        const int map = lua_gettop( L );
+
+        if( lua_istable( L, old ) && lua_istable( L, fresh ) ) {
+            detail::merge_module( L, old, fresh, map );
+        } else {
+            if( !lua_isnil( L, old ) && !lua_rawequal( L, old, fresh ) ) {
+                lua_pushvalue( L, old );
+                lua_pushvalue( L, fresh );
+                lua_rawset( L, map );
+            }
+            lua_pushvalue( L, fresh );
+            lua_setfield( L, loaded, name.c_str( ) );
+        }
+
+        lua_pushglobaltable( L );
+        detail::replace_values( L, -1, map );
+        lua_settop( L, top );
+
+        bump_generation( L );
+        return true;
+    }
+
+    /*
+     * A host-side handle to package.loaded[module][field] (or to the
+     * module value itself with an empty field) that follows reloads.
+     */
+    class function_ref {
+
+    public:
+
+        function_ref( lua_State *L, std::string module, std::string field )
+            :L_(L)
+            ,module_(std::move( module ))
+            ,field_(std::move( field ))
+            ,ref_(LUA_NOREF)
+            ,generation_(-1)
+        { }
+
+        function_ref( function_ref &&other )
+            :L_(other.L_)
+            ,module_(std::move( other.module_ ))
+            ,field_(std::move( other.field_ ))
+            ,ref_(other.ref_)
+            ,generation_(other.generation_)
+        {
+            other.ref_ = LUA_NOREF;
+        }
+
+        function_ref( const function_ref & ) = delete;
+        function_ref &operator = ( const function_ref & ) = delete;
+        function_ref &operator = ( function_ref && ) = delete;
+
+        ~function_ref( )
+        {
+            luaL_unref( L_, LUA_REGISTRYINDEX, ref_ );
+        }
+
+        /// pushes the current value; false (and nil) if it is missing
+        bool push( )
+        {
+            const lua_Integer gen = generation( L_ );
+            if( gen != generation_ || ref_ == LUA_NOREF ) {
+                resolve( );
+                generation_ = gen;
+            }
+            lua_rawgeti( L_, LUA_REGISTRYINDEX, ref_ );
+            return !lua_isnil( L_, -1 );
+        }
+
+    private:
+
+        void resolve( )
+        {
+            luaL_unref( L_, LUA_REGISTRYINDEX, ref_ );
+            detail::push_loaded( L_ );
+            lua_getfield( L_, -1, module_.c_str( ) );
+            if( !field_.empty( ) ) {
+                if( lua_istable( L_, -1 ) ) {
+                    lua_getfield( L_, -1, field_.c_str( ) );
+                } else {
+                    lua_pushnil( L_ );
+                }
+                lua_remove( L_, -2 );
+            }
+            lua_remove( L_, -2 );
+            ref_ = luaL_ref( L_, LUA_REGISTRYINDEX ); /// LUA_REFNIL for nil
+        }
+
+        lua_State   *L_;
+        std::string  module_;
+        std::string  field_;
+        int          ref_;
+        lua_Integer  generation_;
+    };
+
+    struct reload_result {
+        std::string module;
+        bool        ok;
+        std::string error;
+    };
+
+    class watcher {
+
+        /// (watch descriptor, file name) of a watched path
+        typedef std::pair<int, std::string> entry_key;
+
+        struct file_info {
+            std::vector<std::string> modules;
+#if !defined(__linux__)
+            time_t mtime;
+#endif
+        };
+
+    public:
+
+        /// throws std::runtime_error if file notifications are unavailable
+        explicit watcher( lua_State *L )
+            :L_(L)
+            ,fd_(-1)
+        {
+#if defined(__linux__)
+            fd_ = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+            if( fd_ < 0 ) {
+                throw std::runtime_error( "inotify_init1 failed" );
+            }
+#endif
+        }
+
+        watcher( const watcher & ) = delete;
+        watcher &operator = ( const watcher & ) = delete;
+
+        ~watcher( )
+        {
+#if defined(__linux__)
+            ::close( fd_ );
+#endif
+        }
+
+        /// throws std::runtime_error if path cannot be watched; nothing
+        /// is recorded then
+        void watch( const std::string &module, const std::string &path )
+        {
+#if defined(__linux__)
+            const size_t slash = path.rfind( '/' );
+            const std::string dir = slash == std::string::npos
+                                  ? std::string( "." )
+                                  : path.substr( 0, slash ? slash : 1 );
+            /// editors often replace the file, so watch its directory
+            int wd = inotify_add_watch( fd_, dir.c_str( ),
+                                        IN_CLOSE_WRITE | IN_MOVED_TO );
+            if( wd < 0 ) {
+                throw std::runtime_error( "cannot watch " + dir );
+            }
+            const std::string base = slash == std::string::npos
+                                   ? path : path.substr( slash + 1 );
+            entries_[std::make_pair( wd, base )] = path;
+            file_info &info = files_[path];
+#else
+            file_info &info = files_[path];
+            info.mtime = mtime( path );
+#endif
+            info.modules.push_back( module );
+            modules_[module] = path;
+        }
+
+        /// inotify descriptor for an event loop; -1 where polling is used
+        int fd( ) const
+        {
+            return fd_;
+        }
+
+        /// reloads the modules whose files changed; never blocks
+        std::vector<reload_result> poll( )
+        {
+            std::vector<std::string> changed;
+            std::set<std::string> seen;
+            collect( changed, seen );
+
+            std::vector<reload_result> res;
+            for( size_t i = 0; i < changed.size( ); ++i ) {
+                reload_result r;
+                r.module = changed[i];
+                r.ok     = reload( changed[i], r.error );
+                res.push_back( r );
+            }
+            return res;
+        }
+
+        bool reload( const std::string &module, std::string &error )
+        {
+            std::map<std::string, std::string>::const_iterator it =
+                                                    modules_.find( module );
+            if( it == modules_.end( ) ) {
+                error = "module '" + module + "' is not watched";
+                return false;
+            }
+            return reload_module( L_, module, it->second, error );
+        }
+
+    private:
+
+        void add_changed( const std::string &path,
+                          std::vector<std::string> &changed,
+                          std::set<std::string> &seen )
+        {
+            std::map<std::string, file_info>::const_iterator it =
+                                                        files_.find( path );
+            if( it == files_.end( ) ) {
+                return;
+            }
+            for( size_t i = 0; i < it->second.modules.size( ); ++i ) {
+                if( seen.insert( it->second.modules[i] ).second ) {
+                    changed.push_back( it->second.modules[i] );
+                }
+            }
+        }
+
+#if defined(__linux__)
+        void collect( std::vector<std::string> &changed,
+                      std::set<std::string> &seen )
+        {
+            alignas(inotify_event) char buf[4096];
+            for( ;; ) {
+                ssize_t n = ::read( fd_, buf, sizeof(buf) );
+                if( n < 0 && errno == EINTR ) {
+                    continue;
+                }
+                if( n <= 0 ) {
+                    break;
+                }
+                for( char *p = buf; p < buf + n; ) {
+                    const inotify_event *ev =
+                                reinterpret_cast<const inotify_event *>(p);
+                    p += sizeof(inotify_event) + ev->len;
+                    if( ev->len == 0 ) {
+                        continue;
+                    }
+                    std::map<entry_key, std::string>::const_iterator it =
+                        entries_.find( entry_key( ev->wd, ev->name ) );
+                    if( it == entries_.end( ) ) {
+                        continue;
+                    }
+                    add_changed( it->second, changed, seen );
+                }
+            }
+        }
+#else
+        static time_t mtime( const std::string &path )
+        {
+            struct stat st;
+            return ::stat( path.c_str( ), &st ) == 0 ? st.st_mtime : 0;
+        }
+
+        void collect( std::vector<std::string> &changed,
+                      std::set<std::string> &seen )
+        {
+            for( std::map<std::string, file_info>::iterator
+                    it = files_.begin( ); it != files_.end( ); ++it )
+            {
+                const time_t t = mtime( it->first );
+                if( t != it->second.mtime ) {
+                    it->second.mtime = t;
+                    add_changed( it->first, changed, seen );
+                }
+            }
+        }
+#endif
+
+        lua_State                          *L_;
+        int                                 fd_;
+        std::map<std::string, file_info>    files_;
+        std::map<std::string, std::string>  modules_;
+        std::map<entry_key, std::string>    entries_;
+    };
+
+}}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#endif // LUA_HOT_RELOAD_HPP
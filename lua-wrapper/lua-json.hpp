@@ -0,0 +1,1205 @@
+#ifndef LUA_JSON_HPP
+#define LUA_JSON_HPP
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "lua-wrapper.hpp"
+#include "lua-simd-kernels.hpp"
+#include "lua-text-format.hpp"
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#endif
+
+/*
+ * JSON codec working on the Lua stack and on objects:: trees.
+ *
+ *  - decode pushes values directly; containers are collected on the
+ *    stack and created with lua_createtable presized to their length
+ *  - null is json.null (a NULL light userdata) on both sides
+ *  - tables with keys exactly 1..n are arrays, anything else is an object
+ *    with string or number keys; empty tables follow
+ *    options::empty_table_as_array
+ *  - with options::integers, integral literals decode as integers and
+ *    integral floats encode as "2.0", so the subtype survives a round trip
+ *  - string and whitespace scanning is SSE2 on x86-64
+ *    (LUA_WRAPPER_NO_SIMD disables it)
+ *
+ * Strings are passed through as bytes; UTF-8 is not validated.
+ */
+namespace lua { namespace json {
+
+    struct options {
+
+        bool   empty_table_as_array;
+        bool   integers;
+        size_t max_depth;
+
+        options( )
+            :empty_table_as_array(false)
+            ,integers(true)
+            ,max_depth(128)
+        { }
+    };
+
+    namespace detail {
+
+        inline bool is_special( unsigned char c )
+        {
+            return c == '"' || c == '\\' || c < 0x20;
+        }
+
+        inline bool is_space( unsigned char c )
+        {
+            return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+        }
+
+#ifdef LUA_WRAPPER_SIMD_X86
+        inline unsigned first_bit( unsigned mask )
+        {
+#if defined(_MSC_VER) && !defined(__clang__)
+            unsigned long res;
+            _BitScanForward( &res, mask );
+            return static_cast<unsigned>(res);
+#else
+            return static_cast<unsigned>(__builtin_ctz( mask ));
+#endif
+        }
+#endif
+
+        /// first '"', '\\' or control character in [p, end)
+        inline const char *find_special( const char *p, const char *end )
+        {
+#ifdef LUA_WRAPPER_SIMD_X86
+            const __m128i quote = _mm_set1_epi8( '"' );
+            const __m128i slash = _mm_set1_epi8( '\\' );
+            const __m128i ctrl  = _mm_set1_epi8( 0x1F );
+            while( end - p >= 16 ) {
+                __m128i v = _mm_loadu_si128( reinterpret_cast<const __m128i *>(p) );
+                __m128i m = _mm_or_si128(
+                                _mm_or_si128( _mm_cmpeq_epi8( v, quote ),
+                                              _mm_cmpeq_epi8( v, slash ) ),
+                                _mm_cmpeq_epi8( _mm_min_epu8( v, ctrl ), v ) );
+                unsigned mask = static_cast<unsigned>(_mm_movemask_epi8( m ));
+                if( mask ) {
+                    return p + first_bit( mask );
+                }
+                p += 16;
+            }
+#endif
+            while( p != end && !is_special( static_cast<unsigned char>(*p) ) ) {
+                ++p;
+            }
+            return p;
+        }
+
+        /// first non-whitespace character in [p, end)
+        inline const char *skip_space( const char *p, const char *end )
+        {
+            if( p == end || !is_space( static_cast<unsigned char>(*p) ) ) {
+                return p;
+            }
+#ifdef LUA_WRAPPER_SIMD_X86
+            const __m128i sp = _mm_set1_epi8( ' ' );
+            const __m128i nl = _mm_set1_epi8( '\n' );
+            const __m128i cr = _mm_set1_epi8( '\r' );
+            const __m128i tb = _mm_set1_epi8( '\t' );
+            while( end - p >= 16 ) {
+                __m128i v = _mm_loadu_si128( reinterpret_cast<const __m128i *>(p) );
+                __m128i m = _mm_or_si128(
+                                _mm_or_si128( _mm_cmpeq_epi8( v, sp ),
+                                              _mm_cmpeq_epi8( v, nl ) ),
+                                _mm_or_si128( _mm_cmpeq_epi8( v, cr ),
+                                              _mm_cmpeq_epi8( v, tb ) ) );
+                unsigned mask = ~static_cast<unsigned>(_mm_movemask_epi8( m ))
+                              & 0xFFFFu;
+                if( mask ) {
+                    return p + first_bit( mask );
+                }
+                p += 16;
+            }
+#endif
+            while( p != end && is_space( static_cast<unsigned char>(*p) ) ) {
+                ++p;
+            }
+            return p;
+        }
+
+        inline void append_utf8( std::string &out, uint32_t cp )
+        {
+            if( cp < 0x80 ) {
+                out.push_back( static_cast<char>(cp) );
+            } else if( cp < 0x800 ) {
+                out.push_back( static_cast<char>(0xC0 | (cp >> 6)) );
+                out.push_back( static_cast<char>(0x80 | (cp & 0x3F)) );
+            } else if( cp < 0x10000 ) {
+                out.push_back( static_cast<char>(0xE0 | (cp >> 12)) );
+                out.push_back( static_cast<char>(0x80 | ((cp >> 6) & 0x3F)) );
+                out.push_back( static_cast<char>(0x80 | (cp & 0x3F)) );
+            } else {
+                out.push_back( static_cast<char>(0xF0 | (cp >> 18)) );
+                out.push_back( static_cast<char>(0x80 | ((cp >> 12) & 0x3F)) );
+                out.push_back( static_cast<char>(0x80 | ((cp >> 6) & 0x3F)) );
+                out.push_back( static_cast<char>(0x80 | (cp & 0x3F)) );
+            }
+        }
+    }
+
+    /*
+     * Recursive descent parser. Builder receives the events:
+     *  on_null( ), on_boolean( b ), on_integer( i ), on_number( d ),
+     *  on_string( ptr, len ),
+     *  begin_array( ), array_item( ), end_array( ),
+     *  begin_object( ), object_key( ), object_item( ), end_object( )
+     * object_key follows the on_string of a key, array_item and
+     * object_item follow the value.
+     */
+    template <typename Builder>
+    class parser {
+
+    public:
+
+        parser( Builder &builder, const char *data, size_t len,
+                const options &opts )
+            :builder_(builder)
+            ,begin_(data)
+            ,p_(data)
+            ,end_(data + len)
+            ,opts_(opts)
+        { }
+
+        void parse( )
+        {
+            skip( );
+            parse_value( 0 );
+            skip( );
+            if( p_ != end_ ) {
+                fail( "trailing characters" );
+            }
+        }
+
+    private:
+
+        void fail( const char *what ) const
+        {
+            throw std::runtime_error( std::string( "json: " ) + what
+                                    + " at offset "
+                                    + std::to_string( p_ - begin_ ) );
+        }
+
+        void skip( )
+        {
+            p_ = detail::skip_space( p_, end_ );
+        }
+
+        void expect_more( ) const
+        {
+            if( p_ == end_ ) {
+                fail( "unexpected end of input" );
+            }
+        }
+
+        void literal( const char *word, size_t len )
+        {
+            if( static_cast<size_t>(end_ - p_) < len
+             || std::memcmp( p_, word, len ) != 0 )
+            {
+                fail( "invalid literal" );
+            }
+            p_ += len;
+        }
+
+        void parse_value( size_t depth )
+        {
+            expect_more( );
+            switch( *p_ ) {
+            case '{':
+                parse_object( depth );
+                break;
+            case '[':
+                parse_array( depth );
+                break;
+            case '"':
+                parse_string( );
+                break;
+            case 't':
+                literal( "true", 4 );
+                builder_.on_boolean( true );
+                break;
+            case 'f':
+                literal( "false", 5 );
+                builder_.on_boolean( false );
+                break;
+            case 'n':
+                literal( "null", 4 );
+                builder_.on_null( );
+                break;
+            default:
+                parse_number( );
+                break;
+            }
+        }
+
+        void enter( size_t depth )
+        {
+            if( depth >= opts_.max_depth ) {
+                fail( "nesting too deep" );
+            }
+            ++p_;
+            skip( );
+            expect_more( );
+        }
+
+        void parse_array( size_t depth )
+        {
+            enter( depth );
+            builder_.begin_array( );
+            if( *p_ == ']' ) {
+                ++p_;
+                builder_.end_array( );
+                return;
+            }
+            for( ;; ) {
+                parse_value( depth + 1 );
+                builder_.array_item( );
+                skip( );
+                expect_more( );
+                const char c = *p_++;
+                if( c == ']' ) {
+                    break;
+                } else if( c != ',' ) {
+                    --p_;
+                    fail( "expected ',' or ']'" );
+                }
+                skip( );
+            }
+            builder_.end_array( );
+        }
+
+        void parse_object( size_t depth )
+        {
+            enter( depth );
+            builder_.begin_object( );
+            if( *p_ == '}' ) {
+                ++p_;
+                builder_.end_object( );
+                return;
+            }
+            for( ;; ) {
+                if( *p_ != '"' ) {
+                    fail( "expected string key" );
+                }
+                parse_string( );
+                builder_.object_key( );
+                skip( );
+                expect_more( );
+                if( *p_ != ':' ) {
+                    fail( "expected ':'" );
+                }
+                ++p_;
+                skip( );
+                parse_value( depth + 1 );
+                builder_.object_item( );
+                skip( );
+                expect_more( );
+                const char c = *p_++;
+                if( c == '}' ) {
+                    break;
+                } else if( c != ',' ) {
+                    --p_;
+                    fail( "expected ',' or '}'" );
+                }
+                skip( );
+                expect_more( );
+            }
+            builder_.end_object( );
+        }
+
+        uint32_t hex4( )
+        {
+            if( end_ - p_ < 4 ) {
+                fail( "truncated \\u escape" );
+            }
+            uint32_t res = 0;
+            for( int i = 0; i < 4; ++i ) {
+                const char c = *p_++;
+                res <<= 4;
+                if( c >= '0' && c <= '9' ) {
+                    res |= static_cast<uint32_t>(c - '0');
+                } else if( c >= 'a' && c <= 'f' ) {
+                    res |= static_cast<uint32_t>(c - 'a' + 10);
+                } else if( c >= 'A' && c <= 'F' ) {
+                    res |= static_cast<uint32_t>(c - 'A' + 10);
+                } else {
+                    fail( "bad \\u escape" );
+                }
+            }
+            return res;
+        }
+
+        void parse_escape( )
+        {
+            ++p_;
+            expect_more( );
+            const char c = *p_++;
+            switch( c ) {
+            case '"':  buf_.push_back( '"' );  break;
+            case '\\': buf_.push_back( '\\' ); break;
+            case '/':  buf_.push_back( '/' );  break;
+            case 'b':  buf_.push_back( '\b' ); break;
+            case 'f':  buf_.push_back( '\f' ); break;
+            case 'n':  buf_.push_back( '\n' ); break;
+            case 'r':  buf_.push_back( '\r' ); break;
+            case 't':  buf_.push_back( '\t' ); break;
+            case 'u': {
+                uint32_t cp = hex4( );
+                if( cp >= 0xD800 && cp <= 0xDBFF ) {
+                    if( end_ - p_ < 2 || p_[0] != '\\' || p_[1] != 'u' ) {
+                        fail( "unpaired surrogate" );
+                    }
+                    p_ += 2;
+                    uint32_t lo = hex4( );
+                    if( lo < 0xDC00 || lo > 0xDFFF ) {
+                        fail( "unpaired surrogate" );
+                    }
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                } else if( cp >= 0xDC00 && cp <= 0xDFFF ) {
+                    fail( "unpaired surrogate" );
+                }
+                detail::append_utf8( buf_, cp );
+                break;
+            }
+            default:
+                --p_;
+                fail( "bad escape" );
+            }
+        }
+
+        void parse_string( )
+        {
+            const char *start = ++p_;
+            const char *q = detail::find_special( p_, end_ );
+            if( q != end_ && *q == '"' ) {
+                /// no escapes: straight from the input
+                builder_.on_string( start, static_cast<size_t>(q - start) );
+                p_ = q + 1;
+                return;
+            }
+            buf_.assign( start, q );
+            p_ = q;
+            for( ;; ) {
+                expect_more( );
+                const unsigned char c = static_cast<unsigned char>(*p_);
+                if( c == '"' ) {
+                    ++p_;
+                    break;
+                } else if( c == '\\' ) {
+                    parse_escape( );
+                } else if( c < 0x20 ) {
+                    fail( "control character in string" );
+                } else {
+                    q = detail::find_special( p_, end_ );
+                    buf_.append( p_, q );
+                    p_ = q;
+                }
+            }
+            builder_.on_string( buf_.data( ), buf_.size( ) );
+        }
+
+        static bool is_digit( char c )
+        {
+            return c >= '0' && c <= '9';
+        }
+
+        void parse_number( )
+        {
+            const char *start = p_;
+            const bool negative = ( *p_ == '-' );
+            if( negative ) {
+                ++p_;
+            }
+            if( p_ == end_ || !is_digit( *p_ ) ) {
+                fail( "unexpected character" );
+            }
+
+            /// integral part; exact while it fits in 64 bits
+            uint64_t mag = 0;
+            bool fits = true;
+            if( *p_ == '0' ) {
+                ++p_;
+            } else {
+                while( p_ != end_ && is_digit( *p_ ) ) {
+                    const unsigned d = static_cast<unsigned>(*p_ - '0');
+                    if( mag > (UINT64_MAX - d) / 10 ) {
+                        fits = false;
+                    } else {
+                        mag = mag * 10 + d;
+                    }
+                    ++p_;
+                }
+            }
+
+            bool integral = true;
+            if( p_ != end_ && *p_ == '.' ) {
+                integral = false;
+                ++p_;
+                if( p_ == end_ || !is_digit( *p_ ) ) {
+                    fail( "bad number" );
+                }
+                while( p_ != end_ && is_digit( *p_ ) ) {
+                    ++p_;
+                }
+            }
+            if( p_ != end_ && ( *p_ == 'e' || *p_ == 'E' ) ) {
+                integral = false;
+                ++p_;
+                if( p_ != end_ && ( *p_ == '+' || *p_ == '-' ) ) {
+                    ++p_;
+                }
+                if( p_ == end_ || !is_digit( *p_ ) ) {
+                    fail( "bad number" );
+                }
+                while( p_ != end_ && is_digit( *p_ ) ) {
+                    ++p_;
+                }
+            }
+
+            if( integral && fits && opts_.integers ) {
+                const uint64_t limit = negative
+                    ? static_cast<uint64_t>(LUA_MAXINTEGER) + 1
+                    : static_cast<uint64_t>(LUA_MAXINTEGER);
+                if( mag <= limit ) {
+                    builder_.on_integer( negative
+                        ? static_cast<lua_Integer>(0 - mag)
+                        : static_cast<lua_Integer>(mag) );
+                    return;
+                }
+            }
+
+            double value = 0;
+            text::parse_number( start, p_, value );
+            builder_.on_number( value );
+        }
+
+        Builder         &builder_;
+        const char      *begin_;
+        const char      *p_;
+        const char      *end_;
+        const options   &opts_;
+        std::string      buf_;
+    };
+
+    /// builds Lua values on the stack
+    class stack_builder {
+
+        /// items of an open container sit on the stack above base;
+        /// once the batch is full they are flushed into the table at
+        /// base + 1
+        struct frame {
+            int          base;
+            int          pending;
+            lua_Integer  next;
+            bool         object;
+            bool         table;
+        };
+
+        enum { batch = 256 };
+
+    public:
+
+        explicit stack_builder( lua_State *L )
+            :L_(L)
+        { }
+
+        void on_null( )
+        {
+            lua_pushlightuserdata( L_, nullptr );
+        }
+
+        void on_boolean( bool value )
+        {
+            lua_pushboolean( L_, value ? 1 : 0 );
+        }
+
+        void on_integer( lua_Integer value )
+        {
+            lua_pushinteger( L_, value );
+        }
+
+        void on_number( double value )
+        {
+            lua_pushnumber( L_, static_cast<lua_Number>(value) );
+        }
+
+        void on_string( const char *data, size_t len )
+        {
+            lua_pushlstring( L_, data, len );
+        }
+
+        void begin_array( )
+        {
+            open( false );
+        }
+
+        void array_item( )
+        {
+            item( );
+        }
+
+        void end_array( )
+        {
+            close( );
+        }
+
+        void begin_object( )
+        {
+            open( true );
+        }
+
+        void object_key( )
+        { }
+
+        void object_item( )
+        {
+            item( );
+        }
+
+        void end_object( )
+        {
+            close( );
+        }
+
+    private:
+
+        void open( bool object )
+        {
+            if( !lua_checkstack( L_, batch * 2 + 4 ) ) {
+                throw std::runtime_error( "json: stack overflow" );
+            }
+            frame f = { lua_gettop( L_ ), 0, 1, object, false };
+            frames_.push_back( f );
+        }
+
+        void item( )
+        {
+            frame &f = frames_.back( );
+            if( ++f.pending == batch ) {
+                flush( f, batch * 2 );
+            }
+        }
+
+        void flush( frame &f, int size_hint )
+        {
+            if( !f.table ) {
+                if( f.object ) {
+                    lua_createtable( L_, 0, size_hint );
+                } else {
+                    lua_createtable( L_, size_hint, 0 );
+                }
+                lua_insert( L_, f.base + 1 );
+                f.table = true;
+            }
+            const int t = f.base + 1;
+            if( f.object ) {
+                /// input order, so a repeated key keeps its last value
+                for( int i = 0; i < f.pending; ++i ) {
+                    lua_pushvalue( L_, t + 1 + i * 2 );
+                    lua_pushvalue( L_, t + 2 + i * 2 );
+                    lua_rawset( L_, t );
+                }
+                lua_settop( L_, t );
+            } else {
+                for( int i = f.pending; i > 0; --i ) {
+                    lua_rawseti( L_, t, f.next + i - 1 );
+                }
+                f.next += f.pending;
+            }
+            f.pending = 0;
+        }
+
+        void close( )
+        {
+            frame &f = frames_.back( );
+            flush( f, f.pending );
+            frames_.pop_back( );
+        }
+
+        lua_State          *L_;
+        std::vector<frame>  frames_;
+    };
+
+    /// builds an objects:: tree
+    class object_builder {
+
+        struct frame {
+            objects::table_sptr table;
+            objects::base_sptr  key;
+        };
+
+    public:
+
+        void on_null( )
+        {
+            last_.reset( new objects::nil );
+        }
+
+        void on_boolean( bool value )
+        {
+            last_.reset( objects::new_boolean( value ) );
+        }
+
+        void on_integer( lua_Integer value )
+        {
+            last_.reset( objects::new_integer( value ) );
+        }
+
+        void on_number( double value )
+        {
+            last_.reset( objects::new_number( static_cast<lua_Number>(value) ) );
+        }
+
+        void on_string( const char *data, size_t len )
+        {
+            last_.reset( objects::new_string( data, len ) );
+        }
+
+        void begin_array( )
+        {
+            frame f = { objects::table_sptr( objects::new_table( ) ),
+                        objects::base_sptr( ) };
+            frames_.push_back( f );
+        }
+
+        void array_item( )
+        {
+            frames_.back( ).table->add( last_ );
+        }
+
+        void end_array( )
+        {
+            last_ = frames_.back( ).table;
+            frames_.pop_back( );
+        }
+
+        void begin_object( )
+        {
+            begin_array( );
+        }
+
+        void object_key( )
+        {
+            frames_.back( ).key = last_;
+        }
+
+        void object_item( )
+        {
+            frames_.back( ).table->add( frames_.back( ).key, last_ );
+        }
+
+        void end_object( )
+        {
+            end_array( );
+        }
+
+        objects::base_sptr result( ) const
+        {
+            return last_;
+        }
+
+    private:
+
+        std::vector<frame>  frames_;
+        objects::base_sptr  last_;
+    };
+
+    /// appends JSON text to out; out may be reused between calls
+    class encoder {
+
+    public:
+
+        encoder( std::string &out, const options &opts = options( ) )
+            :out_(out)
+            ,opts_(opts)
+        { }
+
+        void encode( lua_State *L, int idx )
+        {
+            encode_value( L, lua_absindex( L, idx ) );
+        }
+
+        void encode( const objects::base &obj )
+        {
+            encode_object( obj, 0 );
+        }
+
+    private:
+
+        void fail( const std::string &what ) const
+        {
+            throw std::runtime_error( "json: " + what );
+        }
+
+        void put_string( const char *s, size_t len )
+        {
+            static const char hex[ ] = "0123456789abcdef";
+            const char *end = s + len;
+            out_.push_back( '"' );
+            for( ;; ) {
+                const char *q = detail::find_special( s, end );
+                out_.append( s, q );
+                if( q == end ) {
+                    break;
+                }
+                const unsigned char c = static_cast<unsigned char>(*q);
+                switch( c ) {
+                case '"':  out_.append( "\\\"", 2 ); break;
+                case '\\': out_.append( "\\\\", 2 ); break;
+                case '\b': out_.append( "\\b", 2 );  break;
+                case '\f': out_.append( "\\f", 2 );  break;
+                case '\n': out_.append( "\\n", 2 );  break;
+                case '\r': out_.append( "\\r", 2 );  break;
+                case '\t': out_.append( "\\t", 2 );  break;
+                default: {
+                    const char esc[6] = { '\\', 'u', '0', '0',
+                                          hex[c >> 4], hex[c & 0xF] };
+                    out_.append( esc, 6 );
+                }
+                }
+                s = q + 1;
+            }
+            out_.push_back( '"' );
+        }
+
+        void put_integer( lua_Integer value )
+        {
+            text::append_integer( out_, static_cast<long long>(value) );
+        }
+
+        void put_number( lua_Number value )
+        {
+            const double d = static_cast<double>(value);
+            if( d != d || d - d != 0 ) {
+                fail( "cannot encode NaN or infinity" );
+            }
+            const size_t start = out_.size( );
+            text::append_number( out_, d );
+            if( opts_.integers
+             && out_.find_first_of( ".eE", start ) == std::string::npos )
+            {
+                out_.append( ".0", 2 );
+            }
+        }
+
+        void put_key( lua_State *L, int idx )
+        {
+            switch( lua_type( L, idx ) ) {
+            case LUA_TSTRING: {
+                size_t len = 0;
+                const char *s = lua_tolstring( L, idx, &len );
+                put_string( s, len );
+                break;
+            }
+            case LUA_TNUMBER:
+                /// formatted here: lua_tolstring would change the key
+                /// under lua_next
+                out_.push_back( '"' );
+                if( lua_isinteger( L, idx ) ) {
+                    put_integer( lua_tointeger( L, idx ) );
+                } else {
+                    put_number( lua_tonumber( L, idx ) );
+                }
+                out_.push_back( '"' );
+                break;
+            default:
+                fail( "object keys must be strings or numbers" );
+            }
+        }
+
+        void enter( const void *self )
+        {
+            for( const void *p: path_ ) {
+                if( p == self ) {
+                    fail( "cycle detected" );
+                }
+            }
+            if( path_.size( ) >= opts_.max_depth ) {
+                fail( "nesting too deep" );
+            }
+            path_.push_back( self );
+        }
+
+        void encode_table( lua_State *L, int idx )
+        {
+            enter( lua_topointer( L, idx ) );
+            if( !lua_checkstack( L, 4 ) ) {
+                fail( "stack overflow" );
+            }
+
+            const size_t len = static_cast<size_t>(lua_rawlen( L, idx ));
+            size_t total = 0;
+            size_t seq   = 0;
+            lua_pushnil( L );
+            while( lua_next( L, idx ) ) {
+                ++total;
+                if( lua_isinteger( L, -2 ) ) {
+                    lua_Integer k = lua_tointeger( L, -2 );
+                    if( k >= 1 && static_cast<size_t>(k) <= len ) {
+                        ++seq;
+                    }
+                }
+                lua_pop( L, 1 );
+            }
+
+            if( total == 0 ) {
+                out_.append( opts_.empty_table_as_array ? "[]" : "{}", 2 );
+            } else if( seq == total && total == len ) {
+                out_.push_back( '[' );
+                for( size_t i = 1; i <= len; ++i ) {
+                    if( i > 1 ) {
+                        out_.push_back( ',' );
+                    }
+                    lua_rawgeti( L, idx, static_cast<lua_Integer>(i) );
+                    encode_value( L, lua_gettop( L ) );
+                    lua_pop( L, 1 );
+                }
+                out_.push_back( ']' );
+            } else {
+                out_.push_back( '{' );
+                bool first = true;
+                lua_pushnil( L );
+                while( lua_next( L, idx ) ) {
+                    if( !first ) {
+                        out_.push_back( ',' );
+                    }
+                    first = false;
+                    const int top = lua_gettop( L );
+                    put_key( L, top - 1 );
+                    out_.push_back( ':' );
+                    encode_value( L, top );
+                    lua_pop( L, 1 );
+                }
+                out_.push_back( '}' );
+            }
+            path_.pop_back( );
+        }
+
+        void encode_value( lua_State *L, int idx )
+        {
+            switch( lua_type( L, idx ) ) {
+            case LUA_TNIL:
+                out_.append( "null", 4 );
+                break;
+            case LUA_TBOOLEAN:
+                if( lua_toboolean( L, idx ) ) {
+                    out_.append( "true", 4 );
+                } else {
+                    out_.append( "false", 5 );
+                }
+                break;
+            case LUA_TNUMBER:
+                if( lua_isinteger( L, idx ) ) {
+                    put_integer( lua_tointeger( L, idx ) );
+                } else {
+                    put_number( lua_tonumber( L, idx ) );
+                }
+                break;
+            case LUA_TSTRING: {
+                size_t len = 0;
+                const char *s = lua_tolstring( L, idx, &len );
+                put_string( s, len );
+                break;
+            }
+            case LUA_TTABLE:
+                encode_table( L, idx );
+                break;
+            case LUA_TLIGHTUSERDATA:
+                if( lua_touserdata( L, idx ) == nullptr ) {
+                    out_.append( "null", 4 );
+                    break;
+                }
+                /* fall through */
+            default:
+                fail( std::string( "cannot encode " )
+                    + types::id_to_string( lua_type( L, idx ) ) );
+            }
+        }
+
+        /// true if the keys are the integers 1..n in order
+        static bool is_sequence( const objects::base &tab )
+        {
+            for( size_t i = 0; i < tab.count( ); ++i ) {
+                const objects::base *key = tab.at( i )->at( 0 );
+                if( key->type_id( ) != objects::base::TYPE_INTEGER
+                 || key->inum( ) != static_cast<lua_Integer>(i + 1) )
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void encode_object_table( const objects::base &tab, size_t depth )
+        {
+            if( depth >= opts_.max_depth ) {
+                fail( "nesting too deep" );
+            }
+            const size_t n = tab.count( );
+            if( n == 0 ) {
+                out_.append( opts_.empty_table_as_array ? "[]" : "{}", 2 );
+            } else if( is_sequence( tab ) ) {
+                out_.push_back( '[' );
+                for( size_t i = 0; i < n; ++i ) {
+                    if( i ) {
+                        out_.push_back( ',' );
+                    }
+                    encode_object( *tab.at( i )->at( 1 ), depth + 1 );
+                }
+                out_.push_back( ']' );
+            } else {
+                out_.push_back( '{' );
+                for( size_t i = 0; i < n; ++i ) {
+                    if( i ) {
+                        out_.push_back( ',' );
+                    }
+                    const objects::base *key = tab.at( i )->at( 0 );
+                    switch( key->type_id( ) ) {
+                    case objects::base::TYPE_STRING: {
+                        const std::string s( key->str( ) );
+                        put_string( s.data( ), s.size( ) );
+                        break;
+                    }
+                    case objects::base::TYPE_INTEGER:
+                    case objects::base::TYPE_NUMBER:
+                        out_.push_back( '"' );
+                        encode_object( *key, depth + 1 );
+                        out_.push_back( '"' );
+                        break;
+                    default:
+                        fail( "object keys must be strings or numbers" );
+                    }
+                    out_.push_back( ':' );
+                    encode_object( *tab.at( i )->at( 1 ), depth + 1 );
+                }
+                out_.push_back( '}' );
+            }
+        }
+
+        void encode_object( const objects::base &obj, size_t depth )
+        {
+            switch( obj.type_id( ) ) {
+            case objects::base::TYPE_NONE:
+            case objects::base::TYPE_NIL:
+                out_.append( "null", 4 );
+                break;
+            case objects::base::TYPE_BOOL:
+                if( obj.inum( ) ) {
+                    out_.append( "true", 4 );
+                } else {
+                    out_.append( "false", 5 );
+                }
+                break;
+            case objects::base::TYPE_INTEGER:
+#if LUA_VERSION_NUM >= 503
+            case objects::base::TYPE_UINTEGER:
+#endif
+                put_integer( obj.inum( ) );
+                break;
+            case objects::base::TYPE_NUMBER:
+                put_number( obj.num( ) );
+                break;
+            case objects::base::TYPE_STRING: {
+                const std::string s( obj.str( ) );
+                put_string( s.data( ), s.size( ) );
+                break;
+            }
+            case objects::base::TYPE_TABLE:
+                encode_object_table( obj, depth );
+                break;
+            default:
+                fail( std::string( "cannot encode " )
+                    + objects::base::type2string( obj.type_id( ) ) );
+            }
+        }
+
+        std::string               &out_;
+        const options              opts_;
+        std::vector<const void *>  path_;
+    };
+
+    /// pushes the decoded value; the stack is left untouched on error
+    inline void decode( lua_State *L, const char *data, size_t len,
+                        const options &opts = options( ) )
+    {
+        const int top = lua_gettop( L );
+        try {
+            stack_builder builder( L );
+            parser<stack_builder> p( builder, data, len, opts );
+            p.parse( );
+        } catch( ... ) {
+            lua_settop( L, top );
+            throw;
+        }
+    }
+
+    inline objects::base_sptr decode_object( const char *data, size_t len,
+                                             const options &opts = options( ) )
+    {
+        object_builder builder;
+        parser<object_builder> p( builder, data, len, opts );
+        p.parse( );
+        return builder.result( );
+    }
+
+    inline objects::base_sptr decode_object( const std::string &text,
+                                             const options &opts = options( ) )
+    {
+        return decode_object( text.data( ), text.size( ), opts );
+    }
+
+    inline void encode( lua_State *L, int idx, std::string &out,
+                        const options &opts = options( ) )
+    {
+        encoder enc( out, opts );
+        enc.encode( L, idx );
+    }
+
+    inline std::string encode( lua_State *L, int idx,
+                               const options &opts = options( ) )
+    {
+        std::string res;
+        encode( L, idx, res, opts );
+        return res;
+    }
+
+    inline std::string encode( const objects::base &obj,
+                               const options &opts = options( ) )
+    {
+        std::string res;
+        encoder enc( res, opts );
+        enc.encode( obj );
+        return res;
+    }
+
+    /// encode output buffer kept as an upvalue of the library functions
+    struct lib_buffer {
+
+        std::string data;
+
+        static const char *name( )
+        {
+            return "json.buffer";
+        }
+
+        static const struct luaL_Reg *table( )
+        {
+            static const struct luaL_Reg lib[ ] = {
+                { nullptr, nullptr },
+            };
+            return lib;
+        }
+    };
+
+    /// reads { empty_table_as_array =, integers =, max_depth = }
+    inline options read_options( lua_State *L, int idx )
+    {
+        options res;
+        if( lua_isnoneornil( L, idx ) ) {
+            return res;
+        }
+        luaL_checktype( L, idx, LUA_TTABLE );
+        lua_getfield( L, idx, "empty_table_as_array" );
+        if( !lua_isnil( L, -1 ) ) {
+            res.empty_table_as_array = !!lua_toboolean( L, -1 );
+        }
+        lua_getfield( L, idx, "integers" );
+        if( !lua_isnil( L, -1 ) ) {
+            res.integers = !!lua_toboolean( L, -1 );
+        }
+        lua_getfield( L, idx, "max_depth" );
+        if( !lua_isnil( L, -1 ) ) {
+            lua_Integer d = luaL_checkinteger( L, -1 );
+            luaL_argcheck( L, d > 0, idx, "max_depth must be positive" );
+            res.max_depth = static_cast<size_t>(d);
+        }
+        lua_pop( L, 3 );
+        return res;
+    }
+
+    /// json.encode( value [, opts] ) -> string
+    inline int lcall_encode( lua_State *L )
+    {
+        luaL_checkany( L, 1 );
+        const options opts = read_options( L, 2 );
+        lib_buffer *buf = state::test_metatable<lib_buffer>(
+                                L, lua_upvalueindex( 1 ) );
+        bool failed = false;
+        buf->data.clear( );
+        try {
+            encoder enc( buf->data, opts );
+            enc.encode( L, 1 );
+        } catch( const std::exception &ex ) {
+            lua_pushstring( L, ex.what( ) );
+            failed = true;
+        }
+        if( failed ) {
+            return lua_error( L );
+        }
+        lua_pushlstring( L, buf->data.data( ), buf->data.size( ) );
+        return 1;
+    }
+
+    /// json.decode( text [, opts] ) -> value
+    inline int lcall_decode( lua_State *L )
+    {
+        size_t len = 0;
+        const char *text = luaL_checklstring( L, 1, &len );
+        const options opts = read_options( L, 2 );
+        lua_settop( L, 2 );
+        bool failed = false;
+        try {
+            decode( L, text, len, opts );
+        } catch( const std::exception &ex ) {
+            lua_pushstring( L, ex.what( ) );
+            failed = true;
+        }
+        return failed ? lua_error( L ) : 1;
+    }
+
+    /*
+     * json.encode( v [, opts] ), json.decode( s [, opts] ), json.null
+     *
+     * ls.openlib( "json", &lua::json::luaopen_json );
+     */
+    inline int luaopen_json( lua_State *L )
+    {
+        state::register_metatable<lib_buffer>( L );
+        lua_pop( L, 1 );
+
+        static const struct luaL_Reg lib[ ] = {
+            { "encode", &lcall_encode },
+            { "decode", &lcall_decode },
+            { nullptr,  nullptr       },
+        };
+
+        lua_createtable( L, 0, 3 );
+        state::create_metatable<lib_buffer>( L );
+        luaL_setfuncs( L, lib, 1 );
+        lua_pushlightuserdata( L, nullptr );
+        lua_setfield( L, -2, "null" );
+        return 1;
+    }
+
+}}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#endif // LUA_JSON_HPP
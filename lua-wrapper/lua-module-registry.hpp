@@ -0,0 +1,477 @@
+#ifndef LUA_MODULE_REGISTRY_HPP
+#define LUA_MODULE_REGISTRY_HPP
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <stdint.h>
+
+extern "C" {
+#include "lualib.h"
+#include "lauxlib.h"
+#include "lua.h"
+}
+
+#include "lua-bytecode-cache.hpp"
+#include "lua-embedded.hpp"
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#endif
+
+/*
+ * In-memory modules for require.
+ *
+ * modules::registry maps module names to source or bytecode (added by
+ * hand or taken from lua::embedded). install( L ) puts its searcher
+ * first in package.searchers; the searcher
+ *
+ *  - loads registered modules from memory; a module added as source is
+ *    compiled once and later states get its bytecode;
+ *  - for other names runs the remaining searchers itself, so a name
+ *    none of them finds is remembered and the next require of it fails
+ *    at once instead of probing package.path/cpath again. A miss is
+ *    keyed by the name and the package.path and package.cpath it was
+ *    searched with, so states with other paths (or a state that changed
+ *    its paths) search again; package.preload entries are always seen.
+ *    A miss expires after miss_ttl( ) (5 s by default, zero turns the
+ *    cache off), so a file that appears later is found; clear_misses( )
+ *    forgets them all at once and adding the module forgets its own.
+ *    States that install searchers of their own see the same misses
+ *    as states that do not: give those their own registry;
+ *  - times every module it hands to require: compile and run time,
+ *    whichever searcher found it.
+ *
+ * One registry can serve many states on many threads; it must outlive
+ * them. Statistics add up over all of them.
+ */
+namespace lua { namespace modules {
+
+    struct module_stats {
+        bool     in_registry = false;
+        uint64_t loads       = 0;
+        uint64_t compile_ns  = 0;   /// registry modules only
+        uint64_t run_ns      = 0;
+    };
+
+    class registry {
+
+        struct entry {
+            std::string code;
+            bool        binary;
+        };
+
+        typedef std::shared_ptr<const entry>      entry_sptr;
+
+    public:
+
+        typedef std::chrono::steady_clock         clock_type;
+
+        registry( ) = default;
+        registry( const registry & ) = delete;
+        registry &operator = ( const registry & ) = delete;
+
+        void add_source( const std::string &name, std::string text )
+        {
+            add( name, std::move( text ), false );
+        }
+
+        /// code is lua_dump output for the Lua the states run
+        void add_bytecode( const std::string &name, std::string code )
+        {
+            add( name, std::move( code ), true );
+        }
+
+        /*
+         * Adds every embedded chunk as a module: "lib/util.lua" becomes
+         * "lib.util", "lib/init.lua" becomes "lib". Returns the count.
+         */
+        size_t add_embedded( )
+        {
+            size_t count = 0;
+            embedded::registry::instance( ).for_each(
+                [this, &count]( const embedded::chunk &c ) {
+                    std::string name( c.name );
+                    if( name.size( ) > 4
+                     && name.compare( name.size( ) - 4, 4, ".lua" ) == 0 )
+                    {
+                        name.erase( name.size( ) - 4 );
+                    }
+                    for( size_t i = 0; i < name.size( ); ++i ) {
+                        if( name[i] == '/' ) {
+                            name[i] = '.';
+                        }
+                    }
+                    if( name.size( ) > 5
+                     && name.compare( name.size( ) - 5, 5, ".init" ) == 0 )
+                    {
+                        name.erase( name.size( ) - 5 );
+                    }
+                    add( name, std::string( reinterpret_cast<const char *>(
+                                                c.data ), c.size ), true );
+                    ++count;
+                } );
+            return count;
+        }
+
+        bool contains( const std::string &name ) const
+        {
+            std::lock_guard<std::mutex> lck( lock_ );
+            return entries_.find( name ) != entries_.end( );
+        }
+
+        /// makes the searcher the first one in package.searchers
+        void install( lua_State *L )
+        {
+            luaL_getsubtable( L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE );
+            lua_getfield( L, -1, LUA_LOADLIBNAME );
+            if( !lua_istable( L, -1 ) ) {
+                lua_pop( L, 2 );
+                luaL_requiref( L, LUA_LOADLIBNAME, &luaopen_package, 0 );
+                lua_pushnil( L );
+                lua_insert( L, -2 );
+            }
+            lua_getfield( L, -1, "searchers" );
+            const int searchers = lua_gettop( L );
+            for( lua_Integer i = luaL_len( L, searchers ); i >= 1; --i ) {
+                lua_rawgeti( L, searchers, i );
+                lua_rawseti( L, searchers, i + 1 );
+            }
+            lua_pushlightuserdata( L, this );
+            lua_pushcclosure( L, &lcall_search, 1 );
+            lua_rawseti( L, searchers, 1 );
+            lua_pop( L, 3 );
+        }
+
+        void clear_misses( )
+        {
+            std::lock_guard<std::mutex> lck( lock_ );
+            misses_.clear( );
+        }
+
+        /// how long a miss is remembered; zero: not at all
+        void set_miss_ttl( clock_type::duration ttl )
+        {
+            std::lock_guard<std::mutex> lck( lock_ );
+            miss_ttl_ = ttl;
+        }
+
+        clock_type::duration miss_ttl( ) const
+        {
+            std::lock_guard<std::mutex> lck( lock_ );
+            return miss_ttl_;
+        }
+
+        size_t misses( ) const
+        {
+            std::lock_guard<std::mutex> lck( lock_ );
+            return misses_.size( );
+        }
+
+        /// requires answered from the miss cache
+        uint64_t miss_hits( ) const
+        {
+            std::lock_guard<std::mutex> lck( lock_ );
+            return miss_hits_;
+        }
+
+        std::map<std::string, module_stats> stats( ) const
+        {
+            std::lock_guard<std::mutex> lck( lock_ );
+            return stats_;
+        }
+
+        void reset_stats( )
+        {
+            std::lock_guard<std::mutex> lck( lock_ );
+            stats_.clear( );
+            miss_hits_ = 0;
+        }
+
+    private:
+
+        void add( const std::string &name, std::string code, bool binary )
+        {
+            entry_sptr e( new entry{ std::move( code ), binary } );
+            std::lock_guard<std::mutex> lck( lock_ );
+            entries_[name] = e;
+            /// keys are "name\0path\0cpath"
+            std::string prefix( name );
+            prefix.push_back( '\0' );
+            miss_map::iterator it = misses_.lower_bound( prefix );
+            while( it != misses_.end( )
+                && it->first.compare( 0, prefix.size( ), prefix ) == 0 )
+            {
+                it = misses_.erase( it );
+            }
+        }
+
+        entry_sptr find( const std::string &name ) const
+        {
+            std::lock_guard<std::mutex> lck( lock_ );
+            std::map<std::string, entry_sptr>::const_iterator it =
+                                                    entries_.find( name );
+            return it == entries_.end( ) ? entry_sptr( ) : it->second;
+        }
+
+        /// keeps the compiled form of a source module for the next state
+        void upgrade( const std::string &name, const entry_sptr &old,
+                      std::string code )
+        {
+            entry_sptr e( new entry{ std::move( code ), true } );
+            std::lock_guard<std::mutex> lck( lock_ );
+            std::map<std::string, entry_sptr>::iterator it =
+                                                    entries_.find( name );
+            if( it != entries_.end( ) && it->second == old ) {
+                it->second = e;
+            }
+        }
+
+        /// the miss key for name in the state whose package table is at
+        /// package: name, package.path and package.cpath
+        static std::string miss_key( lua_State *L, int package,
+                                     const std::string &name )
+        {
+            static const char *fields[2] = { "path", "cpath" };
+            std::string res( name );
+            for( int i = 0; i < 2; ++i ) {
+                res.push_back( '\0' );
+                if( lua_getfield( L, package, fields[i] ) == LUA_TSTRING ) {
+                    size_t len = 0;
+                    const char *value = lua_tolstring( L, -1, &len );
+                    res.append( value, len );
+                }
+                lua_pop( L, 1 );
+            }
+            return res;
+        }
+
+        static bool preloaded( lua_State *L, const std::string &name )
+        {
+            bool res = false;
+            if( lua_getfield( L, LUA_REGISTRYINDEX,
+                              LUA_PRELOAD_TABLE ) == LUA_TTABLE )
+            {
+                lua_pushlstring( L, name.c_str( ), name.size( ) );
+                res = lua_rawget( L, -2 ) != LUA_TNIL;
+                lua_pop( L, 1 );
+            }
+            lua_pop( L, 1 );
+            return res;
+        }
+
+        bool cached_miss( const std::string &key, std::string &message )
+        {
+            std::lock_guard<std::mutex> lck( lock_ );
+            miss_map::iterator it = misses_.find( key );
+            if( it == misses_.end( ) ) {
+                return false;
+            }
+            if( clock_type::now( ) >= it->second.expires ) {
+                misses_.erase( it );
+                return false;
+            }
+            message = it->second.message;
+            ++miss_hits_;
+            return true;
+        }
+
+        void add_miss( const std::string &key, const std::string &message )
+        {
+            std::lock_guard<std::mutex> lck( lock_ );
+            if( miss_ttl_ <= clock_type::duration::zero( ) ) {
+                return;
+            }
+            const clock_type::time_point now = clock_type::now( );
+            /// paths that are never searched again leave expired keys
+            if( misses_.size( ) >= sweep_at_ ) {
+                for( miss_map::iterator it = misses_.begin( );
+                     it != misses_.end( ); )
+                {
+                    it = now >= it->second.expires ? misses_.erase( it )
+                                                   : ++it;
+                }
+                sweep_at_ = misses_.size( ) * 2 > 1024 ? misses_.size( ) * 2
+                                                       : 1024;
+            }
+            miss &m   = misses_[key];
+            m.message = message;
+            m.expires = now + miss_ttl_;
+        }
+
+        void record_compile( const std::string &name, uint64_t ns )
+        {
+            std::lock_guard<std::mutex> lck( lock_ );
+            stats_[name].compile_ns += ns;
+        }
+
+        void record_run( const std::string &name, bool in_registry,
+                         uint64_t ns )
+        {
+            std::lock_guard<std::mutex> lck( lock_ );
+            module_stats &s = stats_[name];
+            s.in_registry = in_registry;
+            s.run_ns     += ns;
+            ++s.loads;
+        }
+
+        static uint64_t since( clock_type::time_point start )
+        {
+            return static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        clock_type::now( ) - start ).count( ) );
+        }
+
+        /// replaces the loader on the top with its timing wrapper
+        void push_loader( lua_State *L, const std::string &name,
+                          bool in_registry )
+        {
+            lua_pushlightuserdata( L, this );
+            lua_insert( L, -2 );
+            lua_pushlstring( L, name.c_str( ), name.size( ) );
+            lua_pushboolean( L, in_registry ? 1 : 0 );
+            lua_pushcclosure( L, &lcall_load, 4 );
+        }
+
+        /*
+         * The searcher proper. Returns the number of results, or -1 with
+         * the error message pushed; Lua errors are only raised by the
+         * caller, once the C++ locals here are gone.
+         */
+        int search( lua_State *L, const std::string &name )
+        {
+            entry_sptr e = find( name );
+            if( e ) {
+                clock_type::time_point start = clock_type::now( );
+                std::string chunkname = "@" + name;
+                if( luaL_loadbufferx( L, e->code.data( ), e->code.size( ),
+                                      chunkname.c_str( ),
+                                      e->binary ? "b" : "t" ) != LUA_OK )
+                {
+                    lua_pushfstring( L, "error loading module '%s' "
+                                        "from the module registry:\n\t%s",
+                                     name.c_str( ), lua_tostring( L, -1 ) );
+                    return -1;
+                }
+                if( !e->binary ) {
+                    std::string code;
+                    if( bytecode::dump( L, code ) ) {
+                        upgrade( name, e, std::move( code ) );
+                    }
+                }
+                record_compile( name, since( start ) );
+                push_loader( L, name, true );
+                lua_pushliteral( L, ":registry:" );
+                return 2;
+            }
+
+            luaL_getsubtable( L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE );
+            lua_getfield( L, -1, LUA_LOADLIBNAME );
+            const std::string key = miss_key( L, lua_gettop( L ), name );
+
+            std::string message;
+            if( !preloaded( L, name ) && cached_miss( key, message ) ) {
+                lua_pushfstring( L, "module '%s' not found:%s",
+                                 name.c_str( ), message.c_str( ) );
+                return -1;
+            }
+
+            /// the other searchers, the way require runs them
+            lua_getfield( L, -1, "searchers" );
+            const int searchers = lua_gettop( L );
+            for( lua_Integer i = 1; ; ++i ) {
+                if( lua_rawgeti( L, searchers, i ) == LUA_TNIL ) {
+                    lua_pop( L, 1 );
+                    break;
+                }
+                if( lua_tocfunction( L, -1 ) == &lcall_search ) {
+                    lua_pop( L, 1 );
+                    continue;
+                }
+                lua_pushlstring( L, name.c_str( ), name.size( ) );
+                if( lua_pcall( L, 1, 2, 0 ) != LUA_OK ) {
+                    return -1;
+                }
+                if( lua_isfunction( L, -2 ) ) {
+                    lua_insert( L, -2 );            /// extra, loader
+                    push_loader( L, name, false );
+                    lua_insert( L, -2 );            /// loader, extra
+                    return 2;
+                }
+                if( lua_isstring( L, -2 ) ) {
+#if LUA_VERSION_NUM >= 504
+                    message.append( "\n\t" );
+#endif
+                    message.append( lua_tostring( L, -2 ) );
+                }
+                lua_pop( L, 2 );
+            }
+            lua_pop( L, 3 );
+
+            add_miss( key, message );
+            lua_pushfstring( L, "module '%s' not found:%s",
+                             name.c_str( ), message.c_str( ) );
+            return -1;
+        }
+
+        static int lcall_search( lua_State *L )
+        {
+            registry *self = static_cast<registry *>(
+                                lua_touserdata( L, lua_upvalueindex( 1 ) ) );
+            size_t len = 0;
+            const char *name = luaL_checklstring( L, 1, &len );
+            int res = self->search( L, std::string( name, len ) );
+            if( res < 0 ) {
+                return lua_error( L );
+            }
+            return res;
+        }
+
+        /// upvalues: registry, loader, module name, in registry
+        static int lcall_load( lua_State *L )
+        {
+            registry *self = static_cast<registry *>(
+                                lua_touserdata( L, lua_upvalueindex( 1 ) ) );
+            const int nargs = lua_gettop( L );
+            lua_pushvalue( L, lua_upvalueindex( 2 ) );
+            lua_insert( L, 1 );
+            clock_type::time_point start = clock_type::now( );
+            lua_call( L, nargs, 1 );
+            const uint64_t ns = since( start );
+            size_t len = 0;
+            const char *name = lua_tolstring( L, lua_upvalueindex( 3 ), &len );
+            self->record_run( std::string( name, len ),
+                              lua_toboolean( L, lua_upvalueindex( 4 ) ) != 0,
+                              ns );
+            return 1;
+        }
+
+        struct miss {
+            std::string             message;
+            clock_type::time_point  expires;
+        };
+
+        typedef std::map<std::string, miss> miss_map;
+
+        mutable std::mutex                  lock_;
+        std::map<std::string, entry_sptr>   entries_;
+        miss_map                            misses_;
+        std::map<std::string, module_stats> stats_;
+        uint64_t                            miss_hits_ = 0;
+        clock_type::duration                miss_ttl_ =
+                                                std::chrono::seconds( 5 );
+        size_t                              sweep_at_ = 1024;
+    };
+
+}}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#endif // LUA_MODULE_REGISTRY_HPP
@@ -0,0 +1,647 @@
+#ifndef LUA_MSGPACK_HPP
+#define LUA_MSGPACK_HPP
+
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "lua-wrapper.hpp"
+#include "lua-typed-array.hpp"
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#endif
+
+/*
+ * MessagePack encoder/decoder working directly on the Lua stack.
+ *
+ *  - integers and floats stay distinct (int family vs float 64)
+ *  - tables with keys exactly 1..n are arrays, everything else is a map;
+ *    an empty table is an empty map
+ *  - typed arrays are ext values (type 1..4: float32, float64, int32,
+ *    int64) carrying the raw little-endian elements, written and read
+ *    with one memcpy
+ *  - cycles and nesting deeper than max_depth are errors
+ *
+ * Sink is anything with write( const char *data, size_t len ).
+ */
+namespace lua { namespace msgpack {
+
+    enum ext_type {
+         EXT_FLOAT32_ARRAY = 1
+        ,EXT_FLOAT64_ARRAY = 2
+        ,EXT_INT32_ARRAY   = 3
+        ,EXT_INT64_ARRAY   = 4
+    };
+
+    struct string_sink {
+
+        std::string &out;
+
+        explicit string_sink( std::string &o )
+            :out(o)
+        { }
+
+        void write( const char *data, size_t len )
+        {
+            out.append( data, len );
+        }
+    };
+
+    struct stream_sink {
+
+        std::ostream &out;
+
+        explicit stream_sink( std::ostream &o )
+            :out(o)
+        { }
+
+        void write( const char *data, size_t len )
+        {
+            out.write( data, static_cast<std::streamsize>(len) );
+        }
+    };
+
+    template <typename Sink>
+    class encoder {
+
+    public:
+
+        encoder( lua_State *L, Sink &sink, size_t max_depth = 128 )
+            :L_(L)
+            ,sink_(sink)
+            ,max_depth_(max_depth)
+        { }
+
+        void encode( int idx )
+        {
+            encode_value( lua_absindex( L_, idx ) );
+        }
+
+    private:
+
+        void put( const void *data, size_t len )
+        {
+            sink_.write( static_cast<const char *>(data), len );
+        }
+
+        void put_byte( unsigned char b )
+        {
+            put( &b, 1 );
+        }
+
+        /// tag followed by a big-endian value of Bytes bytes
+        template <size_t Bytes>
+        void put_be( unsigned char tag, uint64_t value )
+        {
+            unsigned char buf[Bytes + 1];
+            buf[0] = tag;
+            for( size_t i = 0; i < Bytes; ++i ) {
+                buf[Bytes - i] = static_cast<unsigned char>(value >> (i * 8));
+            }
+            put( buf, Bytes + 1 );
+        }
+
+        void put_integer( lua_Integer v )
+        {
+            if( v >= 0 ) {
+                uint64_t u = static_cast<uint64_t>(v);
+                if( u < 0x80 ) {
+                    put_byte( static_cast<unsigned char>(u) );
+                } else if( u <= 0xFF ) {
+                    put_be<1>( 0xcc, u );
+                } else if( u <= 0xFFFF ) {
+                    put_be<2>( 0xcd, u );
+                } else if( u <= 0xFFFFFFFFull ) {
+                    put_be<4>( 0xce, u );
+                } else {
+                    put_be<8>( 0xcf, u );
+                }
+            } else {
+                uint64_t u = static_cast<uint64_t>(v);
+                if( v >= -32 ) {
+                    put_byte( static_cast<unsigned char>(u) );
+                } else if( v >= -128 ) {
+                    put_be<1>( 0xd0, u );
+                } else if( v >= -32768 ) {
+                    put_be<2>( 0xd1, u );
+                } else if( v >= -2147483648LL ) {
+                    put_be<4>( 0xd2, u );
+                } else {
+                    put_be<8>( 0xd3, u );
+                }
+            }
+        }
+
+        void put_number( lua_Number n )
+        {
+            double d = static_cast<double>(n);
+            uint64_t bits;
+            std::memcpy( &bits, &d, sizeof(bits) );
+            put_be<8>( 0xcb, bits );
+        }
+
+        void put_string( const char *s, size_t len )
+        {
+            if( len < 32 ) {
+                put_byte( static_cast<unsigned char>(0xa0 | len) );
+            } else if( len <= 0xFF ) {
+                put_be<1>( 0xd9, len );
+            } else if( len <= 0xFFFF ) {
+                put_be<2>( 0xda, len );
+            } else {
+                put_be<4>( 0xdb, len );
+            }
+            put( s, len );
+        }
+
+        void put_container( size_t n, unsigned char fix, unsigned char t16 )
+        {
+            if( n < 16 ) {
+                put_byte( static_cast<unsigned char>(fix | n) );
+            } else if( n <= 0xFFFF ) {
+                put_be<2>( t16, n );
+            } else {
+                put_be<4>( static_cast<unsigned char>(t16 + 1), n );
+            }
+        }
+
+        void put_ext_header( size_t len, ext_type t )
+        {
+            if( len <= 0xFF ) {
+                put_be<1>( 0xc7, len );
+            } else if( len <= 0xFFFF ) {
+                put_be<2>( 0xc8, len );
+            } else {
+                put_be<4>( 0xc9, len );
+            }
+            put_byte( static_cast<unsigned char>(t) );
+        }
+
+        template <typename T>
+        bool put_typed_array( int idx, ext_type t )
+        {
+            typed_array<T> *arr = typed_array<T>::test( L_, idx );
+            if( !arr ) {
+                return false;
+            }
+            const size_t len = arr->size( ) * sizeof(T);
+            put_ext_header( len, t );
+            put( arr->data( ), len );
+            return true;
+        }
+
+        void put_userdata( int idx )
+        {
+            if( put_typed_array<double>( idx, EXT_FLOAT64_ARRAY )
+             || put_typed_array<float>( idx, EXT_FLOAT32_ARRAY )
+             || put_typed_array<int64_t>( idx, EXT_INT64_ARRAY )
+             || put_typed_array<int32_t>( idx, EXT_INT32_ARRAY ) )
+            {
+                return;
+            }
+            throw std::runtime_error( "msgpack: cannot encode userdata" );
+        }
+
+        void put_table( int idx )
+        {
+            const void *self = lua_topointer( L_, idx );
+            for( const void *p: path_ ) {
+                if( p == self ) {
+                    throw std::runtime_error( "msgpack: cycle detected" );
+                }
+            }
+            if( path_.size( ) >= max_depth_ ) {
+                throw std::runtime_error( "msgpack: nesting too deep" );
+            }
+            if( !lua_checkstack( L_, 4 ) ) {
+                throw std::runtime_error( "msgpack: stack overflow" );
+            }
+            path_.push_back( self );
+
+            /// one pass to count keys; the table is an array only if
+            /// all keys are exactly 1..rawlen
+            const size_t len = static_cast<size_t>(lua_rawlen( L_, idx ));
+            size_t total = 0;
+            size_t seq   = 0;
+            lua_pushnil( L_ );
+            while( lua_next( L_, idx ) ) {
+                ++total;
+                if( lua_isinteger( L_, -2 ) ) {
+                    lua_Integer k = lua_tointeger( L_, -2 );
+                    if( k >= 1 && static_cast<size_t>(k) <= len ) {
+                        ++seq;
+                    }
+                }
+                lua_pop( L_, 1 );
+            }
+
+            if( total > 0 && seq == total && total == len ) {
+                put_container( len, 0x90, 0xdc );
+                for( size_t i = 1; i <= len; ++i ) {
+                    lua_rawgeti( L_, idx, static_cast<lua_Integer>(i) );
+                    encode_value( lua_gettop( L_ ) );
+                    lua_pop( L_, 1 );
+                }
+            } else {
+                put_container( total, 0x80, 0xde );
+                lua_pushnil( L_ );
+                while( lua_next( L_, idx ) ) {
+                    int top = lua_gettop( L_ );
+                    encode_value( top - 1 );
+                    encode_value( top );
+                    lua_pop( L_, 1 );
+                }
+            }
+            path_.pop_back( );
+        }
+
+        void encode_value( int idx )
+        {
+            switch( lua_type( L_, idx ) ) {
+            case LUA_TNIL:
+                put_byte( 0xc0 );
+                break;
+            case LUA_TBOOLEAN:
+                put_byte( lua_toboolean( L_, idx ) ? 0xc3 : 0xc2 );
+                break;
+            case LUA_TNUMBER:
+                if( lua_isinteger( L_, idx ) ) {
+                    put_integer( lua_tointeger( L_, idx ) );
+                } else {
+                    put_number( lua_tonumber( L_, idx ) );
+                }
+                break;
+            case LUA_TSTRING: {
+                size_t len = 0;
+                const char *s = lua_tolstring( L_, idx, &len );
+                put_string( s, len );
+                break;
+            }
+            case LUA_TTABLE:
+                put_table( idx );
+                break;
+            case LUA_TUSERDATA:
+                put_userdata( idx );
+                break;
+            default:
+                throw std::runtime_error( std::string( "msgpack: cannot encode " )
+                               + types::id_to_string( lua_type( L_, idx ) ) );
+            }
+        }
+
+        lua_State               *L_;
+        Sink                    &sink_;
+        size_t                   max_depth_;
+        std::vector<const void *> path_;
+    };
+
+    class decoder {
+
+    public:
+
+        decoder( lua_State *L, const char *data, size_t len,
+                 size_t max_depth = 128 )
+            :L_(L)
+            ,begin_(reinterpret_cast<const unsigned char *>(data))
+            ,p_(begin_)
+            ,end_(begin_ + len)
+            ,max_depth_(max_depth)
+            ,depth_(0)
+        { }
+
+        /// pushes the next value; restores the stack and throws on
+        /// malformed input
+        void decode( )
+        {
+            const int top = lua_gettop( L_ );
+            try {
+                decode_value( );
+            } catch( ... ) {
+                lua_settop( L_, top );
+                throw;
+            }
+        }
+
+        size_t consumed( ) const
+        {
+            return static_cast<size_t>(p_ - begin_);
+        }
+
+        bool done( ) const
+        {
+            return p_ == end_;
+        }
+
+    private:
+
+        void need( size_t n ) const
+        {
+            if( static_cast<size_t>(end_ - p_) < n ) {
+                throw std::runtime_error( "msgpack: truncated input" );
+            }
+        }
+
+        uint64_t take_be( size_t bytes )
+        {
+            need( bytes );
+            uint64_t res = 0;
+            for( size_t i = 0; i < bytes; ++i ) {
+                res = (res << 8) | p_[i];
+            }
+            p_ += bytes;
+            return res;
+        }
+
+        const char *take( size_t n )
+        {
+            need( n );
+            const char *res = reinterpret_cast<const char *>(p_);
+            p_ += n;
+            return res;
+        }
+
+        void push_unsigned( uint64_t u )
+        {
+            if( u > static_cast<uint64_t>(LUA_MAXINTEGER) ) {
+                lua_pushnumber( L_, static_cast<lua_Number>(u) );
+            } else {
+                lua_pushinteger( L_, static_cast<lua_Integer>(u) );
+            }
+        }
+
+        void push_string( size_t len )
+        {
+            const char *s = take( len );
+            lua_pushlstring( L_, s, len );
+        }
+
+        void enter( )
+        {
+            if( ++depth_ > max_depth_ ) {
+                throw std::runtime_error( "msgpack: nesting too deep" );
+            }
+            if( !lua_checkstack( L_, 3 ) ) {
+                throw std::runtime_error( "msgpack: stack overflow" );
+            }
+        }
+
+        /// the count is untrusted: every element takes at least one byte,
+        /// so no more than the bytes left are presized
+        int presize( size_t n, size_t bytes_per_item ) const
+        {
+            const size_t most = static_cast<size_t>(end_ - p_) / bytes_per_item;
+            n = n < most ? n : most;
+            return n > 0x7FFFFFF ? 0x7FFFFFF : static_cast<int>(n);
+        }
+
+        void push_array( size_t n )
+        {
+            enter( );
+            lua_createtable( L_, presize( n, 1 ), 0 );
+            for( size_t i = 1; i <= n; ++i ) {
+                decode_value( );
+                lua_rawseti( L_, -2, static_cast<lua_Integer>(i) );
+            }
+            --depth_;
+        }
+
+        void push_map( size_t n )
+        {
+            enter( );
+            lua_createtable( L_, 0, presize( n, 2 ) );
+            for( size_t i = 0; i < n; ++i ) {
+                decode_value( );
+                if( lua_isnil( L_, -1 ) ) {
+                    throw std::runtime_error( "msgpack: nil map key" );
+                }
+                if( lua_type( L_, -1 ) == LUA_TNUMBER && !lua_isinteger( L_, -1 )
+                 && lua_tonumber( L_, -1 ) != lua_tonumber( L_, -1 ) )
+                {
+                    throw std::runtime_error( "msgpack: NaN map key" );
+                }
+                decode_value( );
+                lua_rawset( L_, -3 );
+            }
+            --depth_;
+        }
+
+        template <typename T>
+        void push_typed_array( size_t len )
+        {
+            if( len % sizeof(T) ) {
+                throw std::runtime_error( "msgpack: bad typed array size" );
+            }
+            const char *src = take( len );
+            const bool registered =
+                    userdata::push_metatable<typed_array<T> >( L_ );
+            lua_pop( L_, 1 );
+            if( !registered ) {
+                state::register_metatable<typed_array<T> >( L_ );
+                lua_pop( L_, 1 );
+            }
+            typed_array<T> *arr = typed_array<T>::create( L_, len / sizeof(T) );
+            if( len ) {
+                std::memcpy( arr->data( ), src, len );
+            }
+        }
+
+        void push_ext( size_t len )
+        {
+            const unsigned char t = static_cast<unsigned char>(take_be( 1 ));
+            switch( t ) {
+            case EXT_FLOAT32_ARRAY:
+                push_typed_array<float>( len );
+                break;
+            case EXT_FLOAT64_ARRAY:
+                push_typed_array<double>( len );
+                break;
+            case EXT_INT32_ARRAY:
+                push_typed_array<int32_t>( len );
+                break;
+            case EXT_INT64_ARRAY:
+                push_typed_array<int64_t>( len );
+                break;
+            default:
+                throw std::runtime_error( "msgpack: unknown ext type" );
+            }
+        }
+
+        void decode_value( )
+        {
+            const unsigned char b = static_cast<unsigned char>(take_be( 1 ));
+
+            if( b <= 0x7f ) {
+                lua_pushinteger( L_, b );
+            } else if( b >= 0xe0 ) {
+                lua_pushinteger( L_, static_cast<int8_t>(b) );
+            } else if( (b & 0xe0) == 0xa0 ) {
+                push_string( b & 0x1f );
+            } else if( (b & 0xf0) == 0x90 ) {
+                push_array( b & 0x0f );
+            } else if( (b & 0xf0) == 0x80 ) {
+                push_map( b & 0x0f );
+            } else {
+                switch( b ) {
+                case 0xc0: lua_pushnil( L_ ); break;
+                case 0xc2: lua_pushboolean( L_, 0 ); break;
+                case 0xc3: lua_pushboolean( L_, 1 ); break;
+                case 0xc4: push_string( take_be( 1 ) ); break;
+                case 0xc5: push_string( take_be( 2 ) ); break;
+                case 0xc6: push_string( take_be( 4 ) ); break;
+                case 0xc7: push_ext( take_be( 1 ) ); break;
+                case 0xc8: push_ext( take_be( 2 ) ); break;
+                case 0xc9: push_ext( take_be( 4 ) ); break;
+                case 0xca: {
+                    uint32_t bits = static_cast<uint32_t>(take_be( 4 ));
+                    float f;
+                    std::memcpy( &f, &bits, sizeof(f) );
+                    lua_pushnumber( L_, f );
+                    break;
+                }
+                case 0xcb: {
+                    uint64_t bits = take_be( 8 );
+                    double d;
+                    std::memcpy( &d, &bits, sizeof(d) );
+                    lua_pushnumber( L_, d );
+                    break;
+                }
+                case 0xcc: push_unsigned( take_be( 1 ) ); break;
+                case 0xcd: push_unsigned( take_be( 2 ) ); break;
+                case 0xce: push_unsigned( take_be( 4 ) ); break;
+                case 0xcf: push_unsigned( take_be( 8 ) ); break;
+                case 0xd0:
+                    lua_pushinteger( L_, static_cast<int8_t>(take_be( 1 )) );
+                    break;
+                case 0xd1:
+                    lua_pushinteger( L_, static_cast<int16_t>(take_be( 2 )) );
+                    break;
+                case 0xd2:
+                    lua_pushinteger( L_, static_cast<int32_t>(take_be( 4 )) );
+                    break;
+                case 0xd3:
+                    lua_pushinteger( L_, static_cast<lua_Integer>(
+                                         static_cast<int64_t>(take_be( 8 )) ) );
+                    break;
+                case 0xd4: push_ext( 1 ); break;
+                case 0xd5: push_ext( 2 ); break;
+                case 0xd6: push_ext( 4 ); break;
+                case 0xd7: push_ext( 8 ); break;
+                case 0xd8: push_ext( 16 ); break;
+                case 0xd9: push_string( take_be( 1 ) ); break;
+                case 0xda: push_string( take_be( 2 ) ); break;
+                case 0xdb: push_string( take_be( 4 ) ); break;
+                case 0xdc: push_array( take_be( 2 ) ); break;
+                case 0xdd: push_array( take_be( 4 ) ); break;
+                case 0xde: push_map( take_be( 2 ) ); break;
+                case 0xdf: push_map( take_be( 4 ) ); break;
+                default:
+                    throw std::runtime_error( "msgpack: bad type byte" );
+                }
+            }
+        }
+
+        lua_State           *L_;
+        const unsigned char *begin_;
+        const unsigned char *p_;
+        const unsigned char *end_;
+        size_t               max_depth_;
+        size_t               depth_;
+    };
+
+    /// encodes the value at idx into sink
+    template <typename Sink>
+    inline void encode( lua_State *L, int idx, Sink &sink )
+    {
+        encoder<Sink> enc( L, sink );
+        enc.encode( idx );
+    }
+
+    inline std::string encode( lua_State *L, int idx )
+    {
+        std::string res;
+        string_sink sink( res );
+        encode( L, idx, sink );
+        return res;
+    }
+
+    /// pushes the first value in data; returns the number of bytes used
+    inline size_t decode( lua_State *L, const char *data, size_t len )
+    {
+        decoder dec( L, data, len );
+        dec.decode( );
+        return dec.consumed( );
+    }
+
+    /// msgpack.encode( v1 [, v2, ...] ) -> string
+    inline int lcall_encode( lua_State *L )
+    {
+        const int n = lua_gettop( L );
+        bool failed = false;
+        {
+            std::string buf;
+            string_sink sink( buf );
+            encoder<string_sink> enc( L, sink );
+            try {
+                for( int i = 1; i <= n; ++i ) {
+                    enc.encode( i );
+                }
+                lua_pushlstring( L, buf.c_str( ), buf.size( ) );
+            } catch( const std::exception &ex ) {
+                lua_pushstring( L, ex.what( ) );
+                failed = true;
+            }
+        }
+        return failed ? lua_error( L ) : 1;
+    }
+
+    /// msgpack.decode( s [, pos] ) -> value, next_pos
+    inline int lcall_decode( lua_State *L )
+    {
+        size_t len = 0;
+        const char *data = luaL_checklstring( L, 1, &len );
+        lua_Integer pos = luaL_optinteger( L, 2, 1 );
+        luaL_argcheck( L, pos >= 1 && static_cast<size_t>(pos) <= len + 1, 2,
+                       "position out of range" );
+        const size_t off = static_cast<size_t>(pos - 1);
+        bool failed = false;
+        {
+            decoder dec( L, data + off, len - off );
+            try {
+                dec.decode( );
+                lua_pushinteger( L, static_cast<lua_Integer>(
+                                     off + dec.consumed( ) + 1) );
+            } catch( const std::exception &ex ) {
+                lua_pushstring( L, ex.what( ) );
+                failed = true;
+            }
+        }
+        return failed ? lua_error( L ) : 2;
+    }
+
+    /// ls.openlib( "msgpack", &lua::msgpack::luaopen_msgpack );
+    inline int luaopen_msgpack( lua_State *L )
+    {
+        static const struct luaL_Reg lib[ ] = {
+            { "encode",  &lcall_encode },
+            { "decode",  &lcall_decode },
+            { nullptr,   nullptr       },
+        };
+        lua_createtable( L, 0, 2 );
+        luaL_setfuncs( L, lib, 0 );
+        return 1;
+    }
+
+}}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#endif // LUA_MSGPACK_HPP
@@ -12,6 +12,9 @@ extern "C" {
 #include "lua.h"
 }
 
+#include "lua-text-format.hpp"
+#include "lua-userdata.hpp"
+
 #ifdef LUA_WRAPPER_TOP_NAMESPACE
 
 namespace LUA_WRAPPER_TOP_NAMESPACE {
@@ -129,6 +132,13 @@ namespace lua { namespace objects {
             return std::string( );
         }
 
+        /// appends the text of str( ) to out; containers write their
+        /// children through it, so a whole tree is one pass over one buffer
+        virtual void append_str( std::string &out ) const
+        {
+            out.append( str( ) );
+        }
+
         virtual lua_Number num( ) const
         {
             return 0;
@@ -144,6 +154,16 @@ namespace lua { namespace objects {
             int ti = type_id( );
             return ( ti == LUA_TNONE ) || ( ti == LUA_TNIL );
         }
+
+    protected:
+
+        /// str( ) for classes that implement append_str( )
+        std::string appended_str( ) const
+        {
+            std::string res;
+            append_str( res );
+            return res;
+        }
     };
 
     typedef std::shared_ptr<base> base_sptr;
@@ -180,6 +200,15 @@ namespace lua { namespace objects {
             return vals[value_ ? 1 : 0];
         }
 
+        void append_str( std::string &out ) const
+        {
+            if( value_ ) {
+                out.append( "true", 4 );
+            } else {
+                out.append( "false", 5 );
+            }
+        }
+
         lua_Number num( ) const
         {
             return static_cast<lua_Number>(value_ ? 1 : 0);
@@ -218,6 +247,11 @@ namespace lua { namespace objects {
         {
             return "nil";
         }
+
+        void append_str( std::string &out ) const
+        {
+            out.append( "nil", 3 );
+        }
     };
 
     class light_userdata: public base {
@@ -247,9 +281,12 @@ namespace lua { namespace objects {
 
         std::string str( ) const
         {
-            std::ostringstream oss;
-            oss << std::hex << ptr_;
-            return oss.str( );
+            return appended_str( );
+        }
+
+        void append_str( std::string &out ) const
+        {
+            text::append_pointer( out, ptr_ );
         }
     };
 
@@ -280,9 +317,12 @@ namespace lua { namespace objects {
 
         std::string str( ) const
         {
-            std::ostringstream oss;
-            oss << num_;
-            return oss.str( );
+            return appended_str( );
+        }
+
+        void append_str( std::string &out ) const
+        {
+            text::append_number( out, static_cast<double>(num_) );
         }
 
         lua_Number num( ) const
@@ -324,9 +364,12 @@ namespace lua { namespace objects {
 
         std::string str( ) const
         {
-            std::ostringstream oss;
-            oss << num_;
-            return oss.str( );
+            return appended_str( );
+        }
+
+        void append_str( std::string &out ) const
+        {
+            text::append_integer( out, static_cast<long long>(num_) );
         }
 
         lua_Number num( ) const
@@ -369,9 +412,12 @@ namespace lua { namespace objects {
 
         std::string str( ) const
         {
-            std::ostringstream oss;
-            oss << num_;
-            return oss.str( );
+            return appended_str( );
+        }
+
+        void append_str( std::string &out ) const
+        {
+            text::append_unsigned( out, static_cast<unsigned long long>(num_) );
         }
 
         lua_Number num( ) const
@@ -430,14 +476,36 @@ namespace lua { namespace objects {
             return cont_ ;
         }
 
+        void append_str( std::string &out ) const
+        {
+            out.append( cont_ );
+        }
+
         lua_Number num( ) const
         {
-            return atof(cont_.c_str( ));
+            double res = 0;
+            const char *p = cont_.data( );
+            text::parse_number( p, p + cont_.size( ), res );
+            return static_cast<lua_Number>(res);
         }
 
-       lua_Integer inum( ) const
+        /// full 64-bit range; "1.5" and "1e3" go through num( )
+        lua_Integer inum( ) const
         {
-            return atoi(cont_.c_str( ));
+            const char *p   = cont_.data( );
+            const char *end = p + cont_.size( );
+            long long res   = 0;
+            const char *stop = text::parse_integer( p, end, res );
+            if( stop && ( stop == end
+                       || ( *stop != '.' && *stop != 'e' && *stop != 'E' ) ) )
+            {
+                return static_cast<lua_Integer>(res);
+            }
+            const lua_Number n = num( );
+            if( n >= -9223372036854775808.0 && n < 9223372036854775808.0 ) {
+                return static_cast<lua_Integer>(n);
+            }
+            return 0;
         }
     };
 
@@ -470,9 +538,13 @@ namespace lua { namespace objects {
 
         std::string str( ) const
         {
-            std::ostringstream oss;
-            oss << "function@" << std::hex << func_;
-            return oss.str( );
+            return appended_str( );
+        }
+
+        void append_str( std::string &out ) const
+        {
+            out.append( "function@", 9 );
+            text::append_pointer( out, reinterpret_cast<const void *>(func_) );
         }
     };
 
@@ -541,12 +613,14 @@ namespace lua { namespace objects {
 
         std::string str( ) const
         {
-            std::ostringstream oss;
-            oss << pair_.first->str( )
-                << "="
-                << pair_.second->str( );
+            return appended_str( );
+        }
 
-            return oss.str( );
+        void append_str( std::string &out ) const
+        {
+            pair_.first->append_str( out );
+            out.push_back( '=' );
+            pair_.second->append_str( out );
         }
 
         size_t nil_size( ) const
@@ -713,32 +787,31 @@ namespace lua { namespace objects {
 
         std::string str( size_t shift, const pair &pair ) const
         {
-            std::string spaces( shift << 2, ' ' );
-            std::ostringstream oss;
-            oss << spaces << pair.str( );
-            return oss.str( );
+            std::string res( shift << 2, ' ' );
+            pair.append_str( res );
+            return res;
         }
 
         std::string str( ) const
         {
-            std::ostringstream oss;
+            return appended_str( );
+        }
 
+        void append_str( std::string &out ) const
+        {
             typedef pair_vector::const_iterator citer;
 
-            oss << "{ ";
+            out.append( "{ ", 2 );
             bool fst = true;
             for( citer b(list_.begin( )), e(list_.end( )); b!=e; ++b  ) {
-                std::string res(str( 0, *b->get( ) ));
                 if( !fst ) {
-                    oss << ", ";
+                    out.append( ", ", 2 );
                 } else {
                     fst = false;
                 }
-                oss << res;
+                (*b)->append_str( out );
             }
-            oss << " }";
-
-            return oss.str( );
+            out.append( " }", 2 );
         }
     };
 
@@ -836,19 +909,60 @@ namespace lua { namespace objects {
 
         void push( lua_State *L ) const
         {
-            void *ud = lua_newuserdata( L, sizeof(T) );
-            if( ud ) {
-                new (ud) T(value_);
-                luaL_getmetatable( L, T::name( ) );
-                lua_setmetatable( L, -2 );
-            } else {
-                lua_pushnil( L );
-            }
+            userdata::create<T>( L, value_ );
         }
     private:
         value_type value_;
     };
 
+    /// pushes a handle to a shared T; nothing is copied per push
+    template <typename T>
+    class shared_metatable: public base {
+
+    public:
+
+        using value_type = T;
+
+        explicit shared_metatable( std::shared_ptr<T> ptr )
+            :ptr_(std::move( ptr ))
+        { }
+
+        virtual int type_id( ) const
+        {
+            return base::TYPE_USERDATA;
+        }
+
+        virtual base *clone( ) const
+        {
+            return new shared_metatable( ptr_ );
+        }
+
+        void push( lua_State *L ) const
+        {
+            userdata::push_shared<T>( L, ptr_ );
+        }
+
+        std::string str( ) const
+        {
+            return appended_str( );
+        }
+
+        void append_str( std::string &out ) const
+        {
+            out.append( T::name( ) );
+            out.push_back( '@' );
+            text::append_pointer( out, ptr_.get( ) );
+        }
+
+        const std::shared_ptr<T> &get( ) const
+        {
+            return ptr_;
+        }
+
+    private:
+        std::shared_ptr<T> ptr_;
+    };
+
     class reference: public base {
 
         lua_State *state_;
@@ -923,10 +1037,16 @@ namespace lua { namespace objects {
 
         std::string str( ) const
         {
-            std::ostringstream oss;
-            oss << base::type2string( type_ & ~base::TYPE_REF )
-                << "@" << std::hex << state_ << ":" << ref_;
-            return oss.str( );
+            return appended_str( );
+        }
+
+        void append_str( std::string &out ) const
+        {
+            out.append( base::type2string( type_ & ~base::TYPE_REF ) );
+            out.push_back( '@' );
+            text::append_pointer( out, state_ );
+            out.push_back( ':' );
+            text::append_unsigned( out, static_cast<unsigned>(ref_), 16 );
         }
     };
 
@@ -963,9 +1083,13 @@ namespace lua { namespace objects {
 
         std::string str( ) const
         {
-            std::ostringstream oss;
-            oss << "thread@" << std::hex << s_;
-            return oss.str( );
+            return appended_str( );
+        }
+
+        void append_str( std::string &out ) const
+        {
+            out.append( "thread@", 7 );
+            text::append_pointer( out, s_ );
         }
     };
 
@@ -0,0 +1,568 @@
+#ifndef LUA_PROFILER_HPP
+#define LUA_PROFILER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <stdint.h>
+
+#if defined(__linux__)
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define LUA_WRAPPER_PROFILER_SIGNAL 1
+#endif
+
+extern "C" {
+#include "lualib.h"
+#include "lauxlib.h"
+#include "lua.h"
+}
+
+#include "lua-text-format.hpp"
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#endif
+
+/*
+ * Sampling profiler for the code a state runs.
+ *
+ * A sample is the call stack (Lua and C functions) at the moment the
+ * hook fires:
+ *
+ *  - count mode: LUA_MASKCOUNT every `period` VM instructions;
+ *  - timer mode: every `period` microseconds. On Linux a POSIX timer
+ *    sends SIGPROF to the thread that called start( ) and the handler
+ *    arms a one-shot count hook there, as lua.c's laction does for
+ *    SIGINT; between samples the VM runs with no hook at all. Elsewhere
+ *    a timer thread raises a flag that a count hook checks every `poll`
+ *    instructions, since lua_sethook must not race the VM thread.
+ *
+ * Count mode is deterministic but slow whatever the period: with a hook
+ * set the VM traces every instruction, and so does the polling timer.
+ * The signal timer costs only the samples themselves; it is the one to
+ * leave on in production. It handles the SIGPROF signals of its own
+ * timers, at most 64 at once (others go to the previous handler) and,
+ * like any SIGPROF profiler, can make blocking calls on the VM thread
+ * return EINTR.
+ *
+ * The hook runs on the thread that runs the state. It interns each frame
+ * into a label table once and pushes the stack as frame ids into a
+ * single-producer/single-consumer ring; nothing in the hook waits for
+ * the reader. collect( ) drains the ring into stack -> count, from any
+ * one thread, and folded( ) writes the flamegraph.pl input:
+ *
+ *  main@app.lua;handler@app.lua:10;[C] string.format 17
+ *
+ * A full ring drops samples and counts them in dropped( ).
+ *
+ * Hooks are per Lua thread: count mode and the polling timer cover
+ * coroutines created after start( ) (they inherit the hook), the signal
+ * timer samples the main thread.
+ * start( ) and stop( ) belong to the thread that runs the state.
+ */
+namespace lua { namespace profiler {
+
+    enum sample_mode {
+         SAMPLE_COUNT = 0
+        ,SAMPLE_TIMER = 1
+    };
+
+    struct options {
+        sample_mode mode       = SAMPLE_TIMER;
+        unsigned    period     = 1000;  /// instructions or microseconds
+        unsigned    max_depth  = 64;
+        size_t      ring_size  = 4096;  /// samples; rounded up to 2^n
+        size_t      max_frames = 16384; /// distinct frame labels
+        unsigned    poll       = 1000;  /// instructions; polling timer
+    };
+
+    class sampler {
+
+        enum { MAX_DEPTH_LIMIT = 128 };
+
+        struct sample {
+            uint32_t depth;
+            uint32_t frames[MAX_DEPTH_LIMIT];   /// leaf first
+        };
+
+        static void *state_key( )
+        {
+            static char key;
+            return &key;
+        }
+
+    public:
+
+        explicit sampler( lua_State *L, const options &opts = options( ) )
+            :L_(L)
+            ,opts_(opts)
+            ,running_(false)
+            ,pending_(false)
+            ,head_(0)
+            ,tail_(0)
+            ,labels_count_(0)
+            ,samples_(0)
+            ,dropped_(0)
+        {
+            if( opts_.max_depth == 0 || opts_.max_depth > MAX_DEPTH_LIMIT ) {
+                opts_.max_depth = MAX_DEPTH_LIMIT;
+            }
+            size_t ring = 2;
+            while( ring < opts_.ring_size ) {
+                ring <<= 1;
+            }
+            ring_.resize( ring );
+            labels_.resize( opts_.max_frames ? opts_.max_frames : 1 );
+        }
+
+        sampler( const sampler & ) = delete;
+        sampler &operator = ( const sampler & ) = delete;
+
+        ~sampler( )
+        {
+            stop( );
+        }
+
+        /// throws std::runtime_error if another sampler runs on L
+        void start( )
+        {
+            if( running_ ) {
+                return;
+            }
+            lua_rawgetp( L_, LUA_REGISTRYINDEX, state_key( ) );
+            const bool busy = !lua_isnil( L_, -1 );
+            lua_pop( L_, 1 );
+            if( busy ) {
+                throw std::runtime_error( "a sampler is already running "
+                                          "on this state" );
+            }
+            lua_pushlightuserdata( L_, this );
+            lua_rawsetp( L_, LUA_REGISTRYINDEX, state_key( ) );
+
+            running_ = true;
+            if( opts_.mode == SAMPLE_COUNT ) {
+                lua_sethook( L_, &lcall_hook, LUA_MASKCOUNT,
+                             opts_.period ? static_cast<int>(opts_.period)
+                                          : 1 );
+            } else if( !start_timer( ) ) {
+                running_ = false;
+                lua_pushnil( L_ );
+                lua_rawsetp( L_, LUA_REGISTRYINDEX, state_key( ) );
+                throw std::runtime_error( "cannot start the sampling "
+                                          "timer" );
+            }
+        }
+
+        void stop( )
+        {
+            if( !running_ ) {
+                return;
+            }
+            running_ = false;
+            stop_timer( );
+            lua_sethook( L_, nullptr, 0, 0 );
+            lua_pushnil( L_ );
+            lua_rawsetp( L_, LUA_REGISTRYINDEX, state_key( ) );
+        }
+
+        bool running( ) const
+        {
+            return running_;
+        }
+
+        /// drains the ring into the aggregated stacks; returns how many
+        /// samples it took
+        size_t collect( )
+        {
+            const size_t mask = ring_.size( ) - 1;
+            size_t tail = tail_.load( std::memory_order_relaxed );
+            const size_t head = head_.load( std::memory_order_acquire );
+            const size_t res = head - tail;
+            for( ; tail != head; ++tail ) {
+                const sample &s = ring_[tail & mask];
+                std::vector<uint32_t> stack( s.frames, s.frames + s.depth );
+                ++stacks_[stack];
+            }
+            tail_.store( tail, std::memory_order_release );
+            return res;
+        }
+
+        /// collect( ) and the folded stacks, root first, one per line
+        std::string folded( )
+        {
+            collect( );
+            const size_t count =
+                        labels_count_.load( std::memory_order_acquire );
+            std::string out;
+            for( stack_map::const_iterator it = stacks_.begin( );
+                 it != stacks_.end( ); ++it )
+            {
+                const std::vector<uint32_t> &st = it->first;
+                for( size_t i = st.size( ); i > 0; --i ) {
+                    const uint32_t id = st[i - 1];
+                    if( id < count ) {
+                        out.append( labels_[id] );
+                    } else {
+                        out.push_back( '?' );
+                    }
+                    out.push_back( i > 1 ? ';' : ' ' );
+                }
+                if( st.empty( ) ) {
+                    out.append( "[idle] " );
+                }
+                text::append_unsigned( out, it->second );
+                out.push_back( '\n' );
+            }
+            return out;
+        }
+
+        void write_folded( std::ostream &os )
+        {
+            const std::string out = folded( );
+            os.write( out.data( ), static_cast<std::streamsize>(out.size( )) );
+        }
+
+        /// forgets the aggregated stacks (labels stay)
+        void clear( )
+        {
+            collect( );
+            stacks_.clear( );
+        }
+
+        uint64_t samples( ) const
+        {
+            return samples_.load( std::memory_order_relaxed );
+        }
+
+        uint64_t dropped( ) const
+        {
+            return dropped_.load( std::memory_order_relaxed );
+        }
+
+    private:
+
+        typedef std::map<std::vector<uint32_t>, uint64_t> stack_map;
+
+#ifdef LUA_WRAPPER_PROFILER_SIGNAL
+
+        static struct sigaction &previous_action( )
+        {
+            static struct sigaction res;
+            return res;
+        }
+
+        enum { MAX_TIMERS = 64 };
+
+        /// one per running timer; the signal carries a slot address,
+        /// never a bare lua_State *
+        struct timer_slot {
+            std::atomic<pid_t>       tid;
+            std::atomic<lua_State *> L;
+        };
+
+        static timer_slot *timer_slots( )
+        {
+            static timer_slot res[MAX_TIMERS];
+            return res;
+        }
+
+        static timer_slot *claim_slot( lua_State *L, pid_t tid )
+        {
+            timer_slot *slots = timer_slots( );
+            for( size_t i = 0; i < MAX_TIMERS; ++i ) {
+                pid_t free_tid = 0;
+                if( slots[i].tid.compare_exchange_strong( free_tid, tid ) ) {
+                    slots[i].L.store( L, std::memory_order_release );
+                    return &slots[i];
+                }
+            }
+            return nullptr;
+        }
+
+        static void release_slot( timer_slot *slot )
+        {
+            slot->L.store( nullptr, std::memory_order_release );
+            slot->tid.store( 0, std::memory_order_release );
+        }
+
+        /// runs on the VM thread: the timer is aimed at it. Signals
+        /// from timers this profiler did not create go to the previous
+        /// handler; a late one from a deleted timer finds its slot
+        /// empty or owned by another thread and is dropped.
+        static void signal_handler( int sig, siginfo_t *info, void *ctx )
+        {
+            timer_slot *slots = timer_slots( );
+            timer_slot *slot = info && info->si_code == SI_TIMER
+                             ? static_cast<timer_slot *>(
+                                            info->si_value.sival_ptr )
+                             : nullptr;
+            if( slot >= slots && slot < slots + MAX_TIMERS ) {
+                lua_State *L = slot->L.load( std::memory_order_acquire );
+                const pid_t tid = static_cast<pid_t>(
+                                        syscall( SYS_gettid ) );
+                if( L && slot->tid.load( std::memory_order_acquire )
+                                                                == tid )
+                {
+                    /// one-shot: the hook clears itself
+                    lua_sethook( L, &lcall_hook, LUA_MASKCOUNT, 1 );
+                }
+                return;
+            }
+            const struct sigaction &prev = previous_action( );
+            if( prev.sa_flags & SA_SIGINFO ) {
+                prev.sa_sigaction( sig, info, ctx );
+            } else if( prev.sa_handler != SIG_DFL
+                    && prev.sa_handler != SIG_IGN )
+            {
+                prev.sa_handler( sig );
+            }
+        }
+
+        static bool install_handler( )
+        {
+            static std::mutex lock;
+            static bool installed = false;
+            std::lock_guard<std::mutex> guard( lock );
+            if( !installed ) {
+                struct sigaction act;
+                std::memset( &act, 0, sizeof(act) );
+                act.sa_sigaction = &signal_handler;
+                act.sa_flags = SA_SIGINFO | SA_RESTART;
+                sigemptyset( &act.sa_mask );
+                installed = sigaction( SIGPROF, &act,
+                                       &previous_action( ) ) == 0;
+            }
+            return installed;
+        }
+
+        bool start_timer( )
+        {
+            if( !install_handler( ) ) {
+                return false;
+            }
+            const pid_t tid = static_cast<pid_t>(syscall( SYS_gettid ));
+            timer_slot_ = claim_slot( L_, tid );
+            if( !timer_slot_ ) {
+                return false;
+            }
+            struct sigevent sev;
+            std::memset( &sev, 0, sizeof(sev) );
+            sev.sigev_notify = SIGEV_THREAD_ID;
+            sev.sigev_signo = SIGPROF;
+            sev.sigev_value.sival_ptr = timer_slot_;
+#ifdef sigev_notify_thread_id
+            sev.sigev_notify_thread_id = tid;
+#else
+            sev._sigev_un._tid = tid;
+#endif
+            if( timer_create( CLOCK_MONOTONIC, &sev, &timer_id_ ) != 0 ) {
+                release_slot( timer_slot_ );
+                return false;
+            }
+            const long us = opts_.period ? static_cast<long>(opts_.period)
+                                         : 1;
+            struct itimerspec its;
+            its.it_interval.tv_sec  = us / 1000000;
+            its.it_interval.tv_nsec = us % 1000000 * 1000;
+            its.it_value = its.it_interval;
+            if( timer_settime( timer_id_, 0, &its, nullptr ) != 0 ) {
+                timer_delete( timer_id_ );
+                release_slot( timer_slot_ );
+                return false;
+            }
+            return true;
+        }
+
+        /// a signal still in flight either finds the slot empty or
+        /// arms the hook, which finds no sampler and clears itself
+        void stop_timer( )
+        {
+            if( opts_.mode == SAMPLE_TIMER ) {
+                timer_delete( timer_id_ );
+                release_slot( timer_slot_ );
+            }
+        }
+
+#else
+
+        bool start_timer( )
+        {
+            pending_ = false;
+            lua_sethook( L_, &lcall_hook, LUA_MASKCOUNT,
+                         opts_.poll ? static_cast<int>(opts_.poll) : 1 );
+            timer_ = std::thread( &sampler::timer_loop, this );
+            return true;
+        }
+
+        void stop_timer( )
+        {
+            if( timer_.joinable( ) ) {
+                timer_.join( );
+            }
+        }
+
+#endif
+
+        /// never touches the state; the hook picks the flag up
+        void timer_loop( )
+        {
+            const std::chrono::microseconds period( opts_.period
+                                                  ? opts_.period : 1 );
+            std::chrono::steady_clock::time_point next =
+                                std::chrono::steady_clock::now( ) + period;
+            while( running_ ) {
+                std::this_thread::sleep_until( next );
+                next += period;
+                pending_.store( true, std::memory_order_release );
+            }
+        }
+
+        /// label for a frame; the name stays "?" when Lua has none
+        static void make_label( const lua_Debug &ar, std::string &res )
+        {
+            res.clear( );
+            if( ar.what && ar.what[0] == 'C' ) {
+                res.append( "[C] " );
+                res.append( ar.name ? ar.name : "?" );
+                return;
+            }
+            if( ar.what && ar.what[0] == 'm' ) {
+                res.append( "main" );
+            } else {
+                res.append( ar.name ? ar.name : "?" );
+            }
+            res.push_back( '@' );
+            res.append( ar.short_src );
+            if( ar.linedefined > 0 ) {
+                res.push_back( ':' );
+                text::append_integer( res, ar.linedefined );
+            }
+            for( size_t i = 0; i < res.size( ); ++i ) {
+                if( res[i] == ';' || res[i] == '\n' ) {
+                    res[i] = '_';
+                }
+            }
+        }
+
+        /// frame id, or UINT32_MAX when the label table is full. Frames
+        /// are keyed by their label text, not by the ar.source and
+        /// ar.name pointers: the collector frees and reuses those strings
+        uint32_t intern( const lua_Debug &ar )
+        {
+            make_label( ar, label_ );
+            frame_ids::const_iterator it = ids_.find( label_ );
+            if( it != ids_.end( ) ) {
+                return it->second;
+            }
+            const size_t id =
+                        labels_count_.load( std::memory_order_relaxed );
+            if( id >= labels_.size( ) ) {
+                return UINT32_MAX;
+            }
+            labels_[id] = label_;
+            labels_count_.store( id + 1, std::memory_order_release );
+            ids_.insert( std::make_pair( label_, static_cast<uint32_t>(id) ) );
+            return static_cast<uint32_t>(id);
+        }
+
+        void take_sample( lua_State *L )
+        {
+            const size_t head = head_.load( std::memory_order_relaxed );
+            const size_t tail = tail_.load( std::memory_order_acquire );
+            if( head - tail >= ring_.size( ) ) {
+                dropped_.fetch_add( 1, std::memory_order_relaxed );
+                return;
+            }
+            sample &s = ring_[head & (ring_.size( ) - 1)];
+            s.depth = 0;
+            lua_Debug ar;
+            for( int level = 0; s.depth < opts_.max_depth
+                             && lua_getstack( L, level, &ar ); ++level )
+            {
+                lua_getinfo( L, "Sn", &ar );
+                const uint32_t id = intern( ar );
+                if( id != UINT32_MAX ) {
+                    s.frames[s.depth++] = id;
+                }
+            }
+            head_.store( head + 1, std::memory_order_release );
+            samples_.fetch_add( 1, std::memory_order_relaxed );
+        }
+
+        static void lcall_hook( lua_State *L, lua_Debug * )
+        {
+            lua_rawgetp( L, LUA_REGISTRYINDEX, state_key( ) );
+            sampler *self = static_cast<sampler *>(lua_touserdata( L, -1 ));
+            lua_pop( L, 1 );
+            if( !self ) {
+                lua_sethook( L, nullptr, 0, 0 );
+                return;
+            }
+            if( self->opts_.mode == SAMPLE_TIMER ) {
+#ifdef LUA_WRAPPER_PROFILER_SIGNAL
+                lua_sethook( L, nullptr, 0, 0 );
+#else
+                if( !self->pending_.load( std::memory_order_relaxed )
+                 || !self->pending_.exchange( false,
+                                              std::memory_order_acquire ) )
+                {
+                    return;
+                }
+#endif
+            }
+            try {
+                self->take_sample( L );
+            } catch( ... ) {
+                /// out of memory for a label: lose the sample
+            }
+        }
+
+        typedef std::unordered_map<std::string, uint32_t> frame_ids;
+
+        lua_State                  *L_;
+        options                     opts_;
+        std::atomic<bool>           running_;
+        std::atomic<bool>           pending_;
+#ifdef LUA_WRAPPER_PROFILER_SIGNAL
+        timer_t                     timer_id_;
+        timer_slot                 *timer_slot_;
+#else
+        std::thread                 timer_;
+#endif
+
+        std::vector<sample>         ring_;
+        std::atomic<size_t>         head_;
+        std::atomic<size_t>         tail_;
+
+        /// written by the hook only, published through labels_count_
+        std::vector<std::string>    labels_;
+        std::atomic<size_t>         labels_count_;
+        frame_ids                   ids_;
+        std::string                 label_;
+
+        stack_map                   stacks_;
+        std::atomic<uint64_t>       samples_;
+        std::atomic<uint64_t>       dropped_;
+    };
+
+}}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#endif // LUA_PROFILER_HPP
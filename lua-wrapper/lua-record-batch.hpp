@@ -0,0 +1,517 @@
+#ifndef LUA_RECORD_BATCH_HPP
+#define LUA_RECORD_BATCH_HPP
+
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "lua-wrapper.hpp"
+#include "lua-typed-array.hpp"
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#endif
+
+namespace lua {
+
+    /*
+     * A batch of rows stored column by column. Columns are either host
+     * buffers (zero-copy) or owned output buffers. Scripts see
+     *
+     *  #batch                      number of rows
+     *  batch:column( name )        typed array view over the column
+     *  batch:add_column( name, t ) new owned column; t is "float32",
+     *                              "float64", "int32" or "int64"
+     *  batch:names( )              { column names }
+     *  for i, row in batch:rows( ) do row.price ... row.score = x end
+     *
+     * The row cursor is one object reused for every row. Column views and
+     * cursors keep the batch alive through an anchor table in the
+     * registry (weak keys: view -> batch), not through a user value, so
+     * the user value slots of the views stay free for scripts and
+     * state::set_user_value cannot drop the batch under a view.
+     */
+    class record_batch {
+
+    public:
+
+        enum column_type {
+             COLUMN_FLOAT32 = 0
+            ,COLUMN_FLOAT64 = 1
+            ,COLUMN_INT32   = 2
+            ,COLUMN_INT64   = 3
+        };
+
+        template <typename T>
+        struct type_of;
+
+        struct column {
+            std::string                 name;
+            column_type                 type;
+            void                       *data;
+            std::unique_ptr<char[ ]>    storage;
+        };
+
+        class row_cursor {
+
+            record_batch *batch_;
+            size_t        row_;
+
+        public:
+
+            explicit row_cursor( record_batch *batch )
+                :batch_(batch)
+                ,row_(0)
+            { }
+
+            size_t row( ) const
+            {
+                return row_;
+            }
+
+            static const char *name( )
+            {
+                return "record_batch.row";
+            }
+
+            static const struct luaL_Reg *table( )
+            {
+                static const struct luaL_Reg lib[ ] = {
+                    { "__index",    &lcall_index    },
+                    { "__newindex", &lcall_newindex },
+                    { nullptr,      nullptr         },
+                };
+                return lib;
+            }
+
+        private:
+
+            friend class record_batch;
+
+            static int lcall_index( lua_State *L )
+            {
+                row_cursor *self = state::check_metatable<row_cursor>( L, 1 );
+                const column *col = self->batch_->find( L, 2 );
+                if( !col ) {
+                    return 0;
+                }
+                record_batch::push_element( L, *col, self->row_ );
+                return 1;
+            }
+
+            static int lcall_newindex( lua_State *L )
+            {
+                row_cursor *self = state::check_metatable<row_cursor>( L, 1 );
+                const column *col = self->batch_->find( L, 2 );
+                if( !col ) {
+                    return luaL_error( L, "no column '%s'",
+                                       luaL_checkstring( L, 2 ) );
+                }
+                record_batch::set_element( L, *col, self->row_, 3 );
+                return 0;
+            }
+        };
+
+        explicit record_batch( size_t rows )
+            :rows_(rows)
+        { }
+
+        record_batch( record_batch && ) = default;
+
+        size_t rows( ) const
+        {
+            return rows_;
+        }
+
+        size_t columns( ) const
+        {
+            return columns_.size( );
+        }
+
+        /// zero-copy column over a host buffer of rows( ) elements
+        template <typename T>
+        T *add_column( const std::string &name, T *data )
+        {
+            column &col = new_column( name, type_of<T>::value );
+            col.data = data;
+            return data;
+        }
+
+        /// owned, zero-initialised column, e.g. for script output
+        template <typename T>
+        T *add_column( const std::string &name )
+        {
+            return static_cast<T *>(
+                    add_column( name, type_of<T>::value ).data );
+        }
+
+        const column &add_column( const std::string &name, column_type t )
+        {
+            column &col = new_column( name, t );
+            const size_t bytes = rows_ * element_size( t );
+            col.storage.reset( new char[bytes ? bytes : 1] );
+            std::memset( col.storage.get( ), 0, bytes );
+            col.data = col.storage.get( );
+            return col;
+        }
+
+        const column *find( const std::string &name ) const
+        {
+            return find( name.c_str( ), name.size( ) );
+        }
+
+        template <typename T>
+        array_view<T> column_view( const std::string &name )
+        {
+            const column *col = find( name );
+            if( !col ) {
+                throw std::out_of_range( "no column '" + name + "'" );
+            }
+            if( col->type != type_of<T>::value ) {
+                throw std::runtime_error( "bad type for column '"
+                                          + name + "'" );
+            }
+            return array_view<T>( static_cast<T *>(col->data), rows_ );
+        }
+
+        static size_t element_size( column_type t )
+        {
+            switch( t ) {
+            case COLUMN_FLOAT32:
+                return sizeof(float);
+            case COLUMN_FLOAT64:
+                return sizeof(double);
+            case COLUMN_INT32:
+                return sizeof(int32_t);
+            case COLUMN_INT64:
+                return sizeof(int64_t);
+            }
+            return 0;
+        }
+
+        static const char *type_name( column_type t )
+        {
+            static const char *names[ ] = {
+                "float32", "float64", "int32", "int64"
+            };
+            return names[t];
+        }
+
+        /// moves the batch into a new userdata; the pointer stays valid
+        /// while the userdata is alive
+        static record_batch *push( lua_State *L, record_batch &&batch )
+        {
+            return state::create_metatable<record_batch>( L, std::move(batch) );
+        }
+
+        static record_batch *check( lua_State *L, int idx )
+        {
+            return state::check_metatable<record_batch>( L, idx );
+        }
+
+        static const char *name( )
+        {
+            return "record_batch";
+        }
+
+        static const struct luaL_Reg *table( )
+        {
+            static const struct luaL_Reg lib[ ] = {
+                { "__len",      &lcall_rows         },
+                { "rows",       &lcall_rows_iter    },
+                { "size",       &lcall_rows         },
+                { "column",     &lcall_column       },
+                { "add_column", &lcall_add_column   },
+                { "names",      &lcall_names        },
+                { nullptr,      nullptr             },
+            };
+            return lib;
+        }
+
+        static int lcall_new( lua_State *L )
+        {
+            lua_Integer rows = luaL_checkinteger( L, 1 );
+            luaL_argcheck( L, rows >= 0, 1, "negative size" );
+            push( L, record_batch( static_cast<size_t>(rows) ) );
+            return 1;
+        }
+
+    private:
+
+        record_batch( const record_batch & ) = delete;
+        record_batch &operator = ( const record_batch & ) = delete;
+
+        column &new_column( const std::string &name, column_type t )
+        {
+            if( find( name ) ) {
+                throw std::logic_error( "column '" + name + "' exists" );
+            }
+            columns_.push_back( column( ) );
+            column &col = columns_.back( );
+            col.name = name;
+            col.type = t;
+            col.data = nullptr;
+            return col;
+        }
+
+        /// batches hold a handful of columns; a scan beats hashing the key
+        const column *find( const char *name, size_t len ) const
+        {
+            for( const column &c: columns_ ) {
+                if( c.name.size( ) == len
+                 && 0 == std::memcmp( c.name.data( ), name, len ) )
+                {
+                    return &c;
+                }
+            }
+            return nullptr;
+        }
+
+        const column *find( lua_State *L, int idx ) const
+        {
+            if( lua_type( L, idx ) != LUA_TSTRING ) {
+                return nullptr;
+            }
+            size_t len = 0;
+            const char *key = lua_tolstring( L, idx, &len );
+            return find( key, len );
+        }
+
+        static void push_element( lua_State *L, const column &col, size_t row )
+        {
+            switch( col.type ) {
+            case COLUMN_FLOAT32:
+                lua_pushnumber( L, static_cast<float *>(col.data)[row] );
+                break;
+            case COLUMN_FLOAT64:
+                lua_pushnumber( L, static_cast<double *>(col.data)[row] );
+                break;
+            case COLUMN_INT32:
+                lua_pushinteger( L, static_cast<int32_t *>(col.data)[row] );
+                break;
+            case COLUMN_INT64:
+                lua_pushinteger( L, static_cast<lua_Integer>(
+                                     static_cast<int64_t *>(col.data)[row] ) );
+                break;
+            }
+        }
+
+        static void set_element( lua_State *L, const column &col,
+                                 size_t row, int idx )
+        {
+            switch( col.type ) {
+            case COLUMN_FLOAT32:
+                static_cast<float *>(col.data)[row] =
+                        static_cast<float>(luaL_checknumber( L, idx ));
+                break;
+            case COLUMN_FLOAT64:
+                static_cast<double *>(col.data)[row] =
+                        luaL_checknumber( L, idx );
+                break;
+            case COLUMN_INT32:
+                static_cast<int32_t *>(col.data)[row] =
+                        static_cast<int32_t>(luaL_checkinteger( L, idx ));
+                break;
+            case COLUMN_INT64:
+                static_cast<int64_t *>(col.data)[row] =
+                        static_cast<int64_t>(luaL_checkinteger( L, idx ));
+                break;
+            }
+        }
+
+        template <typename T>
+        void push_view( lua_State *L, const column &col )
+        {
+            typed_array<T>::wrap( L, static_cast<T *>(col.data), rows_ );
+        }
+
+        /// pushes a typed array over the column, anchored to the batch at
+        /// batch_idx
+        void push_column( lua_State *L, const column &col, int batch_idx )
+        {
+            switch( col.type ) {
+            case COLUMN_FLOAT32:
+                push_view<float>( L, col );
+                break;
+            case COLUMN_FLOAT64:
+                push_view<double>( L, col );
+                break;
+            case COLUMN_INT32:
+                push_view<int32_t>( L, col );
+                break;
+            case COLUMN_INT64:
+                push_view<int64_t>( L, col );
+                break;
+            }
+            anchor( L, batch_idx );
+        }
+
+        static void *anchors_key( )
+        {
+            static char key;
+            return &key;
+        }
+
+        /// keeps the batch at batch_idx alive as long as the userdata
+        /// on the top of the stack is
+        static void anchor( lua_State *L, int batch_idx )
+        {
+            batch_idx = lua_absindex( L, batch_idx );
+            if( lua_rawgetp( L, LUA_REGISTRYINDEX,
+                             anchors_key( ) ) == LUA_TNIL )
+            {
+                lua_pop( L, 1 );
+                lua_newtable( L );
+                lua_createtable( L, 0, 1 );
+                lua_pushliteral( L, "k" );
+                lua_setfield( L, -2, "__mode" );
+                lua_setmetatable( L, -2 );
+                lua_pushvalue( L, -1 );
+                lua_rawsetp( L, LUA_REGISTRYINDEX, anchors_key( ) );
+            }
+            lua_pushvalue( L, -2 );
+            lua_pushvalue( L, batch_idx );
+            lua_rawset( L, -3 );
+            lua_pop( L, 1 );
+        }
+
+        static int lcall_rows( lua_State *L )
+        {
+            record_batch *self = check( L, 1 );
+            lua_pushinteger( L, static_cast<lua_Integer>(self->rows_) );
+            return 1;
+        }
+
+        static int lcall_column( lua_State *L )
+        {
+            record_batch *self = check( L, 1 );
+            const column *col = self->find( L, 2 );
+            if( !col ) {
+                return 0;
+            }
+            self->push_column( L, *col, 1 );
+            return 1;
+        }
+
+        static int lcall_add_column( lua_State *L )
+        {
+            static const char *types[ ] = {
+                "float32", "float64", "int32", "int64", nullptr
+            };
+            record_batch *self = check( L, 1 );
+            size_t len = 0;
+            const char *name = luaL_checklstring( L, 2, &len );
+            int t = luaL_checkoption( L, 3, "float64", types );
+            luaL_argcheck( L, self->find( name, len ) == nullptr, 2,
+                           "column exists" );
+            const column &col = self->add_column( std::string( name, len ),
+                                                  static_cast<column_type>(t) );
+            self->push_column( L, col, 1 );
+            return 1;
+        }
+
+        static int lcall_names( lua_State *L )
+        {
+            record_batch *self = check( L, 1 );
+            lua_createtable( L, static_cast<int>(self->columns_.size( )), 0 );
+            lua_Integer i = 1;
+            for( const column &c: self->columns_ ) {
+                lua_pushlstring( L, c.name.c_str( ), c.name.size( ) );
+                lua_rawseti( L, -2, i++ );
+            }
+            return 1;
+        }
+
+        /// upvalues: batch, cursor
+        static int lcall_next_row( lua_State *L )
+        {
+            record_batch *self = state::test_metatable<record_batch>(
+                        L, lua_upvalueindex( 1 ) );
+            row_cursor *cur = state::test_metatable<row_cursor>(
+                        L, lua_upvalueindex( 2 ) );
+            lua_Integer i = luaL_checkinteger( L, 2 ) + 1;
+            if( !self || !cur || i < 1
+             || static_cast<size_t>(i) > self->rows_ )
+            {
+                return 0;
+            }
+            cur->row_ = static_cast<size_t>(i - 1);
+            lua_pushinteger( L, i );
+            lua_pushvalue( L, lua_upvalueindex( 2 ) );
+            return 2;
+        }
+
+        static int lcall_rows_iter( lua_State *L )
+        {
+            record_batch *self = check( L, 1 );
+            lua_pushvalue( L, 1 );
+            state::create_metatable<row_cursor>( L, self );
+            anchor( L, 1 );
+            lua_pushcclosure( L, &lcall_next_row, 2 );
+            lua_pushnil( L );
+            lua_pushinteger( L, 0 );
+            return 3;
+        }
+
+        size_t              rows_;
+        std::vector<column> columns_;
+    };
+
+    template <>
+    struct record_batch::type_of<float> {
+        static const column_type value = COLUMN_FLOAT32;
+    };
+
+    template <>
+    struct record_batch::type_of<double> {
+        static const column_type value = COLUMN_FLOAT64;
+    };
+
+    template <>
+    struct record_batch::type_of<int32_t> {
+        static const column_type value = COLUMN_INT32;
+    };
+
+    template <>
+    struct record_batch::type_of<int64_t> {
+        static const column_type value = COLUMN_INT64;
+    };
+
+    /*
+     * registers the batch, cursor and typed array metatables and returns
+     * { new = function( rows ) }
+     *
+     * ls.openlib( "record_batch", &lua::luaopen_record_batch );
+     */
+    inline int luaopen_record_batch( lua_State *L )
+    {
+        luaopen_typed_array( L );
+        lua_pop( L, 1 );
+
+        state::register_metatable<record_batch>( L );
+        state::register_metatable<record_batch::row_cursor>( L );
+        lua_pop( L, 2 );
+
+        static const struct luaL_Reg lib[ ] = {
+            { "new",     &record_batch::lcall_new },
+            { nullptr,   nullptr                  },
+        };
+
+        lua_createtable( L, 0, 1 );
+        luaL_setfuncs( L, lib, 0 );
+        return 1;
+    }
+
+}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#endif // LUA_RECORD_BATCH_HPP
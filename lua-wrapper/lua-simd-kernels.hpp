@@ -0,0 +1,796 @@
+#ifndef LUA_SIMD_KERNELS_HPP
+#define LUA_SIMD_KERNELS_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+
+#include <stdint.h>
+
+#if !defined(LUA_WRAPPER_NO_SIMD) \
+    && ( defined(__x86_64__) || defined(_M_X64) )
+#define LUA_WRAPPER_SIMD_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define LUA_WRAPPER_TARGET_AVX2
+#else
+#define LUA_WRAPPER_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#endif
+
+/*
+ * Element-wise and reduction kernels for contiguous numeric buffers.
+ * float and double use SSE2 or AVX2, picked once at runtime;
+ * integer types use the scalar versions. sum and dot accumulate
+ * floats in double on every path, so results differ between ISAs
+ * only by the order of the additions. min and max return NaN when any
+ * element is NaN, on every path.
+ * Define LUA_WRAPPER_NO_SIMD to force the scalar code everywhere.
+ */
+namespace lua { namespace simd {
+
+    enum isa_level {
+         ISA_SCALAR = 0
+        ,ISA_SSE2   = 1
+        ,ISA_AVX2   = 2
+    };
+
+    inline const char *isa_name( isa_level l )
+    {
+        switch( l ) {
+        case ISA_SSE2:
+            return "sse2";
+        case ISA_AVX2:
+            return "avx2";
+        default:
+            break;
+        }
+        return "scalar";
+    }
+
+    inline isa_level detect_isa( )
+    {
+#ifdef LUA_WRAPPER_SIMD_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+        int info[4] = { 0 };
+        __cpuid( info, 0 );
+        if( info[0] >= 7 ) {
+            __cpuid( info, 1 );
+            const bool osxsave = ( info[2] & (1 << 27) ) != 0;
+            const bool avx     = ( info[2] & (1 << 28) ) != 0;
+            __cpuidex( info, 7, 0 );
+            const bool avx2    = ( info[1] & (1 << 5) ) != 0;
+            if( osxsave && avx && avx2
+             && ( _xgetbv( 0 ) & 6 ) == 6 )
+            {
+                return ISA_AVX2;
+            }
+        }
+        return ISA_SSE2;
+#else
+        __builtin_cpu_init( );
+        return __builtin_cpu_supports( "avx2" ) ? ISA_AVX2 : ISA_SSE2;
+#endif
+#else
+        return ISA_SCALAR;
+#endif
+    }
+
+    /// detected once per process
+    inline isa_level current_isa( )
+    {
+        static const isa_level level = detect_isa( );
+        return level;
+    }
+
+    template <typename T>
+    struct accumulator {
+        typedef double type;
+    };
+
+    template <>
+    struct accumulator<int32_t> {
+        typedef int64_t type;
+    };
+
+    template <>
+    struct accumulator<int64_t> {
+        typedef int64_t type;
+    };
+
+    /// portable versions; also finish the tails of the vector loops
+    namespace scalar {
+
+        template <typename T>
+        inline bool is_nan( T )
+        {
+            return false;
+        }
+
+        inline bool is_nan( float v )
+        {
+            return v != v;
+        }
+
+        inline bool is_nan( double v )
+        {
+            return v != v;
+        }
+
+        /// b if it is smaller or NaN, so a NaN sticks
+        template <typename T>
+        inline T min_of( T a, T b )
+        {
+            return b < a || is_nan( b ) ? b : a;
+        }
+
+        template <typename T>
+        inline T max_of( T a, T b )
+        {
+            return b > a || is_nan( b ) ? b : a;
+        }
+
+        template <typename T>
+        typename accumulator<T>::type sum( const T *p, size_t n )
+        {
+            typename accumulator<T>::type res = 0;
+            for( size_t i = 0; i < n; ++i ) {
+                res += p[i];
+            }
+            return res;
+        }
+
+        template <typename T>
+        T min( const T *p, size_t n )
+        {
+            T res = p[0];
+            for( size_t i = 1; i < n; ++i ) {
+                res = min_of( res, p[i] );
+            }
+            return res;
+        }
+
+        template <typename T>
+        T max( const T *p, size_t n )
+        {
+            T res = p[0];
+            for( size_t i = 1; i < n; ++i ) {
+                res = max_of( res, p[i] );
+            }
+            return res;
+        }
+
+        template <typename T>
+        typename accumulator<T>::type dot( const T *a, const T *b, size_t n )
+        {
+            typename accumulator<T>::type res = 0;
+            for( size_t i = 0; i < n; ++i ) {
+                res += static_cast<typename accumulator<T>::type>(a[i]) * b[i];
+            }
+            return res;
+        }
+
+        template <typename T>
+        void scale( T *p, size_t n, T k )
+        {
+            for( size_t i = 0; i < n; ++i ) {
+                p[i] *= k;
+            }
+        }
+
+        /// p += k * q
+        template <typename T>
+        void axpy( T *p, const T *q, size_t n, T k )
+        {
+            for( size_t i = 0; i < n; ++i ) {
+                p[i] += k * q[i];
+            }
+        }
+
+        /// p = p >= t ? hi : lo
+        template <typename T>
+        void threshold( T *p, size_t n, T t, T lo, T hi )
+        {
+            for( size_t i = 0; i < n; ++i ) {
+                p[i] = p[i] >= t ? hi : lo;
+            }
+        }
+    }
+
+#ifdef LUA_WRAPPER_SIMD_X86
+
+    namespace sse2 {
+
+        inline double hsum( __m128d v )
+        {
+            return _mm_cvtsd_f64( _mm_add_sd( v, _mm_unpackhi_pd( v, v ) ) );
+        }
+
+        /// float lanes widened to double, like the scalar accumulator
+        inline double sum( const float *p, size_t n )
+        {
+            __m128d a0 = _mm_setzero_pd( );
+            __m128d a1 = _mm_setzero_pd( );
+            size_t i = 0;
+            for( ; i + 4 <= n; i += 4 ) {
+                const __m128 v = _mm_loadu_ps( p + i );
+                a0 = _mm_add_pd( a0, _mm_cvtps_pd( v ) );
+                a1 = _mm_add_pd( a1, _mm_cvtps_pd( _mm_movehl_ps( v, v ) ) );
+            }
+            return hsum( _mm_add_pd( a0, a1 ) ) + scalar::sum( p + i, n - i );
+        }
+
+        inline double sum( const double *p, size_t n )
+        {
+            __m128d a0 = _mm_setzero_pd( );
+            __m128d a1 = _mm_setzero_pd( );
+            size_t i = 0;
+            for( ; i + 4 <= n; i += 4 ) {
+                a0 = _mm_add_pd( a0, _mm_loadu_pd( p + i ) );
+                a1 = _mm_add_pd( a1, _mm_loadu_pd( p + i + 2 ) );
+            }
+            return hsum( _mm_add_pd( a0, a1 ) ) + scalar::sum( p + i, n - i );
+        }
+
+        inline double dot( const float *a, const float *b, size_t n )
+        {
+            __m128d a0 = _mm_setzero_pd( );
+            __m128d a1 = _mm_setzero_pd( );
+            size_t i = 0;
+            for( ; i + 4 <= n; i += 4 ) {
+                const __m128 va = _mm_loadu_ps( a + i );
+                const __m128 vb = _mm_loadu_ps( b + i );
+                a0 = _mm_add_pd( a0, _mm_mul_pd( _mm_cvtps_pd( va ),
+                                                 _mm_cvtps_pd( vb ) ) );
+                a1 = _mm_add_pd( a1,
+                        _mm_mul_pd( _mm_cvtps_pd( _mm_movehl_ps( va, va ) ),
+                                    _mm_cvtps_pd( _mm_movehl_ps( vb, vb ) ) ) );
+            }
+            return hsum( _mm_add_pd( a0, a1 ) )
+                 + scalar::dot( a + i, b + i, n - i );
+        }
+
+        inline double dot( const double *a, const double *b, size_t n )
+        {
+            __m128d a0 = _mm_setzero_pd( );
+            __m128d a1 = _mm_setzero_pd( );
+            size_t i = 0;
+            for( ; i + 4 <= n; i += 4 ) {
+                a0 = _mm_add_pd( a0, _mm_mul_pd( _mm_loadu_pd( a + i ),
+                                                 _mm_loadu_pd( b + i ) ) );
+                a1 = _mm_add_pd( a1, _mm_mul_pd( _mm_loadu_pd( a + i + 2 ),
+                                                 _mm_loadu_pd( b + i + 2 ) ) );
+            }
+            return hsum( _mm_add_pd( a0, a1 ) )
+                 + scalar::dot( a + i, b + i, n - i );
+        }
+
+        inline float min( const float *p, size_t n )
+        {
+            if( n < 4 ) {
+                return scalar::min( p, n );
+            }
+            __m128 m = _mm_loadu_ps( p );
+            __m128 nan = _mm_cmpunord_ps( m, m );
+            size_t i = 4;
+            for( ; i + 4 <= n; i += 4 ) {
+                const __m128 v = _mm_loadu_ps( p + i );
+                m = _mm_min_ps( m, v );
+                nan = _mm_or_ps( nan, _mm_cmpunord_ps( v, v ) );
+            }
+            if( _mm_movemask_ps( nan ) ) {
+                return std::numeric_limits<float>::quiet_NaN( );
+            }
+            float lanes[4];
+            _mm_storeu_ps( lanes, m );
+            float res = scalar::min( lanes, 4 );
+            return i < n ? scalar::min_of( res, scalar::min( p + i, n - i ) )
+                         : res;
+        }
+
+        inline double min( const double *p, size_t n )
+        {
+            if( n < 2 ) {
+                return scalar::min( p, n );
+            }
+            __m128d m = _mm_loadu_pd( p );
+            __m128d nan = _mm_cmpunord_pd( m, m );
+            size_t i = 2;
+            for( ; i + 2 <= n; i += 2 ) {
+                const __m128d v = _mm_loadu_pd( p + i );
+                m = _mm_min_pd( m, v );
+                nan = _mm_or_pd( nan, _mm_cmpunord_pd( v, v ) );
+            }
+            if( _mm_movemask_pd( nan ) ) {
+                return std::numeric_limits<double>::quiet_NaN( );
+            }
+            double lanes[2];
+            _mm_storeu_pd( lanes, m );
+            double res = scalar::min( lanes, 2 );
+            return i < n ? scalar::min_of( res, scalar::min( p + i, n - i ) )
+                         : res;
+        }
+
+        inline float max( const float *p, size_t n )
+        {
+            if( n < 4 ) {
+                return scalar::max( p, n );
+            }
+            __m128 m = _mm_loadu_ps( p );
+            __m128 nan = _mm_cmpunord_ps( m, m );
+            size_t i = 4;
+            for( ; i + 4 <= n; i += 4 ) {
+                const __m128 v = _mm_loadu_ps( p + i );
+                m = _mm_max_ps( m, v );
+                nan = _mm_or_ps( nan, _mm_cmpunord_ps( v, v ) );
+            }
+            if( _mm_movemask_ps( nan ) ) {
+                return std::numeric_limits<float>::quiet_NaN( );
+            }
+            float lanes[4];
+            _mm_storeu_ps( lanes, m );
+            float res = scalar::max( lanes, 4 );
+            return i < n ? scalar::max_of( res, scalar::max( p + i, n - i ) )
+                         : res;
+        }
+
+        inline double max( const double *p, size_t n )
+        {
+            if( n < 2 ) {
+                return scalar::max( p, n );
+            }
+            __m128d m = _mm_loadu_pd( p );
+            __m128d nan = _mm_cmpunord_pd( m, m );
+            size_t i = 2;
+            for( ; i + 2 <= n; i += 2 ) {
+                const __m128d v = _mm_loadu_pd( p + i );
+                m = _mm_max_pd( m, v );
+                nan = _mm_or_pd( nan, _mm_cmpunord_pd( v, v ) );
+            }
+            if( _mm_movemask_pd( nan ) ) {
+                return std::numeric_limits<double>::quiet_NaN( );
+            }
+            double lanes[2];
+            _mm_storeu_pd( lanes, m );
+            double res = scalar::max( lanes, 2 );
+            return i < n ? scalar::max_of( res, scalar::max( p + i, n - i ) )
+                         : res;
+        }
+
+        inline void scale( float *p, size_t n, float k )
+        {
+            const __m128 vk = _mm_set1_ps( k );
+            size_t i = 0;
+            for( ; i + 4 <= n; i += 4 ) {
+                _mm_storeu_ps( p + i, _mm_mul_ps( _mm_loadu_ps( p + i ), vk ) );
+            }
+            scalar::scale( p + i, n - i, k );
+        }
+
+        inline void scale( double *p, size_t n, double k )
+        {
+            const __m128d vk = _mm_set1_pd( k );
+            size_t i = 0;
+            for( ; i + 2 <= n; i += 2 ) {
+                _mm_storeu_pd( p + i, _mm_mul_pd( _mm_loadu_pd( p + i ), vk ) );
+            }
+            scalar::scale( p + i, n - i, k );
+        }
+
+        inline void axpy( float *p, const float *q, size_t n, float k )
+        {
+            const __m128 vk = _mm_set1_ps( k );
+            size_t i = 0;
+            for( ; i + 4 <= n; i += 4 ) {
+                __m128 r = _mm_add_ps( _mm_loadu_ps( p + i ),
+                                       _mm_mul_ps( vk, _mm_loadu_ps( q + i ) ) );
+                _mm_storeu_ps( p + i, r );
+            }
+            scalar::axpy( p + i, q + i, n - i, k );
+        }
+
+        inline void axpy( double *p, const double *q, size_t n, double k )
+        {
+            const __m128d vk = _mm_set1_pd( k );
+            size_t i = 0;
+            for( ; i + 2 <= n; i += 2 ) {
+                __m128d r = _mm_add_pd( _mm_loadu_pd( p + i ),
+                                        _mm_mul_pd( vk, _mm_loadu_pd( q + i ) ) );
+                _mm_storeu_pd( p + i, r );
+            }
+            scalar::axpy( p + i, q + i, n - i, k );
+        }
+
+        inline void threshold( float *p, size_t n, float t, float lo, float hi )
+        {
+            const __m128 vt  = _mm_set1_ps( t );
+            const __m128 vlo = _mm_set1_ps( lo );
+            const __m128 vhi = _mm_set1_ps( hi );
+            size_t i = 0;
+            for( ; i + 4 <= n; i += 4 ) {
+                __m128 m = _mm_cmpge_ps( _mm_loadu_ps( p + i ), vt );
+                _mm_storeu_ps( p + i, _mm_or_ps( _mm_and_ps( m, vhi ),
+                                                 _mm_andnot_ps( m, vlo ) ) );
+            }
+            scalar::threshold( p + i, n - i, t, lo, hi );
+        }
+
+        inline void threshold( double *p, size_t n,
+                               double t, double lo, double hi )
+        {
+            const __m128d vt  = _mm_set1_pd( t );
+            const __m128d vlo = _mm_set1_pd( lo );
+            const __m128d vhi = _mm_set1_pd( hi );
+            size_t i = 0;
+            for( ; i + 2 <= n; i += 2 ) {
+                __m128d m = _mm_cmpge_pd( _mm_loadu_pd( p + i ), vt );
+                _mm_storeu_pd( p + i, _mm_or_pd( _mm_and_pd( m, vhi ),
+                                                 _mm_andnot_pd( m, vlo ) ) );
+            }
+            scalar::threshold( p + i, n - i, t, lo, hi );
+        }
+    }
+
+    namespace avx2 {
+
+        /// the low and high four floats of v, widened to double
+        LUA_WRAPPER_TARGET_AVX2
+        inline __m256d widen_lo( __m256 v )
+        {
+            return _mm256_cvtps_pd( _mm256_castps256_ps128( v ) );
+        }
+
+        LUA_WRAPPER_TARGET_AVX2
+        inline __m256d widen_hi( __m256 v )
+        {
+            return _mm256_cvtps_pd( _mm256_extractf128_ps( v, 1 ) );
+        }
+
+        LUA_WRAPPER_TARGET_AVX2
+        inline __m128d fold( __m256d v )
+        {
+            return _mm_add_pd( _mm256_castpd256_pd128( v ),
+                               _mm256_extractf128_pd( v, 1 ) );
+        }
+
+        LUA_WRAPPER_TARGET_AVX2
+        inline double sum( const float *p, size_t n )
+        {
+            __m256d a0 = _mm256_setzero_pd( );
+            __m256d a1 = _mm256_setzero_pd( );
+            size_t i = 0;
+            for( ; i + 8 <= n; i += 8 ) {
+                const __m256 v = _mm256_loadu_ps( p + i );
+                a0 = _mm256_add_pd( a0, widen_lo( v ) );
+                a1 = _mm256_add_pd( a1, widen_hi( v ) );
+            }
+            return sse2::hsum( fold( _mm256_add_pd( a0, a1 ) ) )
+                 + sse2::sum( p + i, n - i );
+        }
+
+        LUA_WRAPPER_TARGET_AVX2
+        inline double sum( const double *p, size_t n )
+        {
+            __m256d a0 = _mm256_setzero_pd( );
+            __m256d a1 = _mm256_setzero_pd( );
+            size_t i = 0;
+            for( ; i + 8 <= n; i += 8 ) {
+                a0 = _mm256_add_pd( a0, _mm256_loadu_pd( p + i ) );
+                a1 = _mm256_add_pd( a1, _mm256_loadu_pd( p + i + 4 ) );
+            }
+            return sse2::hsum( fold( _mm256_add_pd( a0, a1 ) ) )
+                 + sse2::sum( p + i, n - i );
+        }
+
+        LUA_WRAPPER_TARGET_AVX2
+        inline double dot( const float *a, const float *b, size_t n )
+        {
+            __m256d a0 = _mm256_setzero_pd( );
+            __m256d a1 = _mm256_setzero_pd( );
+            size_t i = 0;
+            for( ; i + 8 <= n; i += 8 ) {
+                const __m256 va = _mm256_loadu_ps( a + i );
+                const __m256 vb = _mm256_loadu_ps( b + i );
+                a0 = _mm256_add_pd( a0, _mm256_mul_pd( widen_lo( va ),
+                                                       widen_lo( vb ) ) );
+                a1 = _mm256_add_pd( a1, _mm256_mul_pd( widen_hi( va ),
+                                                       widen_hi( vb ) ) );
+            }
+            return sse2::hsum( fold( _mm256_add_pd( a0, a1 ) ) )
+                 + sse2::dot( a + i, b + i, n - i );
+        }
+
+        LUA_WRAPPER_TARGET_AVX2
+        inline double dot( const double *a, const double *b, size_t n )
+        {
+            __m256d a0 = _mm256_setzero_pd( );
+            __m256d a1 = _mm256_setzero_pd( );
+            size_t i = 0;
+            for( ; i + 8 <= n; i += 8 ) {
+                a0 = _mm256_add_pd( a0,
+                        _mm256_mul_pd( _mm256_loadu_pd( a + i ),
+                                       _mm256_loadu_pd( b + i ) ) );
+                a1 = _mm256_add_pd( a1,
+                        _mm256_mul_pd( _mm256_loadu_pd( a + i + 4 ),
+                                       _mm256_loadu_pd( b + i + 4 ) ) );
+            }
+            return sse2::hsum( fold( _mm256_add_pd( a0, a1 ) ) )
+                 + sse2::dot( a + i, b + i, n - i );
+        }
+
+        LUA_WRAPPER_TARGET_AVX2
+        inline float min( const float *p, size_t n )
+        {
+            if( n < 8 ) {
+                return sse2::min( p, n );
+            }
+            __m256 m = _mm256_loadu_ps( p );
+            __m256 nan = _mm256_cmp_ps( m, m, _CMP_UNORD_Q );
+            size_t i = 8;
+            for( ; i + 8 <= n; i += 8 ) {
+                const __m256 v = _mm256_loadu_ps( p + i );
+                m = _mm256_min_ps( m, v );
+                nan = _mm256_or_ps( nan,
+                                    _mm256_cmp_ps( v, v, _CMP_UNORD_Q ) );
+            }
+            if( _mm256_movemask_ps( nan ) ) {
+                return std::numeric_limits<float>::quiet_NaN( );
+            }
+            float lanes[8];
+            _mm256_storeu_ps( lanes, m );
+            float res = scalar::min( lanes, 8 );
+            return i < n ? scalar::min_of( res, scalar::min( p + i, n - i ) )
+                         : res;
+        }
+
+        LUA_WRAPPER_TARGET_AVX2
+        inline double min( const double *p, size_t n )
+        {
+            if( n < 4 ) {
+                return sse2::min( p, n );
+            }
+            __m256d m = _mm256_loadu_pd( p );
+            __m256d nan = _mm256_cmp_pd( m, m, _CMP_UNORD_Q );
+            size_t i = 4;
+            for( ; i + 4 <= n; i += 4 ) {
+                const __m256d v = _mm256_loadu_pd( p + i );
+                m = _mm256_min_pd( m, v );
+                nan = _mm256_or_pd( nan,
+                                    _mm256_cmp_pd( v, v, _CMP_UNORD_Q ) );
+            }
+            if( _mm256_movemask_pd( nan ) ) {
+                return std::numeric_limits<double>::quiet_NaN( );
+            }
+            double lanes[4];
+            _mm256_storeu_pd( lanes, m );
+            double res = scalar::min( lanes, 4 );
+            return i < n ? scalar::min_of( res, scalar::min( p + i, n - i ) )
+                         : res;
+        }
+
+        LUA_WRAPPER_TARGET_AVX2
+        inline float max( const float *p, size_t n )
+        {
+            if( n < 8 ) {
+                return sse2::max( p, n );
+            }
+            __m256 m = _mm256_loadu_ps( p );
+            __m256 nan = _mm256_cmp_ps( m, m, _CMP_UNORD_Q );
+            size_t i = 8;
+            for( ; i + 8 <= n; i += 8 ) {
+                const __m256 v = _mm256_loadu_ps( p + i );
+                m = _mm256_max_ps( m, v );
+                nan = _mm256_or_ps( nan,
+                                    _mm256_cmp_ps( v, v, _CMP_UNORD_Q ) );
+            }
+            if( _mm256_movemask_ps( nan ) ) {
+                return std::numeric_limits<float>::quiet_NaN( );
+            }
+            float lanes[8];
+            _mm256_storeu_ps( lanes, m );
+            float res = scalar::max( lanes, 8 );
+            return i < n ? scalar::max_of( res, scalar::max( p + i, n - i ) )
+                         : res;
+        }
+
+        LUA_WRAPPER_TARGET_AVX2
+        inline double max( const double *p, size_t n )
+        {
+            if( n < 4 ) {
+                return sse2::max( p, n );
+            }
+            __m256d m = _mm256_loadu_pd( p );
+            __m256d nan = _mm256_cmp_pd( m, m, _CMP_UNORD_Q );
+            size_t i = 4;
+            for( ; i + 4 <= n; i += 4 ) {
+                const __m256d v = _mm256_loadu_pd( p + i );
+                m = _mm256_max_pd( m, v );
+                nan = _mm256_or_pd( nan,
+                                    _mm256_cmp_pd( v, v, _CMP_UNORD_Q ) );
+            }
+            if( _mm256_movemask_pd( nan ) ) {
+                return std::numeric_limits<double>::quiet_NaN( );
+            }
+            double lanes[4];
+            _mm256_storeu_pd( lanes, m );
+            double res = scalar::max( lanes, 4 );
+            return i < n ? scalar::max_of( res, scalar::max( p + i, n - i ) )
+                         : res;
+        }
+
+        LUA_WRAPPER_TARGET_AVX2
+        inline void scale( float *p, size_t n, float k )
+        {
+            const __m256 vk = _mm256_set1_ps( k );
+            size_t i = 0;
+            for( ; i + 8 <= n; i += 8 ) {
+                _mm256_storeu_ps( p + i,
+                        _mm256_mul_ps( _mm256_loadu_ps( p + i ), vk ) );
+            }
+            scalar::scale( p + i, n - i, k );
+        }
+
+        LUA_WRAPPER_TARGET_AVX2
+        inline void scale( double *p, size_t n, double k )
+        {
+            const __m256d vk = _mm256_set1_pd( k );
+            size_t i = 0;
+            for( ; i + 4 <= n; i += 4 ) {
+                _mm256_storeu_pd( p + i,
+                        _mm256_mul_pd( _mm256_loadu_pd( p + i ), vk ) );
+            }
+            scalar::scale( p + i, n - i, k );
+        }
+
+        LUA_WRAPPER_TARGET_AVX2
+        inline void axpy( float *p, const float *q, size_t n, float k )
+        {
+            const __m256 vk = _mm256_set1_ps( k );
+            size_t i = 0;
+            for( ; i + 8 <= n; i += 8 ) {
+                __m256 r = _mm256_add_ps( _mm256_loadu_ps( p + i ),
+                           _mm256_mul_ps( vk, _mm256_loadu_ps( q + i ) ) );
+                _mm256_storeu_ps( p + i, r );
+            }
+            scalar::axpy( p + i, q + i, n - i, k );
+        }
+
+        LUA_WRAPPER_TARGET_AVX2
+        inline void axpy( double *p, const double *q, size_t n, double k )
+        {
+            const __m256d vk = _mm256_set1_pd( k );
+            size_t i = 0;
+            for( ; i + 4 <= n; i += 4 ) {
+                __m256d r = _mm256_add_pd( _mm256_loadu_pd( p + i ),
+                            _mm256_mul_pd( vk, _mm256_loadu_pd( q + i ) ) );
+                _mm256_storeu_pd( p + i, r );
+            }
+            scalar::axpy( p + i, q + i, n - i, k );
+        }
+
+        LUA_WRAPPER_TARGET_AVX2
+        inline void threshold( float *p, size_t n, float t, float lo, float hi )
+        {
+            const __m256 vt  = _mm256_set1_ps( t );
+            const __m256 vlo = _mm256_set1_ps( lo );
+            const __m256 vhi = _mm256_set1_ps( hi );
+            size_t i = 0;
+            for( ; i + 8 <= n; i += 8 ) {
+                __m256 m = _mm256_cmp_ps( _mm256_loadu_ps( p + i ), vt,
+                                          _CMP_GE_OQ );
+                _mm256_storeu_ps( p + i, _mm256_blendv_ps( vlo, vhi, m ) );
+            }
+            scalar::threshold( p + i, n - i, t, lo, hi );
+        }
+
+        LUA_WRAPPER_TARGET_AVX2
+        inline void threshold( double *p, size_t n,
+                               double t, double lo, double hi )
+        {
+            const __m256d vt  = _mm256_set1_pd( t );
+            const __m256d vlo = _mm256_set1_pd( lo );
+            const __m256d vhi = _mm256_set1_pd( hi );
+            size_t i = 0;
+            for( ; i + 4 <= n; i += 4 ) {
+                __m256d m = _mm256_cmp_pd( _mm256_loadu_pd( p + i ), vt,
+                                           _CMP_GE_OQ );
+                _mm256_storeu_pd( p + i, _mm256_blendv_pd( vlo, vhi, m ) );
+            }
+            scalar::threshold( p + i, n - i, t, lo, hi );
+        }
+    }
+
+#endif // LUA_WRAPPER_SIMD_X86
+
+    /*
+     * kernels<T>::get( ) returns the table for the current CPU.
+     * min/max expect n > 0.
+     */
+    template <typename T>
+    struct kernels {
+
+        typedef typename accumulator<T>::type acc_type;
+
+        acc_type (*sum)       ( const T *, size_t );
+        T        (*min)       ( const T *, size_t );
+        T        (*max)       ( const T *, size_t );
+        acc_type (*dot)       ( const T *, const T *, size_t );
+        void     (*scale)     ( T *, size_t, T );
+        void     (*axpy)      ( T *, const T *, size_t, T );
+        void     (*threshold) ( T *, size_t, T, T, T );
+
+        static kernels make_scalar( )
+        {
+            kernels res = {
+                &scalar::sum<T>,   &scalar::min<T>,  &scalar::max<T>,
+                &scalar::dot<T>,   &scalar::scale<T>,
+                &scalar::axpy<T>,  &scalar::threshold<T>
+            };
+            return res;
+        }
+
+        static kernels make( isa_level )
+        {
+            return make_scalar( );
+        }
+
+        static const kernels &get( )
+        {
+            static const kernels res = make( current_isa( ) );
+            return res;
+        }
+    };
+
+#ifdef LUA_WRAPPER_SIMD_X86
+
+    template <>
+    inline kernels<float> kernels<float>::make( isa_level level )
+    {
+        if( level == ISA_AVX2 ) {
+            kernels res = {
+                &avx2::sum,  &avx2::min,   &avx2::max, &avx2::dot,
+                &avx2::scale, &avx2::axpy, &avx2::threshold
+            };
+            return res;
+        }
+        kernels res = {
+            &sse2::sum,  &sse2::min,   &sse2::max, &sse2::dot,
+            &sse2::scale, &sse2::axpy, &sse2::threshold
+        };
+        return res;
+    }
+
+    template <>
+    inline kernels<double> kernels<double>::make( isa_level level )
+    {
+        if( level == ISA_AVX2 ) {
+            kernels res = {
+                &avx2::sum,  &avx2::min,   &avx2::max, &avx2::dot,
+                &avx2::scale, &avx2::axpy, &avx2::threshold
+            };
+            return res;
+        }
+        kernels res = {
+            &sse2::sum,  &sse2::min,   &sse2::max, &sse2::dot,
+            &sse2::scale, &sse2::axpy, &sse2::threshold
+        };
+        return res;
+    }
+
+#endif
+
+}}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#endif // LUA_SIMD_KERNELS_HPP
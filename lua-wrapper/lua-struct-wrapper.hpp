@@ -0,0 +1,172 @@
+#ifndef LUA_STRUCT_WRAPPER_HPP
+#define LUA_STRUCT_WRAPPER_HPP
+
+#include <tuple>
+#include <utility>
+
+extern "C" {
+#include "lua.h"
+}
+
+#include "lua-type-wrapper.hpp"
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+#define LUA_WRAPPER_TYPES_NS_BEGIN \
+    namespace LUA_WRAPPER_TOP_NAMESPACE { namespace lua { namespace types {
+#define LUA_WRAPPER_TYPES_NS_END }}}
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#else
+
+#define LUA_WRAPPER_TYPES_NS_BEGIN namespace lua { namespace types {
+#define LUA_WRAPPER_TYPES_NS_END }}
+
+#endif
+
+/*
+ * struct point {
+ *     int         x;
+ *     int         y;
+ *     std::string name;
+ * };
+ *
+ * LUA_WRAPPER_STRUCT( point,
+ *                     LUA_WRAPPER_FIELD( x ),
+ *                     LUA_WRAPPER_FIELD( y ),
+ *                     LUA_WRAPPER_FIELD( name ) )
+ *
+ * after that point works with state::push, get<point>, get_opt<point>,
+ * get_field<point>, set( "path", point ) etc.
+ * The macro has to be used in the global namespace.
+ */
+#define LUA_WRAPPER_STRUCT( Type, ... )                                  \
+    LUA_WRAPPER_TYPES_NS_BEGIN                                           \
+    template <>                                                          \
+    struct struct_fields<Type> {                                         \
+        typedef Type struct_type;                                        \
+        static const auto &list( )                                       \
+        {                                                                \
+            static const auto res = std::make_tuple( __VA_ARGS__ );      \
+            return res;                                                  \
+        }                                                                \
+    };                                                                   \
+    template <>                                                          \
+    struct id_traits<Type> : public                                      \
+           id_struct<Type> { };                                          \
+    LUA_WRAPPER_TYPES_NS_END
+
+#define LUA_WRAPPER_FIELD( Name ) \
+    make_field( #Name, &struct_type::Name )
+
+#define LUA_WRAPPER_FIELD_NAMED( Name, Field ) \
+    make_field( Name, &struct_type::Field )
+
+namespace lua { namespace types {
+
+    template <typename S, typename F>
+    struct struct_field {
+        typedef F value_type;
+        const char  *name;
+        F S::*       member;
+    };
+
+    template <typename S, typename F>
+    inline struct_field<S, F> make_field( const char *name, F S::*member )
+    {
+        struct_field<S, F> res = { name, member };
+        return res;
+    }
+
+    /*
+     * struct struct_fields<MyStruct> {
+     *      typedef MyStruct struct_type;
+     *      static const std::tuple<struct_field<...>...> &list( );
+     * };
+     * LUA_WRAPPER_STRUCT generates it
+     */
+    template <typename S>
+    struct struct_fields;
+
+    template <typename S>
+    struct id_struct: public base_id<LUA_TTABLE> {
+
+    private:
+
+        typedef typename std::decay<
+            decltype( struct_fields<S>::list( ) )
+        >::type fields_tuple;
+
+        enum { field_count = std::tuple_size<fields_tuple>::value };
+
+        struct pusher {
+            lua_State *L;
+            const S   &value;
+
+            template <typename F>
+            void operator ( )( const struct_field<S, F> &fld ) const
+            {
+                id_traits<F>::push( L, value.*fld.member );
+                /// field names are literals with stable addresses,
+                /// so lua_setfield hits the API string cache on every push
+                lua_setfield( L, -2, fld.name );
+            }
+        };
+
+        struct getter {
+            lua_State *L;
+            int        idx;
+            S         &value;
+
+            template <typename F>
+            void operator ( )( const struct_field<S, F> &fld ) const
+            {
+                typedef id_traits<F> traits;
+                lua_getfield( L, idx, fld.name );
+                if( !lua_isnoneornil( L, -1 ) && traits::check( L, -1 ) ) {
+                    value.*fld.member = traits::get( L, -1 );
+                }
+                lua_pop( L, 1 );
+            }
+        };
+
+        template <typename Call, size_t ...I>
+        static void for_each( const Call &call, std::index_sequence<I...> )
+        {
+            const fields_tuple &fields( struct_fields<S>::list( ) );
+            int dummy[ ] = { 0, ( call( std::get<I>( fields ) ), 0 )... };
+            (void)dummy;
+        }
+
+        typedef std::make_index_sequence<field_count> indexes;
+
+    public:
+
+        static S get( lua_State *L, int idx )
+        {
+            S res = S( );
+            if( lua_type( L, idx ) == LUA_TTABLE ) {
+                lua_checkstack( L, 2 );
+                getter g = { L, lua_absindex( L, idx ), res };
+                for_each( g, indexes( ) );
+            }
+            return res;
+        }
+
+        static void push( lua_State *L, const S &value )
+        {
+            lua_checkstack( L, 3 );
+            lua_createtable( L, 0, field_count );
+            pusher p = { L, value };
+            for_each( p, indexes( ) );
+        }
+    };
+
+}}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#endif // LUA_STRUCT_WRAPPER_HPP
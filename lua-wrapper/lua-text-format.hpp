@@ -0,0 +1,247 @@
+#ifndef LUA_TEXT_FORMAT_HPP
+#define LUA_TEXT_FORMAT_HPP
+
+#include <cctype>
+#include <climits>
+#include <clocale>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <stdint.h>
+
+#if( __cplusplus >= 201703L ) || ( defined(_MSVC_LANG) && _MSVC_LANG >= 201703L )
+#if defined(__has_include)
+#if __has_include(<charconv>)
+#include <charconv>
+#define LUA_WRAPPER_HAS_CHARCONV 1
+#if defined(__cpp_lib_to_chars)
+#define LUA_WRAPPER_HAS_FLOAT_CHARCONV 1
+#endif
+#endif
+#endif
+#endif
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#endif
+
+/*
+ * Number <-> text without streams or temporary strings.
+ * Formatting appends to a caller-owned std::string; parsing reads a
+ * [p, end) range. std::to_chars/from_chars are used when the library
+ * has them (C++17; floating point needs __cpp_lib_to_chars), otherwise
+ * a digit loop for integers and printf/strtod for floats.
+ *
+ * Floats are written in the shortest form that reads back exactly and
+ * always with '.', whatever the C locale says; parse_number reads '.'
+ * the same way, so numbers round-trip under any locale.
+ */
+namespace lua { namespace text {
+
+    inline void append_integer( std::string &out, long long value )
+    {
+        char buf[24];
+#ifdef LUA_WRAPPER_HAS_CHARCONV
+        std::to_chars_result res = std::to_chars( buf, buf + sizeof(buf),
+                                                  value );
+        out.append( buf, res.ptr );
+#else
+        char *p = buf + sizeof(buf);
+        unsigned long long mag = value < 0
+                               ? 0 - static_cast<unsigned long long>(value)
+                               : static_cast<unsigned long long>(value);
+        do {
+            *--p = static_cast<char>('0' + mag % 10);
+            mag /= 10;
+        } while( mag );
+        if( value < 0 ) {
+            *--p = '-';
+        }
+        out.append( p, buf + sizeof(buf) );
+#endif
+    }
+
+    inline void append_unsigned( std::string &out, unsigned long long value,
+                                 int base = 10 )
+    {
+        char buf[24];
+#ifdef LUA_WRAPPER_HAS_CHARCONV
+        std::to_chars_result res = std::to_chars( buf, buf + sizeof(buf),
+                                                  value, base );
+        out.append( buf, res.ptr );
+#else
+        static const char digits[ ] = "0123456789abcdef";
+        const unsigned long long b = static_cast<unsigned long long>(base);
+        char *p = buf + sizeof(buf);
+        do {
+            *--p = digits[value % b];
+            value /= b;
+        } while( value );
+        out.append( p, buf + sizeof(buf) );
+#endif
+    }
+
+    /// 0x-prefixed hex address
+    inline void append_pointer( std::string &out, const void *ptr )
+    {
+        out.append( "0x", 2 );
+        append_unsigned( out, reinterpret_cast<uintptr_t>(ptr), 16 );
+    }
+
+    inline void append_number( std::string &out, double value )
+    {
+        char buf[32];
+#ifdef LUA_WRAPPER_HAS_FLOAT_CHARCONV
+        std::to_chars_result res = std::to_chars( buf, buf + sizeof(buf),
+                                                  value );
+        out.append( buf, res.ptr );
+#else
+        /// 17 digits always read back; the first that does is shortest
+        int n = std::snprintf( buf, sizeof(buf), "%.15g", value );
+        for( int prec = 16; prec <= 17 && value == value
+                         && std::strtod( buf, nullptr ) != value; ++prec )
+        {
+            n = std::snprintf( buf, sizeof(buf), "%.*g", prec, value );
+        }
+        const char point = std::localeconv( )->decimal_point[0];
+        if( point != '.' ) {
+            for( int i = 0; i < n; ++i ) {
+                if( buf[i] == point ) {
+                    buf[i] = '.';
+                }
+            }
+        }
+        out.append( buf, static_cast<size_t>(n) );
+#endif
+    }
+
+    inline const char *skip_space( const char *p, const char *end )
+    {
+        while( p != end && ( *p == ' ' || ( *p >= '\t' && *p <= '\r' ) ) ) {
+            ++p;
+        }
+        return p;
+    }
+
+    /*
+     * Both parsers skip leading whitespace and an optional '+', then read
+     * the longest valid prefix, like atof/atoi did. They return the end of
+     * the number, or nullptr if there is none or the integer does not fit.
+     */
+    inline const char *parse_integer( const char *p, const char *end,
+                                      long long &out )
+    {
+        p = skip_space( p, end );
+        if( p != end && *p == '+' ) {
+            ++p;
+        }
+#ifdef LUA_WRAPPER_HAS_CHARCONV
+        std::from_chars_result res = std::from_chars( p, end, out );
+        return res.ec == std::errc( ) ? res.ptr : nullptr;
+#else
+        const bool negative = ( p != end && *p == '-' );
+        if( negative ) {
+            ++p;
+        }
+        if( p == end || *p < '0' || *p > '9' ) {
+            return nullptr;
+        }
+        const unsigned long long limit = negative
+            ? static_cast<unsigned long long>(LLONG_MAX) + 1
+            : static_cast<unsigned long long>(LLONG_MAX);
+        unsigned long long mag = 0;
+        for( ; p != end && *p >= '0' && *p <= '9'; ++p ) {
+            const unsigned d = static_cast<unsigned>(*p - '0');
+            if( mag > (limit - d) / 10 ) {
+                return nullptr;
+            }
+            mag = mag * 10 + d;
+        }
+        out = negative ? static_cast<long long>(0 - mag)
+                       : static_cast<long long>(mag);
+        return p;
+#endif
+    }
+
+    inline const char *parse_number( const char *p, const char *end,
+                                     double &out )
+    {
+        p = skip_space( p, end );
+        if( p != end && *p == '+' ) {
+            ++p;
+        }
+#ifdef LUA_WRAPPER_HAS_FLOAT_CHARCONV
+        /// from_chars takes hex without the prefix; strtod took both
+        const bool negative = ( p != end && *p == '-' );
+        const char *h = p + ( negative ? 1 : 0 );
+        if( end - h > 2 && h[0] == '0' && ( h[1] == 'x' || h[1] == 'X' ) ) {
+            std::from_chars_result res = std::from_chars( h + 2, end, out,
+                                                    std::chars_format::hex );
+            if( res.ec == std::errc( ) ) {
+                out = negative ? -out : out;
+                return res.ptr;
+            }
+        }
+        std::from_chars_result res = std::from_chars( p, end, out );
+        return res.ec == std::errc( ) ? res.ptr : nullptr;
+#else
+        /// strtod needs a terminated string and reads the locale's
+        /// decimal point. The copy stops at the first character no C
+        /// number has (so also at a ',' point) and has the locale's
+        /// point in place of the first '.'
+        size_t len = 0;
+        size_t dot = static_cast<size_t>(end - p);
+        for( ; p + len != end; ++len ) {
+            const char c = p[len];
+            if( c == '.' ) {
+                dot = dot < len ? dot : len;
+            } else if( !std::isalnum( static_cast<unsigned char>(c) )
+                    && c != '+' && c != '-' && c != '(' && c != ')'
+                    && c != '_' )
+            {
+                break;
+            }
+        }
+        const char *point = std::localeconv( )->decimal_point;
+        size_t point_len = std::strlen( point );
+        if( point_len == 0 || dot >= len ) {
+            point = ".";
+            point_len = 1;
+        }
+        const size_t copy_len = dot < len ? len - 1 + point_len : len;
+        char small[64];
+        std::string large;
+        char *src = small;
+        if( copy_len >= sizeof(small) ) {
+            large.resize( copy_len + 1 );
+            src = &large[0];
+        }
+        if( dot < len ) {
+            std::memcpy( src, p, dot );
+            std::memcpy( src + dot, point, point_len );
+            std::memcpy( src + dot + point_len, p + dot + 1, len - dot - 1 );
+        } else {
+            std::memcpy( src, p, len );
+        }
+        src[copy_len] = '\0';
+        char *stop = nullptr;
+        out = std::strtod( src, &stop );
+        size_t used = static_cast<size_t>(stop - src);
+        if( dot < len && used > dot ) {
+            used -= point_len - 1;
+        }
+        return used ? p + used : nullptr;
+#endif
+    }
+
+}}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#endif // LUA_TEXT_FORMAT_HPP
@@ -6,6 +6,7 @@ extern "C" {
 }
 
 #include <stdint.h>
+#include <type_traits>
 
 #ifdef LUA_WRAPPER_TOP_NAMESPACE
 
@@ -79,6 +80,11 @@ namespace lua { namespace types {
             }
             return T( );
         }
+
+        static void push( lua_State *L, const T &value )
+        {
+            lua_pushinteger( L, static_cast<lua_Integer>( value ) );
+        }
     };
 
     struct id_boolean: public base_id<LUA_TBOOLEAN> {
@@ -109,6 +115,11 @@ namespace lua { namespace types {
             }
             return false;
         }
+
+        static void push( lua_State *L, bool value )
+        {
+            lua_pushboolean( L, value ? 1 : 0 );
+        }
     };
 
     template <typename T>
@@ -117,6 +128,11 @@ namespace lua { namespace types {
         {
             return static_cast<T>(lua_tonumber( L, idx ));
         }
+
+        static void push( lua_State *L, const T &value )
+        {
+            lua_pushnumber( L, static_cast<lua_Number>( value ) );
+        }
     };
 
     template <typename T>
@@ -125,6 +141,11 @@ namespace lua { namespace types {
         {
             return static_cast<T>(lua_touserdata( L, idx ));
         }
+
+        static void push( lua_State *L, const T &value )
+        {
+            lua_pushlightuserdata( L, value );
+        }
     };
 
     template <typename T>
@@ -133,6 +154,11 @@ namespace lua { namespace types {
         {
             return static_cast<T>(lua_topointer( L, idx ));
         }
+
+        static void push( lua_State *L, const T &value )
+        {
+            lua_pushlightuserdata( L, const_cast<void *>(value) );
+        }
     };
 
     template <typename T>
@@ -141,6 +167,11 @@ namespace lua { namespace types {
         {
             return static_cast<T>(lua_tocfunction( L, idx ));
         }
+
+        static void push( lua_State *L, const T &value )
+        {
+            lua_pushcfunction( L, value );
+        }
     };
 
     template <typename T>
@@ -158,6 +189,11 @@ namespace lua { namespace types {
             const char *t = lua_tolstring( L, idx, &length );
             return t ? T( t, t + length ) : T( );
         }
+
+        static void push( lua_State *L, const T &value )
+        {
+            lua_pushlstring( L, value.c_str( ), value.size( ) );
+        }
     };
 
     template <typename T>
@@ -174,6 +210,11 @@ namespace lua { namespace types {
             const char *t = lua_tostring( L, idx );
             return T( t ? t : "<nil>" );
         }
+
+        static void push( lua_State *L, const T &value )
+        {
+            lua_pushstring( L, value );
+        }
     };
 
     template <typename CT>
@@ -263,6 +304,29 @@ namespace lua { namespace types {
     struct id_traits<bool> : public
            id_boolean { };
 
+    /// true if id_traits<T> knows how to push T
+    template <typename T>
+    class has_push {
+
+        typedef char one;
+        typedef long two;
+
+        template <typename C> static one test( decltype(&C::push) );
+        template <typename C> static two test( ... );
+
+    public:
+        enum { value = sizeof(test<id_traits<T> >(0)) == sizeof(one) };
+    };
+
+    /// compound values (tables built from structs, containers etc.)
+    /// that state::push has to hand over to id_traits<T>::push
+    template <typename T>
+    struct push_by_traits {
+        enum { value = has_push<T>::value
+                    && !std::is_arithmetic<T>::value
+                    && !std::is_pointer<T>::value };
+    };
+
 }}
 
 #ifdef LUA_WRAPPER_TOP_NAMESPACE
@@ -0,0 +1,424 @@
+#ifndef LUA_TYPED_ARRAY_HPP
+#define LUA_TYPED_ARRAY_HPP
+
+#include <cstddef>
+#include <vector>
+
+#include <stdint.h>
+
+#include "lua-wrapper.hpp"
+#include "lua-simd-kernels.hpp"
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#endif
+
+namespace lua {
+
+    template <typename T>
+    struct typed_array_info;
+
+    template <>
+    struct typed_array_info<float> {
+        static const char *name( ) { return "float32_array"; }
+    };
+
+    template <>
+    struct typed_array_info<double> {
+        static const char *name( ) { return "float64_array"; }
+    };
+
+    template <>
+    struct typed_array_info<int32_t> {
+        static const char *name( ) { return "int32_array"; }
+    };
+
+    template <>
+    struct typed_array_info<int64_t> {
+        static const char *name( ) { return "int64_array"; }
+    };
+
+    /// non-owning view on a contiguous range
+    template <typename T>
+    class array_view {
+
+        T      *data_;
+        size_t  size_;
+
+    public:
+
+        typedef T        value_type;
+        typedef T       *iterator;
+        typedef const T *const_iterator;
+
+        array_view( )
+            :data_(nullptr)
+            ,size_(0)
+        { }
+
+        array_view( T *data, size_t size )
+            :data_(data)
+            ,size_(size)
+        { }
+
+        T *data( ) const            { return data_; }
+        size_t size( ) const        { return size_; }
+        bool empty( ) const         { return size_ == 0; }
+        T *begin( ) const           { return data_; }
+        T *end( ) const             { return data_ + size_; }
+        T &operator [ ]( size_t i ) const { return data_[i]; }
+    };
+
+    /*
+     * Typed numeric array userdata: float32, float64, int32 and int64.
+     * Elements live in one contiguous buffer that is either owned by the
+     * userdata or borrowed from the host (wrap). Borrowed buffers must
+     * outlive the userdata; scripts work on them in place.
+     *
+     * Lua:  a[i] (1-based), a[i] = v, #a, a:size( ), a:fill( v ),
+     *       a:to_table( )
+     * Kernels (lua-simd-kernels.hpp):
+     *       a:sum( ), a:min( ), a:max( ), a:dot( b ),
+     *       a:scale( k ), a:add( b [, k] ), a:threshold( t [, lo, hi] )
+     *       the last three work in place and return the array
+     */
+    template <typename T>
+    class typed_array {
+
+        std::vector<T>  storage_;
+        T              *data_;
+        size_t          size_;
+
+    public:
+
+        typedef T value_type;
+
+        explicit typed_array( size_t count )
+            :storage_(count)
+            ,data_(storage_.data( ))
+            ,size_(count)
+        { }
+
+        typed_array( T *external, size_t count )
+            :data_(external)
+            ,size_(count)
+        { }
+
+        typed_array( const typed_array &other )
+            :storage_(other.storage_)
+            ,data_(other.owns_data( ) ? storage_.data( ) : other.data_)
+            ,size_(other.size_)
+        { }
+
+        typed_array( typed_array &&other )
+            :data_(other.data_)
+            ,size_(other.size_)
+        {
+            if( other.owns_data( ) ) {
+                storage_.swap( other.storage_ );
+                data_ = storage_.data( );
+            }
+            other.data_ = nullptr;
+            other.size_ = 0;
+        }
+
+        typed_array &operator = ( const typed_array & ) = delete;
+
+        bool owns_data( ) const
+        {
+            return !storage_.empty( ) && data_ == storage_.data( );
+        }
+
+        T *data( )                  { return data_; }
+        const T *data( ) const      { return data_; }
+        size_t size( ) const        { return size_; }
+
+        array_view<T> view( )
+        {
+            return array_view<T>( data_, size_ );
+        }
+
+        array_view<const T> view( ) const
+        {
+            return array_view<const T>( data_, size_ );
+        }
+
+        /// pushes a new array with an owned buffer of count zeroes
+        static typed_array *create( lua_State *L, size_t count )
+        {
+            return state::create_metatable<typed_array>( L, count );
+        }
+
+        /// pushes a new array over the host buffer; no copy is made
+        static typed_array *wrap( lua_State *L, T *data, size_t count )
+        {
+            return state::create_metatable<typed_array>( L, data, count );
+        }
+
+        static typed_array *check( lua_State *L, int idx )
+        {
+            return state::check_metatable<typed_array>( L, idx );
+        }
+
+        static typed_array *test( lua_State *L, int idx )
+        {
+            return state::test_metatable<typed_array>( L, idx );
+        }
+
+        static const char *name( )
+        {
+            return typed_array_info<T>::name( );
+        }
+
+        static const struct luaL_Reg *table( )
+        {
+            static const struct luaL_Reg lib[ ] = {
+                { "__index",    &lcall_index    },
+                { "__newindex", &lcall_newindex },
+                { "__len",      &lcall_size     },
+                { "__tostring", &lcall_tostring },
+                { "size",       &lcall_size     },
+                { "fill",       &lcall_fill     },
+                { "to_table",   &lcall_to_table },
+                { "sum",        &lcall_sum      },
+                { "min",        &lcall_min      },
+                { "max",        &lcall_max      },
+                { "dot",        &lcall_dot      },
+                { "scale",      &lcall_scale    },
+                { "add",        &lcall_add      },
+                { "threshold",  &lcall_threshold},
+                { nullptr,      nullptr         },
+            };
+            return lib;
+        }
+
+        /// constructor for scripts: accepts a size or a sequence
+        static int lcall_new( lua_State *L )
+        {
+            if( lua_type( L, 1 ) == LUA_TTABLE ) {
+                size_t len = static_cast<size_t>(lua_rawlen( L, 1 ));
+                typed_array *res = create( L, len );
+                for( size_t i = 0; i < len; ++i ) {
+                    lua_rawgeti( L, 1, static_cast<lua_Integer>(i + 1) );
+                    res->data_[i] = to_value( L, -1 );
+                    lua_pop( L, 1 );
+                }
+            } else {
+                lua_Integer len = luaL_checkinteger( L, 1 );
+                luaL_argcheck( L, len >= 0, 1, "negative size" );
+                create( L, static_cast<size_t>(len) );
+            }
+            return 1;
+        }
+
+        static T to_value( lua_State *L, int idx )
+        {
+            if( std::is_integral<T>::value ) {
+                return static_cast<T>(luaL_checkinteger( L, idx ));
+            }
+            return static_cast<T>(luaL_checknumber( L, idx ));
+        }
+
+        static void push_value( lua_State *L, T value )
+        {
+            types::id_traits<T>::push( L, value );
+        }
+
+    private:
+
+        typedef simd::kernels<T>             kernels;
+        typedef typename kernels::acc_type   acc_type;
+
+        static void push_acc( lua_State *L, acc_type value )
+        {
+            if( std::is_integral<acc_type>::value ) {
+                lua_pushinteger( L, static_cast<lua_Integer>(value) );
+            } else {
+                lua_pushnumber( L, static_cast<lua_Number>(value) );
+            }
+        }
+
+        /// 1-based Lua index to offset; size_ if out of range
+        size_t offset( lua_State *L, int idx ) const
+        {
+            int isnum = 0;
+            lua_Integer i = lua_tointegerx( L, idx, &isnum );
+            if( !isnum || i < 1 || static_cast<lua_Unsigned>(i) > size_ ) {
+                return size_;
+            }
+            return static_cast<size_t>(i - 1);
+        }
+
+        static int lcall_index( lua_State *L )
+        {
+            typed_array *self = check( L, 1 );
+            if( lua_type( L, 2 ) == LUA_TNUMBER ) {
+                size_t off = self->offset( L, 2 );
+                if( off < self->size_ ) {
+                    push_value( L, self->data_[off] );
+                } else {
+                    lua_pushnil( L );
+                }
+            } else {
+                lua_getmetatable( L, 1 );
+                lua_pushvalue( L, 2 );
+                lua_rawget( L, -2 );
+            }
+            return 1;
+        }
+
+        static int lcall_newindex( lua_State *L )
+        {
+            typed_array *self = check( L, 1 );
+            size_t off = self->offset( L, 2 );
+            luaL_argcheck( L, off < self->size_, 2, "index out of range" );
+            self->data_[off] = to_value( L, 3 );
+            return 0;
+        }
+
+        static int lcall_size( lua_State *L )
+        {
+            typed_array *self = check( L, 1 );
+            lua_pushinteger( L, static_cast<lua_Integer>(self->size_) );
+            return 1;
+        }
+
+        static int lcall_fill( lua_State *L )
+        {
+            typed_array *self = check( L, 1 );
+            T value = to_value( L, 2 );
+            for( size_t i = 0; i < self->size_; ++i ) {
+                self->data_[i] = value;
+            }
+            lua_settop( L, 1 );
+            return 1;
+        }
+
+        static int lcall_to_table( lua_State *L )
+        {
+            typed_array *self = check( L, 1 );
+            lua_createtable( L, static_cast<int>(self->size_), 0 );
+            for( size_t i = 0; i < self->size_; ++i ) {
+                push_value( L, self->data_[i] );
+                lua_rawseti( L, -2, static_cast<lua_Integer>(i + 1) );
+            }
+            return 1;
+        }
+
+        static int lcall_sum( lua_State *L )
+        {
+            typed_array *self = check( L, 1 );
+            push_acc( L, kernels::get( ).sum( self->data_, self->size_ ) );
+            return 1;
+        }
+
+        static int lcall_min( lua_State *L )
+        {
+            typed_array *self = check( L, 1 );
+            if( self->size_ == 0 ) {
+                return 0;
+            }
+            push_value( L, kernels::get( ).min( self->data_, self->size_ ) );
+            return 1;
+        }
+
+        static int lcall_max( lua_State *L )
+        {
+            typed_array *self = check( L, 1 );
+            if( self->size_ == 0 ) {
+                return 0;
+            }
+            push_value( L, kernels::get( ).max( self->data_, self->size_ ) );
+            return 1;
+        }
+
+        static int lcall_dot( lua_State *L )
+        {
+            typed_array *self  = check( L, 1 );
+            typed_array *other = check( L, 2 );
+            luaL_argcheck( L, self->size_ == other->size_, 2, "size mismatch" );
+            push_acc( L, kernels::get( ).dot( self->data_, other->data_,
+                                              self->size_ ) );
+            return 1;
+        }
+
+        static int lcall_scale( lua_State *L )
+        {
+            typed_array *self = check( L, 1 );
+            kernels::get( ).scale( self->data_, self->size_, to_value( L, 2 ) );
+            lua_settop( L, 1 );
+            return 1;
+        }
+
+        static int lcall_add( lua_State *L )
+        {
+            typed_array *self  = check( L, 1 );
+            typed_array *other = check( L, 2 );
+            luaL_argcheck( L, self->size_ == other->size_, 2, "size mismatch" );
+            T k = lua_isnoneornil( L, 3 ) ? T( 1 ) : to_value( L, 3 );
+            kernels::get( ).axpy( self->data_, other->data_, self->size_, k );
+            lua_settop( L, 1 );
+            return 1;
+        }
+
+        static int lcall_threshold( lua_State *L )
+        {
+            typed_array *self = check( L, 1 );
+            T t  = to_value( L, 2 );
+            T lo = lua_isnoneornil( L, 3 ) ? T( 0 ) : to_value( L, 3 );
+            T hi = lua_isnoneornil( L, 4 ) ? T( 1 ) : to_value( L, 4 );
+            kernels::get( ).threshold( self->data_, self->size_, t, lo, hi );
+            lua_settop( L, 1 );
+            return 1;
+        }
+
+        static int lcall_tostring( lua_State *L )
+        {
+            typed_array *self = check( L, 1 );
+            lua_pushfstring( L, "%s(%d)", name( ),
+                             static_cast<int>(self->size_) );
+            return 1;
+        }
+    };
+
+    typedef typed_array<float>   float32_array;
+    typedef typed_array<double>  float64_array;
+    typedef typed_array<int32_t> int32_array;
+    typedef typed_array<int64_t> int64_array;
+
+    /*
+     * registers all array metatables and returns the constructor table
+     *  typed_array.float32( n | { ... } ), float64, int32, int64
+     *
+     * ls.openlib( "typed_array", &lua::luaopen_typed_array );
+     */
+    inline int luaopen_typed_array( lua_State *L )
+    {
+        state::register_metatable<float32_array>( L );
+        state::register_metatable<float64_array>( L );
+        state::register_metatable<int32_array>( L );
+        state::register_metatable<int64_array>( L );
+        lua_pop( L, 4 );
+
+        static const struct luaL_Reg lib[ ] = {
+            { "float32", &float32_array::lcall_new },
+            { "float64", &float64_array::lcall_new },
+            { "int32",   &int32_array::lcall_new   },
+            { "int64",   &int64_array::lcall_new   },
+            { nullptr,   nullptr                   },
+        };
+
+        lua_createtable( L, 0, 4 );
+        luaL_setfuncs( L, lib, 0 );
+        return 1;
+    }
+
+}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#endif // LUA_TYPED_ARRAY_HPP
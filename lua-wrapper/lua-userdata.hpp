@@ -0,0 +1,573 @@
+#ifndef LUA_USERDATA_HPP
+#define LUA_USERDATA_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+extern "C" {
+#include "lualib.h"
+#include "lauxlib.h"
+#include "lua.h"
+}
+
+#include "lua-type-wrapper.hpp"
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+
+namespace LUA_WRAPPER_TOP_NAMESPACE {
+
+#endif
+
+/*
+ * Userdata layout for metatable types:
+ *
+ *  [ header { identity *, object *, destroy } ][ payload ]
+ *
+ * The payload is either T itself (create) or a handle to a T that lives
+ * elsewhere (push_shared, push_pointer, push_intrusive); object points to
+ * the T in both cases, so check/test do not care which one it is.
+ * destroy releases the payload from __gc.
+ *
+ * The identity is a per-type static, so a type check compares pointers
+ * instead of looking T::name( ) up in the registry. Metatables are also
+ * stored in the registry under the identity address (lua_rawgetp), so
+ * pushes do not hash the name either.
+ *
+ * The header also records the address of the metatable the userdata
+ * got at creation. It is only trusted when that matches the metatable
+ * the userdata has, so a check is lua_getmetatable and two pointer
+ * compares. Userdata made elsewhere (lua_newuserdata and
+ * luaL_setmetatable) fall back to luaL_testudata by T::name( ), as
+ * before. __gc clears the identity, so a finalized object no longer
+ * passes the check.
+ *
+ * register_metatable<T, Bases...> links T's identity to its bases, so
+ * check<Base> also accepts a T: after the direct compare misses, the
+ * base links are walked and the object pointer is upcast on the way.
+ *
+ * create<T> follows T::userdata_policy when T declares one:
+ *  inline_value  - T inside the userdata, destroyed by __gc (default)
+ *  no_finalizer  - T inside the userdata and no __gc at all, so the
+ *                  collector frees it like a string; T must be trivially
+ *                  destructible
+ *
+ * T::user_values (an enum or static const int) sets how many Lua user
+ * values every T userdata carries, 1 by default. Script state hung on
+ * an object goes there instead of a side table keyed by the object;
+ * user_slot<V, N> reads and writes slot N as a V from C++. Lua 5.3 has
+ * exactly one slot per userdata whatever T asks for.
+ */
+namespace lua { namespace userdata {
+
+    struct base_link;
+
+    struct identity {
+        const char      *name;
+        const base_link *bases;     /// { nullptr, nullptr } terminated
+    };
+
+    struct base_link {
+        const identity *id;
+        void         *(*upcast)( void * );
+    };
+
+    template <typename T>
+    struct identity_of {
+
+        static identity &instance( )
+        {
+            static identity id = { T::name( ), nullptr };
+            return id;
+        }
+
+        static const identity *get( )
+        {
+            return &instance( );
+        }
+    };
+
+    template <typename T, typename Base>
+    inline void *upcast( void *p )
+    {
+        return static_cast<Base *>(static_cast<T *>(p));
+    }
+
+    template <typename T, typename ...Bases>
+    struct bases_of {
+        static const base_link *list( )
+        {
+            static const base_link links[ ] = {
+                { identity_of<Bases>::get( ), &upcast<T, Bases> }...,
+                { nullptr, nullptr },
+            };
+            return links;
+        }
+    };
+
+    /// obj (of type from) as a pointer to type to; nullptr if to is not
+    /// from or one of its bases
+    inline void *cast_to( const identity *from, const identity *to,
+                          void *obj )
+    {
+        if( from == to ) {
+            return obj;
+        }
+        for( const base_link *l = from->bases; l && l->id; ++l ) {
+            void *res = cast_to( l->id, to, l->upcast( obj ) );
+            if( res ) {
+                return res;
+            }
+        }
+        return nullptr;
+    }
+
+    typedef void (*destroy_fn)( void *payload );
+
+    struct header {
+        const identity *id;
+        void           *object;
+        destroy_fn      destroy;
+        const void     *metatable;  /// lua_topointer of the metatable
+    };
+
+    /// payload offset; keeps the payload aligned like the block itself
+    static const size_t header_size =
+            ( sizeof(header) + sizeof(void *) * 2 - 1 )
+            & ~( sizeof(void *) * 2 - 1 );
+
+    inline void *payload( header *h )
+    {
+        return reinterpret_cast<char *>(h) + header_size;
+    }
+
+    template <typename P>
+    inline void destroy_payload( void *p )
+    {
+        static_cast<P *>(p)->~P( );
+    }
+
+    inline void destroy_nothing( void * )
+    { }
+
+    /// intrusive_ptr_release is found by ADL, as boost::intrusive_ptr does
+    template <typename T>
+    inline void destroy_intrusive( void *p )
+    {
+        intrusive_ptr_release( *static_cast<T **>(p) );
+    }
+
+    struct inline_value { };
+    struct no_finalizer { };
+
+    template <typename>
+    struct void_type {
+        typedef void type;
+    };
+
+    template <typename T, typename = void>
+    struct policy_of {
+        typedef inline_value type;
+    };
+
+    template <typename T>
+    struct policy_of<T, typename void_type<typename T::userdata_policy>::type> {
+        typedef typename T::userdata_policy type;
+    };
+
+    /// false if register_metatable should not add the default __gc
+    template <typename T>
+    struct needs_finalizer {
+        static const bool value =
+            !std::is_same<typename policy_of<T>::type, no_finalizer>::value;
+    };
+
+    template <typename T, typename = void>
+    struct user_values_of {
+        static const int value = 1;
+    };
+
+    template <typename T>
+    struct user_values_of<T, typename void_type<
+                                decltype( T::user_values )>::type> {
+        static const int value = static_cast<int>(T::user_values);
+    };
+
+    /// header of the userdata at idx; nullptr unless the header names
+    /// the metatable the userdata has
+    inline header *get_header( lua_State *L, int idx )
+    {
+        void *ud = lua_touserdata( L, idx );
+        if( !ud || lua_rawlen( L, idx ) < sizeof(header)
+         || !lua_getmetatable( L, idx ) )
+        {
+            return nullptr;
+        }
+        const void *mt = lua_topointer( L, -1 );
+        lua_pop( L, 1 );
+        header *h = static_cast<header *>(ud);
+        return h->metatable == mt ? h : nullptr;
+    }
+
+    template <typename T>
+    inline T *test( lua_State *L, int idx )
+    {
+        header *h = get_header( L, idx );
+        if( !h ) {
+            /// a plain userdata holding a T, set up by name elsewhere
+            return static_cast<T *>(luaL_testudata( L, idx, T::name( ) ));
+        }
+        const identity *want = identity_of<T>::get( );
+        if( h->id == want ) {
+            return static_cast<T *>(h->object);
+        } else if( h->id && h->id->bases ) {
+            return static_cast<T *>(cast_to( h->id, want, h->object ));
+        }
+        return nullptr;
+    }
+
+    /// raises the same "X expected, got Y" error as luaL_checkudata;
+    /// Y is the __name of the metatable if there is one
+    inline int type_error( lua_State *L, int idx, const char *expected )
+    {
+        const char *actual = luaL_typename( L, idx );
+        if( luaL_getmetafield( L, idx, "__name" ) == LUA_TSTRING ) {
+            actual = lua_tostring( L, -1 );
+        }
+        const char *msg = lua_pushfstring( L, "%s expected, got %s",
+                                           expected, actual );
+        return luaL_argerror( L, idx, msg );
+    }
+
+    template <typename T>
+    inline T *check( lua_State *L, int idx )
+    {
+        T *res = test<T>( L, idx );
+        if( !res ) {
+            type_error( L, idx, T::name( ) );
+        }
+        return res;
+    }
+
+    /// stores the table at idx as T's metatable
+    template <typename T>
+    inline void bind_metatable( lua_State *L, int idx )
+    {
+        lua_pushvalue( L, idx );
+        lua_rawsetp( L, LUA_REGISTRYINDEX, identity_of<T>::get( ) );
+    }
+
+    /// copies the fields of base's metatable that the table at dst does
+    /// not have yet, except __gc, __name and a self __index
+    inline void copy_methods( lua_State *L, int dst, const identity *base )
+    {
+        dst = lua_absindex( L, dst );
+        if( lua_rawgetp( L, LUA_REGISTRYINDEX, base ) != LUA_TTABLE ) {
+            lua_pop( L, 1 );
+            throw std::runtime_error( std::string( "base metatable '" )
+                                    + base->name + "' is not registered" );
+        }
+        const int src = lua_gettop( L );
+        lua_pushnil( L );
+        while( lua_next( L, src ) ) {
+            bool skip = !!lua_rawequal( L, -1, src );
+            if( !skip && lua_type( L, -2 ) == LUA_TSTRING ) {
+                const char *key = lua_tostring( L, -2 );
+                skip = !std::strcmp( key, "__gc" )
+                    || !std::strcmp( key, "__name" );
+            }
+            if( !skip ) {
+                lua_pushvalue( L, -2 );
+                if( lua_rawget( L, dst ) == LUA_TNIL ) {
+                    lua_pushvalue( L, -3 );
+                    lua_pushvalue( L, -3 );
+                    lua_rawset( L, dst );
+                }
+                lua_pop( L, 1 );
+            }
+            lua_pop( L, 1 );
+        }
+        lua_pop( L, 1 );
+    }
+
+    /// links T to Bases and flattens their (already registered)
+    /// metatables into the one at idx
+    template <typename T, typename ...Bases>
+    inline void inherit( lua_State *L, int idx )
+    {
+        const identity *bases[ ] = { identity_of<Bases>::get( )..., nullptr };
+        identity_of<T>::instance( ).bases = bases_of<T, Bases...>::list( );
+        for( const identity **b = bases; *b; ++b ) {
+            copy_methods( L, idx, *b );
+        }
+    }
+
+    /// pushes T's metatable; falls back to the name for tables
+    /// registered elsewhere. false (and nil pushed) if there is none
+    template <typename T>
+    inline bool push_metatable( lua_State *L )
+    {
+        if( lua_rawgetp( L, LUA_REGISTRYINDEX,
+                         identity_of<T>::get( ) ) != LUA_TNIL )
+        {
+            return true;
+        }
+        lua_pop( L, 1 );
+        return luaL_getmetatable( L, T::name( ) ) != LUA_TNIL;
+    }
+
+    /// pushes a userdata with P constructed from args; the header is
+    /// filled in by the caller
+    /// pushes user value n of the userdata at idx and returns its type;
+    /// nil and LUA_TNONE if there is no such slot
+    inline int push_user_value( lua_State *L, int idx, int n )
+    {
+#if LUA_VERSION_NUM >= 504
+        return lua_getiuservalue( L, idx, n );
+#else
+        if( n == 1 && lua_type( L, idx ) == LUA_TUSERDATA ) {
+            return lua_getuservalue( L, idx );
+        }
+        lua_pushnil( L );
+        return LUA_TNONE;
+#endif
+    }
+
+    /// pops a value into user value n of the userdata at idx;
+    /// false if there is no such slot
+    inline bool set_user_value( lua_State *L, int idx, int n )
+    {
+#if LUA_VERSION_NUM >= 504
+        return lua_setiuservalue( L, idx, n ) != 0;
+#else
+        if( n == 1 && lua_type( L, idx ) == LUA_TUSERDATA ) {
+            lua_setuservalue( L, idx );
+            return true;
+        }
+        lua_pop( L, 1 );
+        return false;
+#endif
+    }
+
+    /// user value N of a userdata as a V (any type with types::id_traits)
+    template <typename V, int N>
+    struct user_slot {
+
+        typedef types::id_traits<V> traits;
+
+        /// true if the slot exists and holds something convertible to V
+        static bool is( lua_State *L, int idx )
+        {
+            bool res = push_user_value( L, idx, N ) != LUA_TNONE
+                    && traits::check( L, -1 );
+            lua_pop( L, 1 );
+            return res;
+        }
+
+        /// the slot converted by id_traits; V( ) for a missing slot
+        static V get( lua_State *L, int idx )
+        {
+            push_user_value( L, idx, N );
+            V res = traits::get( L, -1 );
+            lua_pop( L, 1 );
+            return res;
+        }
+
+        static bool set( lua_State *L, int idx, const V &value )
+        {
+            idx = lua_absindex( L, idx );
+            traits::push( L, value );
+            return set_user_value( L, idx, N );
+        }
+    };
+
+    template <typename P, typename ...Args>
+    inline header *create_payload( lua_State *L, int nuv, Args&& ... args )
+    {
+#if LUA_VERSION_NUM >= 504
+        void *ud = lua_newuserdatauv( L, header_size + sizeof(P), nuv );
+#else
+        (void)nuv;
+        void *ud = lua_newuserdata( L, header_size + sizeof(P) );
+#endif
+        header *h  = static_cast<header *>(ud);
+        h->id        = nullptr;
+        h->object    = nullptr;
+        h->destroy   = nullptr;
+        h->metatable = nullptr;
+        try {
+            new (payload( h )) P( std::forward<Args>(args)... );
+        } catch( ... ) {
+            lua_pop( L, 1 );
+            throw;
+        }
+        return h;
+    }
+
+    template <typename T>
+    inline T *finish( lua_State *L, header *h, T *object, destroy_fn destroy )
+    {
+        h->id      = identity_of<T>::get( );
+        h->object  = object;
+        h->destroy = destroy;
+        push_metatable<T>( L );
+        h->metatable = lua_topointer( L, -1 );
+        lua_setmetatable( L, -2 );
+        return object;
+    }
+
+    template <typename T, typename ...Args>
+    inline T *create_with( lua_State *L, inline_value, Args&& ... args )
+    {
+        header *h = create_payload<T>( L, user_values_of<T>::value,
+                                       std::forward<Args>(args)... );
+        return finish<T>( L, h, static_cast<T *>(payload( h )),
+                          &destroy_payload<T> );
+    }
+
+    template <typename T, typename ...Args>
+    inline T *create_with( lua_State *L, no_finalizer, Args&& ... args )
+    {
+        static_assert( std::is_trivially_destructible<T>::value,
+                       "no_finalizer needs a trivially destructible T" );
+        header *h = create_payload<T>( L, user_values_of<T>::value,
+                                       std::forward<Args>(args)... );
+        return finish<T>( L, h, static_cast<T *>(payload( h )),
+                          &destroy_nothing );
+    }
+
+    /// pushes a new userdata holding T( args... ); covers emplace and,
+    /// with an rvalue T, move construction
+    template <typename T, typename ...Args>
+    inline T *create( lua_State *L, Args&& ... args )
+    {
+        return create_with<T>( L, typename policy_of<T>::type( ),
+                               std::forward<Args>(args)... );
+    }
+
+    /// pushes a handle sharing ownership of ptr; nil for an empty ptr
+    template <typename T>
+    inline T *push_shared( lua_State *L, std::shared_ptr<T> ptr )
+    {
+        typedef std::shared_ptr<T> holder;
+        T *object = ptr.get( );
+        if( !object ) {
+            lua_pushnil( L );
+            return nullptr;
+        }
+        header *h = create_payload<holder>( L, user_values_of<T>::value,
+                                            std::move( ptr ) );
+        return finish<T>( L, h, object, &destroy_payload<holder> );
+    }
+
+    /// make_shared<T>( args... ) pushed as a shared handle
+    template <typename T, typename ...Args>
+    inline T *emplace_shared( lua_State *L, Args&& ... args )
+    {
+        return push_shared<T>( L,
+                    std::make_shared<T>( std::forward<Args>(args)... ) );
+    }
+
+    /// pushes a borrowed pointer; the host keeps ptr alive for as long
+    /// as scripts can reach it
+    template <typename T>
+    inline T *push_pointer( lua_State *L, T *ptr )
+    {
+        if( !ptr ) {
+            lua_pushnil( L );
+            return nullptr;
+        }
+        header *h = create_payload<T *>( L, user_values_of<T>::value, ptr );
+        return finish<T>( L, h, ptr, &destroy_nothing );
+    }
+
+    /// pushes an intrusively counted pointer: intrusive_ptr_add_ref( ptr )
+    /// now, intrusive_ptr_release( ptr ) from __gc
+    template <typename T>
+    inline T *push_intrusive( lua_State *L, T *ptr )
+    {
+        if( !ptr ) {
+            lua_pushnil( L );
+            return nullptr;
+        }
+        header *h = create_payload<T *>( L, user_values_of<T>::value, ptr );
+        intrusive_ptr_add_ref( ptr );
+        return finish<T>( L, h, ptr, &destroy_intrusive<T> );
+    }
+
+    /// the shared_ptr behind a push_shared handle; empty for any other
+    /// kind of userdata
+    template <typename T>
+    inline std::shared_ptr<T> get_shared( lua_State *L, int idx )
+    {
+        typedef std::shared_ptr<T> holder;
+        header *h = get_header( L, idx );
+        if( h && h->id == identity_of<T>::get( )
+              && h->destroy == &destroy_payload<holder> )
+        {
+            return *static_cast<holder *>(payload( h ));
+        }
+        return holder( );
+    }
+
+    /// default __gc: releases the payload and clears the header
+    template <typename T>
+    inline int lcall_gc( lua_State *L )
+    {
+        header *h = get_header( L, 1 );
+        if( h && h->id == identity_of<T>::get( ) ) {
+            destroy_fn destroy = h->destroy;
+            h->id      = nullptr;
+            h->object  = nullptr;
+            h->destroy = nullptr;
+            destroy( payload( h ) );
+        }
+        return 0;
+    }
+
+    /// true if the T of h lives in the userdata itself (by value or
+    /// no_finalizer), not behind a handle
+    inline bool owns_object( header *h )
+    {
+        return h->object == payload( h );
+    }
+
+    /// wraps a __gc from T::table( ) (upvalue 1); the header is cleared
+    /// after it ran, so it can still check its argument. The user __gc
+    /// destroys a by-value T, so it only runs for those;
+    /// handles (shared, raw, intrusive) do not own their T and are just
+    /// released here
+    template <typename T>
+    inline int lcall_wrapped_gc( lua_State *L )
+    {
+        header *h = get_header( L, 1 );
+        if( !h || h->id != identity_of<T>::get( ) || owns_object( h ) ) {
+            lua_pushvalue( L, lua_upvalueindex( 1 ) );
+            lua_pushvalue( L, 1 );
+            lua_call( L, 1, 0 );
+            h = get_header( L, 1 );
+        }
+        if( h && h->id == identity_of<T>::get( ) ) {
+            destroy_fn destroy = h->destroy;
+            h->id      = nullptr;
+            h->object  = nullptr;
+            h->destroy = nullptr;
+            if( destroy != &destroy_payload<T> ) {
+                destroy( payload( h ) );
+            }
+        }
+        return 0;
+    }
+
+}}
+
+#ifdef LUA_WRAPPER_TOP_NAMESPACE
+}
+#endif
+
+#endif // LUA_USERDATA_HPP
@@ -1,6 +1,8 @@
 #ifndef LUA_WRAPPER_HPP
 #define LUA_WRAPPER_HPP
 
+#include <chrono>
+#include <cstring>
 #include <stdexcept>
 #include <list>
 
@@ -17,7 +19,11 @@ extern "C" {
 #endif
 
 #include "lua-type-wrapper.hpp"
+#include "lua-container-wrapper.hpp"
+#include "lua-struct-wrapper.hpp"
 #include "lua-objects.hpp"
+#include "lua-boundary-stats.hpp"
+#include "lua-gc.hpp"
 
 #ifdef LUA_WRAPPER_TOP_NAMESPACE
 
@@ -63,6 +69,182 @@ namespace lua {
             value.obj_->push( vm_ );
         }
 
+        struct std_lib {
+            const char     *name;
+            lua_CFunction   func;
+            int             results;
+            bool            lazy;   /// openlibs_lazy defers it
+        };
+
+        static const std_lib *std_libs( size_t &count )
+        {
+            static const std_lib libs[ ] = {
+                 { "base",          &luaopen_base,      0, false }
+                ,{ LUA_STRLIBNAME,  &luaopen_string,    1, false }
+                ,{ LUA_TABLIBNAME,  &luaopen_table,     1, true  }
+                ,{ LUA_MATHLIBNAME, &luaopen_math,      1, true  }
+                ,{ LUA_LOADLIBNAME, &luaopen_package,   1, true  }
+                ,{ LUA_COLIBNAME,   &luaopen_coroutine, 1, true  }
+                ,{ LUA_UTF8LIBNAME, &luaopen_utf8,      1, true  }
+                ,{ LUA_IOLIBNAME,   &luaopen_io,        1, true  }
+                ,{ LUA_OSLIBNAME,   &luaopen_os,        1, true  }
+                ,{ LUA_DBLIBNAME,   &luaopen_debug,     1, true  }
+            };
+            count = sizeof( libs ) / sizeof( libs[0] );
+            return libs;
+        }
+
+        static const std_lib *find_std_lib( const char *name )
+        {
+            size_t count = 0;
+            const std_lib *libs = std_libs( count );
+            for( size_t i = 0; i < count; ++i ) {
+                if( 0 == std::strcmp( libs[i].name, name ) ) {
+                    return &libs[i];
+                }
+            }
+            return nullptr;
+        }
+
+        /*
+         * openlibs_lazy keeps the global names it may still fill in a
+         * table (upvalue 1 of both metamethods): library names and
+         * "require". A name leaves the table when it is opened or
+         * assigned, so nothing comes back once a script or the host has
+         * set it, nil included.
+         */
+
+        /// package.preload entries for the pending libraries, and _G's
+        /// metatable dropped once nothing is pending
+        static void lazy_libs_update( lua_State *L, int pending )
+        {
+            pending = lua_absindex( L, pending );
+            bool empty = true;
+            luaL_getsubtable( L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE );
+            luaL_getsubtable( L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE );
+            const int preload = lua_gettop( L );
+            lua_pushnil( L );
+            while( lua_next( L, pending ) ) {
+                lua_pop( L, 1 );
+                empty = false;
+                const std_lib *lib = find_std_lib( lua_tostring( L, -1 ) );
+                if( !lib ) {
+                    continue;   /// "require"
+                }
+                if( lua_getfield( L, -3, lib->name ) == LUA_TNIL
+                 && lua_getfield( L, -3, lib->name ) == LUA_TNIL )
+                {
+                    lua_pushcfunction( L, lib->func );
+                    lua_setfield( L, -5, lib->name );
+                }
+                lua_settop( L, preload + 1 );
+            }
+            lua_pop( L, 2 );
+            if( empty ) {
+                lua_pushglobaltable( L );
+                lua_pushnil( L );
+                lua_setmetatable( L, -2 );
+                lua_pop( L, 1 );
+            }
+        }
+
+        /// removes name from the pending table; true if it was there
+        static bool lazy_take( lua_State *L, const char *name )
+        {
+            const int pending = lua_upvalueindex( 1 );
+            const bool res = lua_getfield( L, pending, name ) != LUA_TNIL;
+            lua_pop( L, 1 );
+            if( res ) {
+                lua_pushnil( L );
+                lua_setfield( L, pending, name );
+            }
+            return res;
+        }
+
+        /// _G.__index of openlibs_lazy: ( _G, key )
+        static int lcall_lazy_index( lua_State *L )
+        {
+            if( lua_type( L, 2 ) != LUA_TSTRING
+             || !lazy_take( L, lua_tostring( L, 2 ) ) )
+            {
+                lua_pushnil( L );
+                return 1;
+            }
+            const char *key = lua_tostring( L, 2 );
+            if( 0 != std::strcmp( key, "require" ) ) {
+                /// package sets require too; keep what a script put there
+                const bool keep = 0 == std::strcmp( key, LUA_LOADLIBNAME )
+                               && !lazy_take( L, "require" );
+                if( keep ) {
+                    lua_pushliteral( L, "require" );
+                    lua_rawget( L, 1 );
+                }
+                luaL_requiref( L, key, find_std_lib( key )->func, 1 );
+                if( keep ) {
+                    lua_pushliteral( L, "require" );
+                    lua_pushvalue( L, -3 );
+                    lua_rawset( L, 1 );
+                    lua_remove( L, -2 );
+                }
+                lazy_libs_update( L, lua_upvalueindex( 1 ) );
+                return 1;
+            }
+            /// require alone: package gets its global only if pending
+            const bool glb = lazy_take( L, LUA_LOADLIBNAME );
+            luaL_requiref( L, LUA_LOADLIBNAME, &luaopen_package,
+                           glb ? 1 : 0 );
+            lua_pop( L, 1 );
+            lazy_libs_update( L, lua_upvalueindex( 1 ) );
+            lua_pushvalue( L, 2 );
+            lua_rawget( L, 1 );
+            return 1;
+        }
+
+        /// _G.__newindex of openlibs_lazy: ( _G, key, value )
+        static int lcall_lazy_newindex( lua_State *L )
+        {
+            if( lua_type( L, 2 ) == LUA_TSTRING ) {
+                const char *key = lua_tostring( L, 2 );
+                if( lazy_take( L, key ) ) {
+                    const std_lib *lib = find_std_lib( key );
+                    /// and require( key ) does not bring it back either
+                    luaL_getsubtable( L, LUA_REGISTRYINDEX,
+                                      LUA_PRELOAD_TABLE );
+                    if( lib && lua_getfield( L, -1, key ) == LUA_TFUNCTION
+                     && lua_tocfunction( L, -1 ) == lib->func )
+                    {
+                        lua_pushnil( L );
+                        lua_setfield( L, -3, key );
+                    }
+                    lua_settop( L, 3 );
+                    lazy_libs_update( L, lua_upvalueindex( 1 ) );
+                }
+            }
+            lua_settop( L, 3 );
+            lua_rawset( L, 1 );
+            return 0;
+        }
+
+        static void openlibs_lazy_table( lua_State *L, int pending )
+        {
+            pending = lua_absindex( L, pending );
+            luaL_requiref( L, "_G", &luaopen_base, 1 );
+            luaL_requiref( L, LUA_STRLIBNAME, &luaopen_string, 1 );
+            lua_pop( L, 2 );
+
+            lua_pushglobaltable( L );
+            lua_createtable( L, 0, 2 );
+            lua_pushvalue( L, pending );
+            lua_pushcclosure( L, &state::lcall_lazy_index, 1 );
+            lua_setfield( L, -2, "__index" );
+            lua_pushvalue( L, pending );
+            lua_pushcclosure( L, &state::lcall_lazy_newindex, 1 );
+            lua_setfield( L, -2, "__newindex" );
+            lua_setmetatable( L, -2 );
+            lua_pop( L, 1 );
+            lazy_libs_update( L, pending );
+        }
+
     public:
 
         enum state_owning {
@@ -110,30 +292,110 @@ namespace lua {
 
         int openlib( const char *libname )
         {
-            static const struct {
-                std::string     name;
-                lua_CFunction   func;
-                int             results;
-            } libs[ ] = {
-                 { LUA_TABLIBNAME,  &luaopen_table,   1 }
-                ,{ LUA_IOLIBNAME,   &luaopen_io,      1 }
-                ,{ LUA_OSLIBNAME,   &luaopen_os,      1 }
-                ,{ LUA_STRLIBNAME,  &luaopen_string,  1 }
-                ,{ LUA_MATHLIBNAME, &luaopen_math,    1 }
-                ,{ LUA_DBLIBNAME,   &luaopen_debug,   1 }
-                ,{ LUA_LOADLIBNAME, &luaopen_package, 1 }
-                ,{ LUA_UTF8LIBNAME, &luaopen_utf8,    1 }
-                ,{ "base",          &luaopen_base,    0 }
-            };
+            const std_lib *lib = find_std_lib( libname );
+            if( lib ) {
+                return openlib( libname, lib->func, lib->results );
+            }
+            return 0;
+        }
 
-            const size_t libs_count = sizeof( libs ) / sizeof( libs[0] );
+        /*
+         * openlibs for states that touch few libraries: base and string
+         * (string methods need its metatable) are opened, every other
+         * standard library is opened on the first access to its global
+         * through an __index metamethod on _G; `require` opens package.
+         * Until package is opened, require of a standard library name is
+         * answered from package.preload.
+         *
+         * A library name that a script (or the host) assigns, nil
+         * included, is never opened behind its back afterwards, and its
+         * preload entry goes too: `os = nil` strips os for good.
+         *
+         * Pending libraries are not in _G yet: pairs( _G ) and
+         * rawget( _G, "math" ) do not see them until first use.
+         *
+         * The metatable is removed from _G once nothing is left to open.
+         * A script that sets its own metatable on _G before that loses
+         * the libraries still pending; with a strict-mode metatable they
+         * fail as undeclared globals. Use openlibs( ) for such scripts.
+         */
+        void openlibs_lazy( )
+        {
+            size_t count = 0;
+            const std_lib *libs = std_libs( count );
+            std::vector<std::string> names;
+            for( size_t i = 0; i < count; ++i ) {
+                if( libs[i].lazy ) {
+                    names.push_back( libs[i].name );
+                }
+            }
+            openlibs_lazy( names );
+        }
 
-            for( size_t i=0; i<libs_count; ++i ) {
-                if( 0 == libs[i].name.compare( libname ) ) {
-                    return openlib( libname, libs[i].func, libs[i].results );
+        /*
+         * The same with only the listed libraries openable ("table",
+         * "math", "package", "coroutine", "utf8", "io", "os", "debug");
+         * the others stay absent, also from package.preload.
+         * Throws std::runtime_error for any other name.
+         */
+        void openlibs_lazy( const std::vector<std::string> &libs )
+        {
+            for( size_t i = 0; i < libs.size( ); ++i ) {
+                const std_lib *lib = find_std_lib( libs[i].c_str( ) );
+                if( !lib || !lib->lazy ) {
+                    throw std::runtime_error( "'" + libs[i]
+                            + "' is not a lazily opened standard library" );
                 }
             }
-            return 0;
+            lua_createtable( vm_, 0, static_cast<int>(libs.size( )) + 1 );
+            for( size_t i = 0; i < libs.size( ); ++i ) {
+                lua_pushboolean( vm_, 1 );
+                lua_setfield( vm_, -2, libs[i].c_str( ) );
+                if( libs[i] == LUA_LOADLIBNAME ) {
+                    lua_pushboolean( vm_, 1 );
+                    lua_setfield( vm_, -2, "require" );
+                }
+            }
+            openlibs_lazy_table( vm_, -1 );
+            lua_pop( vm_, 1 );
+        }
+
+        /*
+         * Collector mode and parameters (see gc::config); returns the
+         * previous mode. gc_collect and gc_step are timed into a running
+         * gc::telemetry of the state.
+         */
+        gc::collector_mode gc_configure( const gc::config &conf )
+        {
+            return gc::configure( vm_, conf );
+        }
+
+        int gc_collect( )
+        {
+            return gc::telemetry::collect( vm_ );
+        }
+
+        /// kb: the LUA_GCSTEP argument; returns 1 if a cycle finished
+        int gc_step( int kb = 0 )
+        {
+            return gc::telemetry::step( vm_, kb );
+        }
+
+        /// collection work for the idle time between requests
+        gc::step_report gc_step_for( std::chrono::microseconds budget )
+        {
+            return gc::telemetry::step_for( vm_, budget );
+        }
+
+        /// all zero unless built with LUA_WRAPPER_BOUNDARY_STATS
+        boundary::snapshot boundary_stats( )
+        {
+            return boundary::get_snapshot( vm_ );
+        }
+
+        void reset_boundary_stats( )
+        {
+            boundary::reset( vm_ );
         }
 
         lua_State *get_state( )
@@ -194,49 +456,71 @@ namespace lua {
 
         void push( )
         {
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_PUSH );
             lua_pushnil( vm_ );
         }
 
         void push( bool value )
         {
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_PUSH );
             lua_pushboolean( vm_, value ? 1 : 0 );
         }
 
         void push( const char* value )
         {
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_PUSH );
             lua_pushstring( vm_, value );
+            LUA_WRAPPER_BOUNDARY_BYTES( vm_, -1 );
         }
 
         void push( const char* value, size_t len )
         {
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_PUSH );
             lua_pushlstring( vm_, value, len );
+            LUA_WRAPPER_BOUNDARY_BYTES( vm_, -1 );
         }
 
         void push( const std::string& value )
         {
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_PUSH );
             lua_pushlstring( vm_, value.c_str( ), value.size( ) );
+            LUA_WRAPPER_BOUNDARY_BYTES( vm_, -1 );
         }
 
         void push( lua_CFunction value )
         {
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_PUSH );
             lua_pushcfunction( vm_, value );
         }
 
         template<typename T>
         void push( T * value )
         {
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_PUSH );
             lua_pushlightuserdata( vm_, reinterpret_cast<void *>( value ) );
         }
 
         template<typename T>
-        void push( T value )
+        typename std::enable_if<!types::push_by_traits<T>::value>::type
+        push( T value )
         {
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_PUSH );
             lua_pushinteger( vm_, static_cast<T>( value ) );
         }
 
+        template<typename T>
+        typename std::enable_if<types::push_by_traits<T>::value>::type
+        push( const T &value )
+        {
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_PUSH );
+            types::id_traits<T>::push( vm_, value );
+            LUA_WRAPPER_BOUNDARY_BYTES( vm_, -1 );
+        }
+
         template<typename T>
         void push_num( T value )
         {
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_PUSH );
             lua_pushnumber( vm_, static_cast<T>( value ) );
         }
 
@@ -268,6 +552,7 @@ namespace lua {
         template<typename T>
         T get( int id = -1 )
         {
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_GET );
             typedef types::id_traits<T> traits;
             if( !traits::check( vm_, id ) ) {
                 throw std::runtime_error( std::string("bad type '")
@@ -276,16 +561,19 @@ namespace lua {
                         + types::id_to_string( get_type( id ) )
                         + std::string("'") );
             }
+            LUA_WRAPPER_BOUNDARY_BYTES( vm_, id );
             return traits::get( vm_, id );
         }
 
         template<typename T>
         T get_opt( int id = -1, const T& def = T( ) )
         {
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_GET );
             typedef types::id_traits<T> traits;
             if( id > get_top( ) || !traits::check( vm_, id ) ) {
                 return def;
             }
+            LUA_WRAPPER_BOUNDARY_BYTES( vm_, id );
             return traits::get( vm_, id );
         }
 
@@ -315,6 +603,20 @@ namespace lua {
         /// bad do not use this
         objects::base_sptr get_table_deep( unsigned deepness,
                                            int idx = -1, unsigned flags = 0 )
+        {
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_GET_TABLE_DEEP );
+            return table_deep( deepness, idx, flags );
+        }
+
+        objects::base_sptr get_table( int idx = -1, unsigned flags = 0 )
+        {
+            return get_table_deep( 0, idx, flags );
+        }
+
+    private:
+
+        objects::base_sptr table_deep( unsigned deepness, int idx,
+                                       unsigned flags )
         {
             lua_pushvalue( vm_, idx );
             lua_pushnil( vm_ );
@@ -338,11 +640,11 @@ namespace lua {
 
                 } else {
                     first = (get_type( -1 ) == LUA_TTABLE)
-                          ? get_table_deep( deepness - 1, -1, flags )
+                          ? table_deep( deepness - 1, -1, flags )
                           : get_object( -1, flags );
 
                     second = (get_type( -2 ) == LUA_TTABLE)
-                           ? get_table_deep( deepness - 1, -2, flags )
+                           ? table_deep( deepness - 1, -2, flags )
                            : get_object( -2, flags );
                 }
 
@@ -356,10 +658,7 @@ namespace lua {
             return new_table;
         }
 
-        objects::base_sptr get_table( int idx = -1, unsigned flags = 0 )
-        {
-            return get_table_deep( 0, idx, flags );
-        }
+    public:
 
         objects::base_sptr get_object_deep( unsigned deepness,
                                             int idx = -1, unsigned flags = 0 )
@@ -420,8 +719,12 @@ namespace lua {
          *      static const struct luaL_Reg *table( ) // table w.calls
          * };
          *
+         * Bases are registered metatable types T derives from. Their
+         * methods are copied into T's metatable (T's own win), so an
+         * inherited call is still one lookup, and check_metatable<Base>
+         * accepts T. Register the bases first.
          */
-        template <typename T>
+        template <typename T, typename ...Bases>
         static void register_metatable( lua_State *L )
         {
             static const luaL_Reg empty = { NULL, NULL };
@@ -447,13 +750,13 @@ namespace lua {
                 ++p;
             }
 
-            if( !tostr_found ) {
+            if( !tostr_found && sizeof...(Bases) == 0 ) {
                 luaL_Reg tostr = { "__tostring",
                                    &state::lcall_default_tostring<T> };
                 call_table.push_back( tostr );
             }
 
-            if( !gc_found ) {
+            if( !gc_found && userdata::needs_finalizer<T>::value ) {
                 luaL_Reg tostr = { "__gc", &state::lcall_default_gc<T> };
                 call_table.push_back( tostr );
             }
@@ -462,39 +765,40 @@ namespace lua {
 
             objects::metatable_recorder mt( T::name( ), &call_table[0] );
             mt.push( L );
+
+            if( gc_found ) {
+                lua_getfield( L, -1, "__gc" );
+                lua_pushcclosure( L, &userdata::lcall_wrapped_gc<T>, 1 );
+                lua_setfield( L, -2, "__gc" );
+            }
+
+            if( sizeof...(Bases) > 0 ) {
+                userdata::inherit<T, Bases...>( L, -1 );
+                if( !tostr_found ) {
+                    set_default_tostring<T, Bases...>( L );
+                }
+            }
+            userdata::bind_metatable<T>( L, -1 );
         }
 
-        template <typename T>
+        template <typename T, typename ...Bases>
         void register_metatable( )
         {
-            register_metatable<T>( vm_ );
+            register_metatable<T, Bases...>( vm_ );
         }
 
         template <typename T, typename ...Args>
         static T *create_metatable( lua_State *L, Args&& ... args )
         {
-            void *ud = lua_newuserdata( L, sizeof(T) );
-            if( ud ) {
-                T *inst = new (ud) T(std::forward<Args>(args)...);
-                luaL_getmetatable( L, T::name( ) );
-                lua_setmetatable(L, -2);
-                return inst;
-            }
-            return NULL;
+            return userdata::create<T>( L, std::forward<Args>(args)... );
         }
 
 
         template <typename T, typename ...Args>
         static int create_metatable_call( lua_State *L, Args&& ... args )
         {
-            void *ud = lua_newuserdata( L, sizeof(T) );
-            if( ud ) {
-                new (ud) T(std::forward<Args>(args)...);
-                luaL_getmetatable( L, T::name( ) );
-                lua_setmetatable( L, -2 );
-                return 1;
-            }
-            return 0;
+            userdata::create<T>( L, std::forward<Args>(args)... );
+            return 1;
         }
 
         template <typename T, typename ...Args>
@@ -505,6 +809,82 @@ namespace lua {
             return res;
         }
 
+        /// like create_metatable_object, but T is built once and every
+        /// push shares it instead of copying
+        template <typename T, typename ...Args>
+        static objects::base_sptr create_shared_metatable_object( Args&& ... args )
+        {
+            using MT = objects::shared_metatable<T>;
+            objects::base_sptr res( new MT(
+                        std::make_shared<T>( std::forward<Args>(args)... ) ) );
+            return res;
+        }
+
+        /*
+         * Handle userdata: the userdata holds a shared_ptr<T>, a borrowed
+         * T* or an intrusively counted T* instead of T itself.
+         * check_metatable/test_metatable work the same for all of them.
+         */
+        template <typename T>
+        static T *push_shared_metatable( lua_State *L, std::shared_ptr<T> ptr )
+        {
+            return userdata::push_shared<T>( L, std::move( ptr ) );
+        }
+
+        template <typename T>
+        T *push_shared_metatable( std::shared_ptr<T> ptr )
+        {
+            return userdata::push_shared<T>( vm_, std::move( ptr ) );
+        }
+
+        template <typename T, typename ...Args>
+        static T *emplace_shared_metatable( lua_State *L, Args&& ... args )
+        {
+            return userdata::emplace_shared<T>( L,
+                                            std::forward<Args>(args)... );
+        }
+
+        template <typename T, typename ...Args>
+        T *emplace_shared_metatable( Args&& ... args )
+        {
+            return userdata::emplace_shared<T>( vm_,
+                                            std::forward<Args>(args)... );
+        }
+
+        /// the host keeps ptr alive while scripts can reach it
+        template <typename T>
+        static T *push_pointer_metatable( lua_State *L, T *ptr )
+        {
+            return userdata::push_pointer<T>( L, ptr );
+        }
+
+        template <typename T>
+        T *push_pointer_metatable( T *ptr )
+        {
+            return userdata::push_pointer<T>( vm_, ptr );
+        }
+
+        /// intrusive_ptr_add_ref/intrusive_ptr_release are found by ADL
+        template <typename T>
+        static T *push_intrusive_metatable( lua_State *L, T *ptr )
+        {
+            return userdata::push_intrusive<T>( L, ptr );
+        }
+
+        template <typename T>
+        T *push_intrusive_metatable( T *ptr )
+        {
+            return userdata::push_intrusive<T>( vm_, ptr );
+        }
+
+        /// shared_ptr behind a push_shared_metatable handle, empty otherwise
+        template <typename T>
+        static std::shared_ptr<T> get_shared_metatable( lua_State *L,
+                                                        int id = 1 )
+        {
+            return userdata::get_shared<T>( L, id );
+        }
+
         template <typename T, typename ...Args>
         T *create_metatable( Args&& ... args )
         {
@@ -515,13 +895,14 @@ namespace lua {
         template <typename T>
         static T *test_metatable( lua_State *L, int id = 1 )
         {
+            LUA_WRAPPER_BOUNDARY_SCOPE( L, OP_METATABLE_CHECK );
             return lcall_get_instance<T>( L, id );
         }
 
         template <typename T>
         T *test_metatable( int id = 1 )
         {
-            return lcall_get_instance<T>( vm_, id );
+            return test_metatable<T>( vm_, id );
         }
 
         /// check and get metatable.
@@ -529,8 +910,12 @@ namespace lua {
         template <typename T>
         static T *check_metatable( lua_State *L, int id = 1 )
         {
-            void *ud = luaL_checkudata( L, id, T::name( ) );
-            return static_cast<T *>(ud);
+            /// userdata::check, with the error raised outside the scope
+            T *res = test_metatable<T>( L, id );
+            if( !res ) {
+                userdata::type_error( L, id, T::name( ) );
+            }
+            return res;
         }
 
         template <typename T>
@@ -539,13 +924,58 @@ namespace lua {
             return check_metatable<T>( vm_, id );
         }
 
+        /*
+         * User values of a metatable object: T::user_values slots (1 by
+         * default, always 1 on Lua 5.3) that live in the userdata itself.
+         * push_user_value returns the type, LUA_TNONE for a missing slot;
+         * set_user_value returns false for one.
+         */
+        static int push_user_value( lua_State *L, int id, int slot )
+        {
+            return userdata::push_user_value( L, id, slot );
+        }
+
+        int push_user_value( int id, int slot )
+        {
+            return userdata::push_user_value( vm_, id, slot );
+        }
+
+        template <typename V>
+        static V get_user_value( lua_State *L, int id, int slot )
+        {
+            userdata::push_user_value( L, id, slot );
+            V res = types::id_traits<V>::get( L, -1 );
+            lua_pop( L, 1 );
+            return res;
+        }
+
+        template <typename V>
+        V get_user_value( int id, int slot )
+        {
+            return get_user_value<V>( vm_, id, slot );
+        }
+
+        template <typename V>
+        static bool set_user_value( lua_State *L, int id, int slot,
+                                    const V &value )
+        {
+            id = lua_absindex( L, id );
+            types::id_traits<V>::push( L, value );
+            return userdata::set_user_value( L, id, slot );
+        }
+
+        template <typename V>
+        bool set_user_value( int id, int slot, const V &value )
+        {
+            return set_user_value<V>( vm_, id, slot, value );
+        }
+
     private:
 
         template <typename T>
         static T *lcall_get_instance( lua_State *L, int id )
         {
-            void *ud = luaL_testudata( L, id, T::name( ) );
-            return static_cast<T *>(ud);
+            return userdata::test<T>( L, id );
         }
 
         template <typename T>
@@ -558,14 +988,31 @@ namespace lua {
             return 1;
         }
 
+        /// a custom __tostring inherited from a base stays, a default
+        /// one is replaced with T's
+        template <typename T, typename ...Bases>
+        static void set_default_tostring( lua_State *L )
+        {
+            const lua_CFunction base_defaults[ ] = {
+                &state::lcall_default_tostring<Bases>..., nullptr
+            };
+            lua_getfield( L, -1, "__tostring" );
+            lua_CFunction cur = lua_tocfunction( L, -1 );
+            lua_pop( L, 1 );
+            bool replace = ( cur == nullptr );
+            for( const lua_CFunction *f = base_defaults; *f; ++f ) {
+                replace = replace || ( cur == *f );
+            }
+            if( replace ) {
+                lua_pushcfunction( L, &state::lcall_default_tostring<T> );
+                lua_setfield( L, -2, "__tostring" );
+            }
+        }
+
         template <typename T>
         static int lcall_default_gc( lua_State *L )
         {
-            T *inst = lcall_get_instance<T>( L, 1 );
-            if( inst ) {
-                inst->~T( );
-            }
-            return 0;
+            return userdata::lcall_gc<T>( L );
         }
 
     private:
@@ -781,6 +1228,7 @@ namespace lua {
 
         int exec_function( const char* func )
         {
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_EXEC_FUNCTION );
             lua_getglobal( vm_, func );
             int rc = lua_pcall( vm_, 0, LUA_MULTRET, 0 );
             return rc;
@@ -788,6 +1236,7 @@ namespace lua {
 
         int exec_function( const char* func, const objects::base &bo )
         {
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_EXEC_FUNCTION );
             lua_getglobal( vm_, func );
             bo.push( vm_ );
             int rc = lua_pcall( vm_, 1, LUA_MULTRET, 0 );
@@ -846,6 +1295,7 @@ namespace lua {
         int exec_function( const char* func,
                            const std::vector<objects::base_sptr> &bo )
         {
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_EXEC_FUNCTION );
             lua_getglobal( vm_, func );
             push_object_list( bo );
             int rc = lua_pcall( vm_, static_cast<int>(bo.size( )),
@@ -856,7 +1306,7 @@ namespace lua {
         template <typename P0>
         int exec_function( const char* func, P0 p0 )
         {
-
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_EXEC_FUNCTION );
             lua_getglobal( vm_, func );
             push( p0 );
             int rc = lua_pcall( vm_, 1, LUA_MULTRET, 0 );
@@ -867,7 +1317,7 @@ namespace lua {
         int exec_function( const char* func, P0 p0,
                            const std::vector<objects::base_sptr> &bo )
         {
-
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_EXEC_FUNCTION );
             lua_getglobal( vm_, func );
             push( p0 );
             push_object_list( bo );
@@ -879,6 +1329,7 @@ namespace lua {
         template <typename P0, typename P1>
         int exec_function( const char* func, P0 p0, P1 p1 )
         {
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_EXEC_FUNCTION );
             lua_getglobal( vm_, func );
             push( p0 );
             push( p1 );
@@ -890,6 +1341,7 @@ namespace lua {
         int exec_function( const char* func, P0 p0, P1 p1,
                            const std::vector<objects::base_sptr> &bo )
         {
+            LUA_WRAPPER_BOUNDARY_SCOPE( vm_, OP_EXEC_FUNCTION );
             lua_getglobal( vm_, func );
             push( p0 );
             push( p1 );
@@ -1057,6 +1509,7 @@ namespace lua {
         objects::base_sptr object_by_path( lua_State *L, const objects::base *o,
                                            const char *str )
         {
+            LUA_WRAPPER_BOUNDARY_SCOPE( L, OP_OBJECT_BY_PATH );
             typedef path_element_info_list::iterator iter;
 
             objects::base_sptr result;